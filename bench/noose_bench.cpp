@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <x86intrin.h>
+    #define NOOSE_BENCH_TSC
+#endif
+
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Microbenchmarks, run on nestest with fixed iteration counts. Each benchmark
+is repeated and the fastest repetition is reported, which is the most
+stable number between runs on a busy machine. Results are printed as JSON:
+ns_per_op is wall time, cycles_per_op is host cycles from the TSC (null
+where there is none). For the instruction benchmarks an op is one
+instruction, so cycles_per_op is cycles/instruction.
+
+    noose_bench [-rom data/nestest.nes] [-log data/nestest.log] [-repeat 5] [-filter name]
+*/
+
+namespace bench
+{
+    // nestest runs its automated tests from $C000 for as many instructions as the log has lines
+    static const uint16_t NESTEST_START       = 0xC000;
+    static const uint32_t NESTEST_INSTRUCTIONS = 8991;
+
+    static const uint32_t DECODE_PASSES  = 200;
+    static const uint32_t EXECUTE_PASSES = 50;
+    static const uint32_t MEMORY_PASSES  = 200;
+    static const uint32_t LOAD_COUNT     = 200;
+    static const uint32_t VERIFY_COUNT   = 5;
+    static const uint32_t FRAME_WARMUP   = 60;
+    static const uint32_t FRAME_COUNT    = 600;
+
+    struct s_sample
+    {
+        double   seconds;
+        uint64_t tsc;
+    };
+
+    struct s_result
+    {
+        const char* name;
+        const char* unit;
+        uint64_t    ops;
+        s_sample    best;
+        uint64_t    emulated_cycles; // 0 where it doesn't apply
+        int32_t     passed;          // 1 or -1 for benchmarks that check something, 0 otherwise
+    };
+
+    struct s_context
+    {
+        const char*     rom_path;
+        const char*     log_path;
+        noose::rom      rom;
+        uint32_t        repeat;
+        const char*     filter;
+        uint16_t        pcs[NESTEST_INSTRUCTIONS]; // executed by the nestest run, in order
+        uint8_t*        start_state;               // at $C000, before the first instruction
+        uint32_t        state_size;
+        volatile uint32_t sink;                    // keeps results the compiler would otherwise drop
+        bool            first;
+    };
+
+    typedef struct s_sample  sample;
+    typedef struct s_result  result;
+    typedef struct s_context context;
+
+    static inline sample now()
+    {
+        sample s;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        s.seconds = ts.tv_sec + ts.tv_nsec * 1e-9;
+#if defined(NOOSE_BENCH_TSC)
+        s.tsc = __rdtsc();
+#else
+        s.tsc = 0;
+#endif
+        return s;
+    }
+
+    static inline sample elapsed(const sample& from)
+    {
+        sample to = now();
+        to.seconds -= from.seconds;
+        to.tsc     -= from.tsc;
+        return to;
+    }
+
+    static void keep_best(sample* best, const sample& s)
+    {
+        if (best->seconds == 0.0 || s.seconds < best->seconds)
+        {
+            *best = s;
+        }
+    }
+
+    static void print_result(context* ctx, const result& r)
+    {
+        double ns_per_op = r.best.seconds * 1e9 / r.ops;
+
+        printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, \"ns_per_op\": %.3f, ",
+            ctx->first ? "" : ",", r.name, r.unit, (unsigned long long) r.ops, r.best.seconds, ns_per_op);
+
+#if defined(NOOSE_BENCH_TSC)
+        printf("\"cycles_per_op\": %.2f", (double) r.best.tsc / r.ops);
+#else
+        printf("\"cycles_per_op\": null");
+#endif
+
+        if (r.emulated_cycles)
+        {
+            printf(", \"emulated_cycles_per_op\": %.2f", (double) r.emulated_cycles / r.ops);
+        }
+
+        if (r.passed)
+        {
+            printf(", \"passed\": %s", r.passed > 0 ? "true" : "false");
+        }
+
+        if (strcmp(r.unit, "frame") == 0)
+        {
+            printf(", \"frames_per_second\": %.1f", r.ops / r.best.seconds);
+        }
+
+        printf("}");
+        ctx->first = false;
+    }
+
+    static bool is_selected(const context* ctx, const char* name)
+    {
+        return !ctx->filter || strstr(name, ctx->filter);
+    }
+
+    static machine* create_nestest_machine(context* ctx)
+    {
+        noose::machine* m = noose::create_machine(&ctx->rom);
+        if (m)
+        {
+            noose::set_audio_rate(m, 0);
+            noose::load_state(m, ctx->start_state, ctx->state_size);
+        }
+        return m;
+    }
+
+    // Runs nestest once to record the executed pcs and the state to restart from
+    static bool prepare(context* ctx)
+    {
+        noose::machine* m = noose::create_machine(&ctx->rom);
+        if (!m)
+        {
+            return false;
+        }
+
+        noose::cpu::set_status(m, 0x24);
+        m->pc = NESTEST_START;
+
+        ctx->state_size  = noose::get_state_size();
+        ctx->start_state = (uint8_t*) malloc(ctx->state_size);
+        noose::save_state(m, ctx->start_state, ctx->state_size);
+
+        for (uint32_t i = 0; i < NESTEST_INSTRUCTIONS; ++i)
+        {
+            ctx->pcs[i] = m->pc;
+            noose::cpu::execute(m, noose::cpu::get_next_instruction(m));
+        }
+
+        noose::destroy_machine(m);
+        return true;
+    }
+
+    static void run_decode(context* ctx)
+    {
+        noose::machine* m = create_nestest_machine(ctx);
+        result          r = { "decode", "instruction", (uint64_t) DECODE_PASSES * NESTEST_INSTRUCTIONS, {}, 0, 0 };
+        uint32_t        acc = 0;
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample start = now();
+            for (uint32_t pass = 0; pass < DECODE_PASSES; ++pass)
+            {
+                for (uint32_t i = 0; i < NESTEST_INSTRUCTIONS; ++i)
+                {
+                    m->pc = ctx->pcs[i];
+                    acc  += noose::cpu::get_next_instruction(m).cycle_count;
+                }
+            }
+            keep_best(&r.best, elapsed(start));
+        }
+
+        ctx->sink = acc;
+        print_result(ctx, r);
+        noose::destroy_machine(m);
+    }
+
+    static void run_execute(context* ctx)
+    {
+        noose::machine* m = create_nestest_machine(ctx);
+        result          r = { "execute", "instruction", (uint64_t) EXECUTE_PASSES * NESTEST_INSTRUCTIONS, {}, 0, 0 };
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample total = {};
+            for (uint32_t pass = 0; pass < EXECUTE_PASSES; ++pass)
+            {
+                // Restarting isn't part of the measurement
+                noose::load_state(m, ctx->start_state, ctx->state_size);
+                uint64_t cycles = m->cycles;
+
+                sample start = now();
+                for (uint32_t i = 0; i < NESTEST_INSTRUCTIONS; ++i)
+                {
+                    noose::cpu::execute(m, noose::cpu::get_next_instruction(m));
+                }
+                sample s = elapsed(start);
+
+                total.seconds += s.seconds;
+                total.tsc     += s.tsc;
+                r.emulated_cycles = (m->cycles - cycles) * EXECUTE_PASSES;
+            }
+            keep_best(&r.best, total);
+        }
+
+        print_result(ctx, r);
+        noose::destroy_machine(m);
+    }
+
+    // Sweeps [from, from + size) one byte at a time
+    static void run_read_memory(context* ctx, const char* name, uint16_t from, uint32_t size)
+    {
+        noose::machine* m = create_nestest_machine(ctx);
+        result          r = { name, "access", (uint64_t) MEMORY_PASSES * size, {}, 0, 0 };
+        uint32_t        acc = 0;
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample start = now();
+            for (uint32_t pass = 0; pass < MEMORY_PASSES; ++pass)
+            {
+                for (uint32_t i = 0; i < size; ++i)
+                {
+                    acc += noose::cpu::read_memory(m, (uint16_t) (from + i));
+                }
+            }
+            keep_best(&r.best, elapsed(start));
+        }
+
+        ctx->sink = acc;
+        print_result(ctx, r);
+        noose::destroy_machine(m);
+    }
+
+    static void run_write_memory(context* ctx, const char* name, uint16_t from, uint32_t size)
+    {
+        noose::machine* m = create_nestest_machine(ctx);
+        result          r = { name, "access", (uint64_t) MEMORY_PASSES * size, {}, 0, 0 };
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample start = now();
+            for (uint32_t pass = 0; pass < MEMORY_PASSES; ++pass)
+            {
+                for (uint32_t i = 0; i < size; ++i)
+                {
+                    noose::cpu::write_memory(m, (uint16_t) (from + i), (uint8_t) (pass + i));
+                }
+            }
+            keep_best(&r.best, elapsed(start));
+        }
+
+        ctx->sink = m->ram[ctx->sink & 0x7ff];
+        print_result(ctx, r);
+        noose::destroy_machine(m);
+    }
+
+    static void run_load_rom(context* ctx, const char* name, noose::load_mode mode)
+    {
+        result r = { name, "load", LOAD_COUNT, {}, 0, 0 };
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample start = now();
+            for (uint32_t i = 0; i < LOAD_COUNT; ++i)
+            {
+                noose::rom rom = {};
+                if (!noose::load_rom(ctx->rom_path, &rom, mode))
+                {
+                    return;
+                }
+                ctx->sink = rom.data_prg[0];
+                noose::reset_rom(&rom);
+            }
+            keep_best(&r.best, elapsed(start));
+        }
+
+        print_result(ctx, r);
+    }
+
+    // verify_rom reports divergences on stdout, which would end up in the JSON
+    static int silence_stdout()
+    {
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        int null  = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        return saved;
+    }
+
+    static void restore_stdout(int saved)
+    {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+
+    // Timed whether or not the CPU gets through the log, the result is reported alongside
+    static void run_verify_rom(context* ctx)
+    {
+        result r      = { "verify_rom", "run", VERIFY_COUNT, {}, 0, 0 };
+        bool   passed = true;
+
+        int saved = silence_stdout();
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            sample start = now();
+            for (uint32_t i = 0; i < VERIFY_COUNT; ++i)
+            {
+                passed &= noose::verify_rom(&ctx->rom, ctx->log_path, noose::VERIFY_QUIET);
+            }
+            keep_best(&r.best, elapsed(start));
+        }
+        restore_stdout(saved);
+
+        r.passed = passed ? 1 : -1;
+        print_result(ctx, r);
+    }
+
+    // The whole system from power-on, with the CPU running blocks (and the JIT if built in)
+    static void run_frames(context* ctx)
+    {
+        result r = { "frame", "frame", FRAME_COUNT, {}, 0, 0 };
+
+        for (uint32_t rep = 0; rep < ctx->repeat; ++rep)
+        {
+            noose::machine* m = noose::create_machine(&ctx->rom);
+            if (!m)
+            {
+                return;
+            }
+            noose::set_audio_rate(m, 0);
+
+            for (uint32_t i = 0; i < FRAME_WARMUP; ++i)
+            {
+                noose::run_until_frame(m);
+            }
+
+            uint64_t cycles = m->cycles;
+            sample   start  = now();
+            for (uint32_t i = 0; i < FRAME_COUNT; ++i)
+            {
+                noose::run_until_frame(m);
+            }
+            keep_best(&r.best, elapsed(start));
+
+            r.emulated_cycles = m->cycles - cycles;
+            noose::destroy_machine(m);
+        }
+
+        print_result(ctx, r);
+    }
+
+    static const char* get_option(int argc, char const *argv[], const char* option, const char* fallback)
+    {
+        for (int i = 1; i + 1 < argc; ++i)
+        {
+            if (strcmp(argv[i], option) == 0)
+            {
+                return argv[i + 1];
+            }
+        }
+        return fallback;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    static bench::context ctx;
+
+    ctx.rom_path = bench::get_option(argc, argv, "-rom", "data/nestest.nes");
+    ctx.log_path = bench::get_option(argc, argv, "-log", "data/nestest.log");
+    ctx.repeat   = (uint32_t) atoi(bench::get_option(argc, argv, "-repeat", "5"));
+    ctx.filter   = bench::get_option(argc, argv, "-filter", 0);
+    ctx.first    = true;
+
+    if (ctx.repeat == 0)
+    {
+        ctx.repeat = 1;
+    }
+
+    if (!noose::load_rom(ctx.rom_path, &ctx.rom) || !bench::prepare(&ctx))
+    {
+        fprintf(stderr, "[ERROR] %s\n", noose::has_errors() ? noose::last_error() : "Unable to load ROM");
+        return 1;
+    }
+
+    printf("{\n  \"rom\": \"%s\",\n  \"repeat\": %u,\n", ctx.rom_path, ctx.repeat);
+
+#if defined(NOOSE_JIT_ENABLED)
+    printf("  \"jit\": true,\n");
+#else
+    printf("  \"jit\": false,\n");
+#endif
+
+#if defined(NOOSE_CPU_THREADED)
+    printf("  \"threaded\": true,\n");
+#else
+    printf("  \"threaded\": false,\n");
+#endif
+
+    printf("  \"benchmarks\": [");
+
+    if (bench::is_selected(&ctx, "decode"))          bench::run_decode(&ctx);
+    if (bench::is_selected(&ctx, "execute"))         bench::run_execute(&ctx);
+    if (bench::is_selected(&ctx, "read_memory_ram")) bench::run_read_memory(&ctx, "read_memory_ram", 0x0000, 0x2000);
+    if (bench::is_selected(&ctx, "read_memory_prg")) bench::run_read_memory(&ctx, "read_memory_prg", 0x8000, 0x8000);
+    if (bench::is_selected(&ctx, "write_memory_ram")) bench::run_write_memory(&ctx, "write_memory_ram", 0x0000, 0x0800);
+    if (bench::is_selected(&ctx, "load_rom_copy"))   bench::run_load_rom(&ctx, "load_rom_copy", noose::LOAD_MODE_COPY);
+    if (bench::is_selected(&ctx, "load_rom_mmap"))   bench::run_load_rom(&ctx, "load_rom_mmap", noose::LOAD_MODE_MMAP);
+    if (bench::is_selected(&ctx, "verify_rom"))      bench::run_verify_rom(&ctx);
+    if (bench::is_selected(&ctx, "frame"))           bench::run_frames(&ctx);
+
+    printf("\n  ]\n}\n");
+
+    noose::reset_rom(&ctx.rom);
+    free(ctx.start_state);
+    return 0;
+}
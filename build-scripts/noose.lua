@@ -2,6 +2,22 @@ NOOSE_ROOT_PATH  = (path.getabsolute("") .. "/") .. "../"
 NOOSE_BUILD_PATH = path.join(NOOSE_ROOT_PATH,"build")
 NOOSE_BIN_PATH   = path.join(NOOSE_ROOT_PATH,"bin")
 NOOSE_SRC_PATH   = path.join(NOOSE_ROOT_PATH,"src")
+NOOSE_BENCH_PATH = path.join(NOOSE_ROOT_PATH,"bench")
+
+newoption {
+    trigger     = "cpu-threaded",
+    description = "Use the direct-threaded (computed goto) interpreter for cpu::execute",
+}
+
+newoption {
+    trigger     = "no-jit",
+    description = "Build without the x86-64 dynamic recompiler",
+}
+
+newoption {
+    trigger     = "profile",
+    description = "Count opcodes, executed pcs and memory accesses for -profile",
+}
 
 solution "noose"
     language       ( "C++" )
@@ -12,6 +28,19 @@ solution "noose"
     flags          { "NoPCH" } -- "FatalWarnings",
     buildoptions   { "-Wno-switch"}
 
+    if _OPTIONS["cpu-threaded"] then
+        defines { "NOOSE_CPU_THREADED" }
+    end
+
+    -- Only used on x86-64 Linux, other targets always interpret
+    if not _OPTIONS["no-jit"] then
+        defines { "NOOSE_JIT" }
+    end
+
+    if _OPTIONS["profile"] then
+        defines { "NOOSE_PROFILE" }
+    end
+
     configuration "Debug"
         defines { "DEBUG" }
         flags   { "Symbols" }
@@ -27,6 +56,18 @@ project "noose"
     targetdir   ( NOOSE_BIN_PATH )
     files       { path.join(NOOSE_SRC_PATH, "**.cpp") }
     includedirs { NOOSE_SRC_PATH }
+    links       { "pthread" }
+
+-- Microbenchmarks, run from the repository root: bin/noose_bench > results.json
+project "noose_bench"
+    objdir      ( path.join(NOOSE_BUILD_PATH, "bench") )
+    kind        ( "ConsoleApp" )
+    targetname  ( "noose_bench" )
+    targetdir   ( NOOSE_BIN_PATH )
+    files       { path.join(NOOSE_SRC_PATH, "**.cpp"), path.join(NOOSE_BENCH_PATH, "**.cpp") }
+    excludes    { path.join(NOOSE_SRC_PATH, "main.cpp") }
+    includedirs { NOOSE_SRC_PATH }
+    links       { "pthread" }
 
 print("ello govenor")
 print(NOOSE_ROOT_PATH)
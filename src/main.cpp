@@ -13,12 +13,40 @@ namespace app
         {
             NO_COMMAND = 0,
             VERIFY_CPU,
-            PRINT_HEADER
+            PRINT_HEADER,
+            SCAN_ROMS,
+            RUN_BATCH,
+            VERIFY_PPU,
+            RECORD_WAV,
+            RECORD_MOVIE,
+            PLAY_MOVIE,
+            RECORD_TRACE,
+            FORMAT_TRACE,
+            RECORD_PROFILE,
+            VERIFY_BLOCKS,
         } id;
 
         struct payload
         {
             char verify_log_path[256];
+            uint32_t verify_flags;
+            char scan_path[256];
+            noose::scan_format scan_format;
+            bool     scan_hash;
+            char batch_manifest_path[256];
+            uint32_t thread_count;
+            uint32_t line_count;
+            char wav_path[256];
+            uint32_t frame_count;
+            uint32_t sample_rate;
+            char movie_path[256];
+            uint32_t seed;
+            uint32_t run_ahead;
+            char trace_path[256];
+            uint32_t entry_count;
+            noose::trace_format trace_format;
+            char profile_path[256];
+            noose::profile_format profile_format;
         } data;
 
         command* next;
@@ -33,6 +61,30 @@ namespace app
         return cmd;
     }
 
+    bool has_flag(int argc, char const *argv[], const char* flag)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], flag) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* get_option(int argc, char const *argv[], const char* option)
+    {
+        for (int i = 1; i + 1 < argc; ++i)
+        {
+            if (strcmp(argv[i], option) == 0)
+            {
+                return argv[i+1];
+            }
+        }
+        return 0;
+    }
+
     command* get_commands(int argc, char const *argv[])
     {
         command* last_cmd = make_command(command::NO_COMMAND, 0);
@@ -49,11 +101,94 @@ namespace app
                     const char* verify_path = argv[i+1];
                     size_t verify_path_len = strlen(verify_path);
                     memcpy(last_cmd->data.verify_log_path, verify_path, verify_path_len);
+                    last_cmd->data.verify_flags = has_flag(argc, argv, "-quiet") ? noose::VERIFY_QUIET : noose::VERIFY_DEFAULT;
                 }
                 else if (strcmp(arg, "-print_header") == 0)
                 {
                     last_cmd = make_command(command::PRINT_HEADER, last_cmd);
                 }
+                else if (strcmp(arg, "-scan") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::SCAN_ROMS, last_cmd);
+                    const char* scan_path = argv[i+1];
+                    const char* format    = get_option(argc, argv, "-format");
+                    const char* threads   = get_option(argc, argv, "-threads");
+                    strncpy(last_cmd->data.scan_path, scan_path, sizeof(last_cmd->data.scan_path) - 1);
+                    last_cmd->data.scan_format  = format && strcmp(format, "json") == 0 ? noose::SCAN_FORMAT_JSON : noose::SCAN_FORMAT_CSV;
+                    last_cmd->data.scan_hash    = has_flag(argc, argv, "-hash");
+                    last_cmd->data.thread_count = threads ? atoi(threads) : 0;
+                }
+                else if (strcmp(arg, "-batch") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::RUN_BATCH, last_cmd);
+                    const char* threads = get_option(argc, argv, "-threads");
+                    strncpy(last_cmd->data.batch_manifest_path, argv[i+1], sizeof(last_cmd->data.batch_manifest_path) - 1);
+                    last_cmd->data.thread_count = threads ? atoi(threads) : 0;
+                }
+                else if (strcmp(arg, "-verify_ppu") == 0)
+                {
+                    last_cmd = make_command(command::VERIFY_PPU, last_cmd);
+                    const char* lines = get_option(argc, argv, "-lines");
+                    last_cmd->data.line_count = lines ? atoi(lines) : 100000;
+                }
+                else if (strcmp(arg, "-wav") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::RECORD_WAV, last_cmd);
+                    const char* frames = get_option(argc, argv, "-frames");
+                    const char* rate   = get_option(argc, argv, "-rate");
+                    strncpy(last_cmd->data.wav_path, argv[i+1], sizeof(last_cmd->data.wav_path) - 1);
+                    last_cmd->data.frame_count = frames ? atoi(frames) : 600;
+                    last_cmd->data.sample_rate = rate ? atoi(rate) : 44100;
+                }
+                else if (strcmp(arg, "-record") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::RECORD_MOVIE, last_cmd);
+                    const char* frames = get_option(argc, argv, "-frames");
+                    const char* seed   = get_option(argc, argv, "-seed");
+                    strncpy(last_cmd->data.movie_path, argv[i+1], sizeof(last_cmd->data.movie_path) - 1);
+                    last_cmd->data.frame_count = frames ? atoi(frames) : 600;
+                    last_cmd->data.seed        = seed ? atoi(seed) : 1;
+                }
+                else if (strcmp(arg, "-play") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::PLAY_MOVIE, last_cmd);
+                    const char* run_ahead = get_option(argc, argv, "-run_ahead");
+                    strncpy(last_cmd->data.movie_path, argv[i+1], sizeof(last_cmd->data.movie_path) - 1);
+                    last_cmd->data.run_ahead = run_ahead ? atoi(run_ahead) : 0;
+                }
+                else if (strcmp(arg, "-trace") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::RECORD_TRACE, last_cmd);
+                    const char* frames  = get_option(argc, argv, "-frames");
+                    const char* entries = get_option(argc, argv, "-entries");
+                    strncpy(last_cmd->data.trace_path, argv[i+1], sizeof(last_cmd->data.trace_path) - 1);
+                    last_cmd->data.frame_count = frames ? atoi(frames) : 600;
+                    last_cmd->data.entry_count = entries ? atoi(entries) : 1 << 20;
+                }
+                else if (strcmp(arg, "-trace_format") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::FORMAT_TRACE, last_cmd);
+                    const char* format = get_option(argc, argv, "-format");
+                    const char* last   = get_option(argc, argv, "-last");
+                    strncpy(last_cmd->data.trace_path, argv[i+1], sizeof(last_cmd->data.trace_path) - 1);
+                    last_cmd->data.trace_format = format && strcmp(format, "json") == 0 ? noose::TRACE_FORMAT_JSON : noose::TRACE_FORMAT_TEXT;
+                    last_cmd->data.entry_count  = last ? atoi(last) : 0;
+                }
+                else if (strcmp(arg, "-verify_blocks") == 0)
+                {
+                    last_cmd = make_command(command::VERIFY_BLOCKS, last_cmd);
+                    const char* frames = get_option(argc, argv, "-frames");
+                    last_cmd->data.frame_count = frames ? atoi(frames) : 600;
+                }
+                else if (strcmp(arg, "-profile") == 0 && i + 1 < argc)
+                {
+                    last_cmd = make_command(command::RECORD_PROFILE, last_cmd);
+                    const char* frames = get_option(argc, argv, "-frames");
+                    const char* format = get_option(argc, argv, "-format");
+                    strncpy(last_cmd->data.profile_path, argv[i+1], sizeof(last_cmd->data.profile_path) - 1);
+                    last_cmd->data.frame_count    = frames ? atoi(frames) : 600;
+                    last_cmd->data.profile_format = format && strcmp(format, "folded") == 0 ? noose::PROFILE_FORMAT_FOLDED : noose::PROFILE_FORMAT_CSV;
+                }
             }
         }
 
@@ -71,16 +206,25 @@ namespace app
         }
     }
 
-    void process_commands(command* cmd, noose::rom rom)
+    void process_commands(command* cmd, const noose::rom* rom)
     {
         command* it = cmd;
         while(it)
         {
+            if (!rom && (it->id == command::VERIFY_CPU || it->id == command::PRINT_HEADER || it->id == command::RECORD_WAV ||
+                         it->id == command::RECORD_MOVIE || it->id == command::PLAY_MOVIE || it->id == command::RECORD_TRACE ||
+                         it->id == command::RECORD_PROFILE || it->id == command::VERIFY_BLOCKS))
+            {
+                noose::error("Command needs a ROM");
+                it = it->next;
+                continue;
+            }
+
             switch(it->id)
             {
                 case command::VERIFY_CPU:
                     noose::debug("CMD :: Verifying ROM");
-                    if (!noose::verify_rom(&rom, cmd->data.verify_log_path))
+                    if (!noose::verify_rom(rom, it->data.verify_log_path, it->data.verify_flags))
                     {
                         noose::error("Verification failed, reason:");
                         while(noose::has_errors())
@@ -91,11 +235,75 @@ namespace app
                     break;
                 case command::PRINT_HEADER:
                     noose::debug("CMD :: Print Header");
-                    noose::print_header(rom.header);
+                    noose::print_header(rom->header);
+                    break;
+                case command::SCAN_ROMS:
+                    noose::scan_roms(it->data.scan_path, it->data.scan_format, it->data.scan_hash, it->data.thread_count);
+                    break;
+                case command::RUN_BATCH:
+                    noose::run_batch(it->data.batch_manifest_path, it->data.thread_count);
+                    break;
+                case command::VERIFY_PPU:
+                    noose::debug("CMD :: Verifying PPU compositor");
+                    if (!noose::verify_compose(it->data.line_count))
+                    {
+                        noose::error("Verification failed");
+                    }
+                    break;
+                case command::RECORD_WAV:
+                    noose::debug("CMD :: Recording audio");
+                    if (!noose::record_wav(rom, it->data.wav_path, it->data.frame_count, it->data.sample_rate))
+                    {
+                        noose::error("Recording failed");
+                    }
+                    break;
+                case command::RECORD_MOVIE:
+                    noose::debug("CMD :: Recording movie");
+                    if (!noose::record_movie(rom, it->data.movie_path, it->data.frame_count, it->data.seed))
+                    {
+                        noose::error("Recording failed");
+                    }
+                    break;
+                case command::PLAY_MOVIE:
+                    noose::debug("CMD :: Playing movie");
+                    if (!noose::play_movie(rom, it->data.movie_path, it->data.run_ahead))
+                    {
+                        noose::error("Playback failed");
+                    }
+                    break;
+                case command::RECORD_TRACE:
+                    noose::debug("CMD :: Tracing");
+                    if (!noose::record_trace(rom, it->data.trace_path, it->data.frame_count, it->data.entry_count))
+                    {
+                        noose::error("Tracing failed");
+                    }
+                    break;
+                case command::FORMAT_TRACE:
+                    noose::format_trace(it->data.trace_path, it->data.trace_format, it->data.entry_count);
+                    break;
+                case command::RECORD_PROFILE:
+                    noose::debug("CMD :: Profiling");
+                    if (!noose::record_profile(rom, it->data.profile_path, it->data.frame_count, it->data.profile_format))
+                    {
+                        noose::error("Profiling failed");
+                    }
+                    break;
+                case command::VERIFY_BLOCKS:
+                    noose::debug("CMD :: Verifying blocks");
+                    if (!noose::verify_blocks(rom, it->data.frame_count))
+                    {
+                        noose::error("Verification failed");
+                    }
                     break;
                 default:break;
             }
 
+            // Reasons queued by whatever failed above
+            while(noose::has_errors())
+            {
+                noose::error(noose::last_error());
+            }
+
             it = it->next;
         }
     }
@@ -110,19 +318,27 @@ int main(int argc, char const *argv[])
         return -1;
     }
 
+    noose::load_mode load_mode = app::has_flag(argc, argv, "-mmap") ? noose::LOAD_MODE_MMAP : noose::LOAD_MODE_COPY;
+
+    // The ROM is optional, commands like -scan work on their own
     noose::rom rom = {};
-    if (!noose::load_rom(argv[1], &rom))
+    bool rom_loaded = false;
+    if (argv[1][0] != '-')
     {
-        noose::error("Unable to load rom, reason:");
-        while(noose::has_errors())
+        rom_loaded = noose::load_rom(argv[1], &rom, load_mode);
+        if (!rom_loaded)
         {
-            noose::error(noose::last_error());
+            noose::error("Unable to load rom, reason:");
+            while(noose::has_errors())
+            {
+                noose::error(noose::last_error());
+            }
         }
     }
 
     app::command* cmd = app::get_commands(argc, argv);
 
-    app::process_commands(cmd, rom);
+    app::process_commands(cmd, rom_loaded ? &rom : 0);
 
     noose::reset_rom(&rom);
 
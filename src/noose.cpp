@@ -2,18 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "noose.h"
 
 #include "noose_internal.h"
 
-static struct s_pgm_error
+// Errors are queued per thread, so machines running on worker threads
+// don't interleave their messages
+static __thread struct s_pgm_error
 {
     char msg[512];
     s_pgm_error* next;
 } error_head = {};
 
-static void add_error(const char* error_str)
+void noose::add_error(const char* error_str)
 {
     s_pgm_error* error = (s_pgm_error*) malloc(sizeof(s_pgm_error));
 
@@ -33,6 +39,48 @@ static void add_error(const char* error_str)
     error->msg[error_str_size] = '\0';
 }
 
+// NES 2.0 size: an MSB nibble of $F switches the LSB byte to 2^E * (MM * 2 + 1)
+static uint32_t decode_nes_2_0_size(uint8_t lsb, uint8_t msb, uint32_t unit)
+{
+    if (msb != 0x0f)
+    {
+        return (((uint32_t) msb << 8) | lsb) * unit;
+    }
+
+    uint32_t exponent   = lsb >> 2;
+    uint32_t multiplier = (lsb & 0x03) * 2 + 1;
+    if (exponent >= 30)
+    {
+        return 0xffffffff; // no file that big fits in memory, let the truncation check reject it
+    }
+    return ((uint32_t) 1 << exponent) * multiplier;
+}
+
+noose::header_info noose::decode_header(const noose::header& h)
+{
+    noose::header_info info;
+    info.nes_2_0   = noose::header::nes_2_0_bits(h) == 0x02;
+    info.mapper_id = noose::header::mapper_number_lower(h);
+
+    if (info.nes_2_0)
+    {
+        info.mapper_id |= (noose::header::mapper_number_higher(h) << 4) | ((h.flags_8 & 0x0f) << 8);
+        info.size_prg   = decode_nes_2_0_size(h.page_count_prg, h.flags_9 & 0x0f, BLOCK_SIZE_PRG);
+        info.size_chr   = decode_nes_2_0_size(h.page_count_chr, h.flags_9 >> 4, BLOCK_SIZE_CHR);
+        return info;
+    }
+
+    // Old dumps have garbage from byte 7 on, only trust flags 7 when the padding is clean
+    if (h.unused[1] == 0 && h.unused[2] == 0 && h.unused[3] == 0 && h.unused[4] == 0)
+    {
+        info.mapper_id |= noose::header::mapper_number_higher(h) << 4;
+    }
+
+    info.size_prg = h.page_count_prg * BLOCK_SIZE_PRG;
+    info.size_chr = h.page_count_chr * BLOCK_SIZE_CHR;
+    return info;
+}
+
 static bool has_magic_number(noose::header header)
 {
     const char magic_number[] = {'N','E', 'S', 0x1A};
@@ -54,7 +102,7 @@ static bool load_file(const char* path, uint8_t** buffer_out, uint32_t* buffer_s
 
     if (f == NULL)
     {
-        add_error("Unable to open file");
+        noose::add_error("Unable to open file");
         return false;
     }
 
@@ -65,7 +113,7 @@ static bool load_file(const char* path, uint8_t** buffer_out, uint32_t* buffer_s
     *buffer_size = f_size;
     if (fread(*buffer_out, sizeof(uint8_t), f_size, f) != f_size)
     {
-        add_error("Couldn't read all bytes in ROM");
+        noose::add_error("Couldn't read all bytes in ROM");
         return false;
     }
     fclose(f);
@@ -73,84 +121,179 @@ static bool load_file(const char* path, uint8_t** buffer_out, uint32_t* buffer_s
     return true;
 }
 
-bool noose::load_rom(const char* path, noose::rom* output)
+static bool map_file(const char* path, uint8_t** buffer_out, uint32_t* buffer_size)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        noose::add_error("Unable to open file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        noose::add_error("Unable to stat file");
+        close(fd);
+        return false;
+    }
+
+    void* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        noose::add_error("Unable to map file");
+        return false;
+    }
+
+    *buffer_out  = (uint8_t*) mem;
+    *buffer_size = st.st_size;
+
+    return true;
+}
+
+static void release_buffer(uint8_t* buffer, uint32_t buffer_size, noose::load_mode mode)
+{
+    if (mode == noose::LOAD_MODE_MMAP)
+    {
+        munmap(buffer, buffer_size);
+    }
+    else
+    {
+        free(buffer);
+    }
+}
+
+bool noose::load_rom(const char* path, noose::rom* output, noose::load_mode mode)
 {
     uint8_t* buffer = 0;
     uint32_t buffer_size = 0;
 
-    if (!load_file(path, &buffer, &buffer_size))
+    bool loaded = mode == noose::LOAD_MODE_MMAP ?
+        map_file(path, &buffer, &buffer_size) :
+        load_file(path, &buffer, &buffer_size);
+
+    if (!loaded)
     {
         return false;
     }
 
+    if (buffer_size < sizeof(noose::header))
+    {
+        noose::add_error("File too small to be a ROM");
+        release_buffer(buffer, buffer_size, mode);
+        return false;
+    }
+
     memcpy(&output->header, buffer, sizeof(noose::header));
 
     if (!has_magic_number(output->header))
     {
-        add_error("Invalid header, no magic number");
+        noose::add_error("Invalid header, no magic number");
+        release_buffer(buffer, buffer_size, mode);
         return false;
     }
 
-    uint32_t cursor = sizeof(noose::header);
+    noose::header_info info = noose::decode_header(output->header);
+
+    uint32_t size_trainer = noose::header::has_trainer_data(output->header) ? sizeof(output->data_trainer) : 0;
+    uint32_t size_prg     = info.size_prg;
+    uint32_t size_chr     = info.size_chr;
 
-    if (noose::header::has_trainer_data(output->header))
+    if (sizeof(noose::header) + size_trainer + (uint64_t) size_prg + size_chr > buffer_size)
     {
-        uint32_t data_trainer_size = sizeof(output->data_trainer);
-        memcpy(output->data_trainer, &buffer[cursor], data_trainer_size);
-        cursor += data_trainer_size;
+        noose::add_error("ROM is truncated");
+        release_buffer(buffer, buffer_size, mode);
+        return false;
     }
 
-    if (output->header.page_count_prg > 0)
+    uint32_t cursor = sizeof(noose::header);
+
+    if (size_trainer > 0)
     {
-        uint32_t bytes_to_alloc = output->header.page_count_prg * BLOCK_SIZE_PRG;
-        output->data_prg = (uint8_t*) malloc(bytes_to_alloc);
-        memcpy(output->data_prg, &buffer[cursor], bytes_to_alloc);
-        cursor += bytes_to_alloc;
+        memcpy(output->data_trainer, &buffer[cursor], size_trainer);
+        cursor += size_trainer;
     }
 
-    if (output->header.page_count_chr > 0)
+    if (mode == noose::LOAD_MODE_MMAP)
+    {
+        // Keep the mapping alive, PRG and CHR are views into it
+        output->mapping      = buffer;
+        output->mapping_size = buffer_size;
+        output->data_prg     = size_prg > 0 ? &buffer[cursor] : 0;
+        output->data_chr     = size_chr > 0 ? &buffer[cursor + size_prg] : 0;
+    }
+    else
     {
-        uint32_t bytes_to_alloc = output->header.page_count_chr * BLOCK_SIZE_CHR;
-        output->data_chr = (uint8_t*) malloc(bytes_to_alloc);
-        memcpy(output->data_chr, &buffer[cursor], bytes_to_alloc);
+        if (size_prg > 0)
+        {
+            output->data_prg = (uint8_t*) malloc(size_prg);
+            memcpy(output->data_prg, &buffer[cursor], size_prg);
+        }
+
+        if (size_chr > 0)
+        {
+            output->data_chr = (uint8_t*) malloc(size_chr);
+            memcpy(output->data_chr, &buffer[cursor + size_prg], size_chr);
+        }
+
+        free(buffer);
     }
 
-    free(buffer);
+    // CHR ROM never changes, decode it for the PPU once and share it
+    if (size_chr > 0)
+    {
+        output->tiles_chr = (uint8_t*) malloc(size_chr / noose::ppu::TILE_SIZE * noose::ppu::DECODED_TILE_SIZE);
+        noose::ppu::decode_tiles(output->data_chr, size_chr, output->tiles_chr);
+    }
 
-    output->mapper_id = noose::header::mapper_number_lower(output->header) | (noose::header::mapper_number_higher(output->header) << 4);
+    output->mapper_id = info.mapper_id;
+    output->size_prg  = size_prg;
+    output->size_chr  = size_chr;
 
     return true;
 }
 
 void noose::reset_rom(noose::rom* rom)
 {
-    if (rom->data_prg)
+    if (rom->mapping)
     {
-        free(rom->data_prg);
+        munmap(rom->mapping, rom->mapping_size);
     }
-
-    if (rom->data_chr)
+    else
     {
-        free(rom->data_chr);
+        if (rom->data_prg)
+        {
+            free(rom->data_prg);
+        }
+
+        if (rom->data_chr)
+        {
+            free(rom->data_chr);
+        }
     }
 
+    free(rom->tiles_chr);
+
     memset(rom, 0, sizeof(*rom));
 }
 
-static inline uint8_t dbg_write_instruction_to_buffer_one_op(const noose::cpu::instruction_meta meta, char* buffer)
+static inline uint8_t dbg_write_instruction_to_buffer_one_op(noose::machine* m, const noose::cpu::instruction_meta& meta, char* buffer)
 {
-    int op0 = noose::cpu::read_memory(noose::cpu::pc + 1);
+    int op0 = noose::cpu::read_memory(m, m->pc + 1);
     return sprintf(buffer, "%02X     %s #$%02X", op0, meta.name, op0);
 }
 
-static inline uint8_t dbg_write_instruction_to_buffer_two_op(const noose::cpu::instruction_meta meta, char* buffer)
+static inline uint8_t dbg_write_instruction_to_buffer_two_op(noose::machine* m, const noose::cpu::instruction_meta& meta, char* buffer)
 {
-    int op0 = noose::cpu::read_memory(noose::cpu::pc + 1);
-    int op1 = noose::cpu::read_memory(noose::cpu::pc + 2);
+    int op0 = noose::cpu::read_memory(m, m->pc + 1);
+    int op1 = noose::cpu::read_memory(m, m->pc + 2);
     return sprintf(buffer, "%02X %02X  %s $%02X%02X", op0, op1, meta.name, op1, op0);
 }
 
-static uint8_t dbg_write_instruction_to_buffer(const noose::cpu::instruction i, char* buffer)
+static uint8_t dbg_write_instruction_to_buffer(noose::machine* m, const noose::cpu::instruction& i, char* buffer)
 {
     noose::cpu::instruction_meta meta = noose::cpu::get_instruction_meta(i);
 
@@ -158,60 +301,414 @@ static uint8_t dbg_write_instruction_to_buffer(const noose::cpu::instruction i,
     {
         case noose::cpu::FUNC_JMP:
         {
-            return dbg_write_instruction_to_buffer_two_op(meta, buffer);
+            return dbg_write_instruction_to_buffer_two_op(m, meta, buffer);
         }
         case noose::cpu::FUNC_LDX:
         {
-            int op0 = noose::cpu::read_memory(noose::cpu::pc + 1);
+            int op0 = noose::cpu::read_memory(m, m->pc + 1);
             if (noose::cpu::get_address_mode(i) == noose::cpu::MODE_IMMEDIATE)
             {
                 return sprintf(buffer, "%02X     %s #$%02X", op0, meta.name, op0);
             }
             else
             {
-                int op1 = noose::cpu::read_memory(noose::cpu::pc + 2);
+                int op1 = noose::cpu::read_memory(m, m->pc + 2);
                 return sprintf(buffer, "%02X %02X  %s $%02X%02X", op0, op1, meta.name, op1, op0);
             }
         }
         case noose::cpu::FUNC_STX:
         {
-            int op0 = noose::cpu::read_memory(noose::cpu::pc + 1);
+            int op0 = noose::cpu::read_memory(m, m->pc + 1);
             if (noose::cpu::get_address_mode(i) == noose::cpu::MODE_ZEROPAGE)
             {
-                return sprintf(buffer, "%02X     %s $%02X = %02X", op0, meta.name, op0, noose::cpu::x);
+                return sprintf(buffer, "%02X     %s $%02X = %02X", op0, meta.name, op0, m->x);
             }
         }
         case noose::cpu::FUNC_JSR:
         {
-            return dbg_write_instruction_to_buffer_two_op(meta, buffer);
+            return dbg_write_instruction_to_buffer_two_op(m, meta, buffer);
         }
         case noose::cpu::FUNC_NOP:
         {
-            return dbg_write_instruction_to_buffer_one_op(meta, buffer);
+            return dbg_write_instruction_to_buffer_one_op(m, meta, buffer);
         }
     }
 
     return 0;
 }
 
-static void print_debug_instruction(const noose::cpu::instruction inst)
+static void print_debug_instruction(const noose::cpu::instruction& inst)
 {
     noose::cpu::instruction_meta meta = noose::cpu::get_instruction_meta(inst);
     printf("Instruction, Address Mode, Cycle count: %s, %s, %d\n", meta.name, get_address_mode_str(inst), inst.cycle_count);
 }
 
-bool noose::verify_rom(const noose::rom* rom, const char* verify_log_path)
+static bool parse_hex(const char* str, uint32_t digits, uint32_t* out)
 {
-    noose::cpu::initialize(rom);
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < digits; ++i)
+    {
+        char c = str[i];
+        if      (c >= '0' && c <= '9') value = (value << 4) | (c - '0');
+        else if (c >= 'A' && c <= 'F') value = (value << 4) | (c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f') value = (value << 4) | (c - 'a' + 10);
+        else return false;
+    }
+    *out = value;
+    return true;
+}
 
-    // Start up state
-    noose::cpu::p  = 0x24; // Should be 34, but not for nestest apparently..
-    noose::cpu::pc = 0xC000;
+static bool parse_hex_field(const char* line, const char* name, uint32_t digits, uint32_t* out)
+{
+    const char* field = strstr(line, name);
+    return field && parse_hex(field + strlen(name), digits, out);
+}
+
+// "C000  4C F5 C5  JMP $C5F5     A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7"
+static bool parse_log_line(const char* line, noose::trace_record* out)
+{
+    uint32_t pc, opcode, a, x, y, p, sp;
+
+    if (!parse_hex(line, 4, &pc) || !parse_hex(line + 6, 2, &opcode))
+    {
+        return false;
+    }
+
+    // Skip past the disassembly so the field names can't match inside it
+    const char* regs = strstr(line + 16, " A:");
+    const char* cyc  = regs ? strstr(regs, "CYC:") : 0;
+
+    if (!regs || !cyc ||
+        !parse_hex_field(regs, "A:", 2, &a)  || !parse_hex_field(regs, "X:", 2, &x) ||
+        !parse_hex_field(regs, "Y:", 2, &y)  || !parse_hex_field(regs, "P:", 2, &p) ||
+        !parse_hex_field(regs, "SP:", 2, &sp))
+    {
+        return false;
+    }
+
+    out->pc     = pc;
+    out->opcode = opcode;
+    out->a      = a;
+    out->x      = x;
+    out->y      = y;
+    out->p      = p;
+    out->sp     = sp;
+    out->cycle  = strtoul(cyc + 4, 0, 10);
+    return true;
+}
+
+static void capture_trace_record(const noose::machine* m, const noose::cpu::instruction& inst, uint32_t cycle, noose::trace_record* out)
+{
+    out->pc     = m->pc;
+    out->opcode = inst.code;
+    out->a      = m->a;
+    out->x      = m->x;
+    out->y      = m->y;
+    out->p      = noose::cpu::get_status(m);
+    out->sp     = m->sp;
+    out->cycle  = cycle;
+}
+
+static bool trace_records_equal(const noose::trace_record& lhs, const noose::trace_record& rhs)
+{
+    return lhs.pc == rhs.pc && lhs.opcode == rhs.opcode &&
+        lhs.a == rhs.a && lhs.x == rhs.x && lhs.y == rhs.y &&
+        lhs.p == rhs.p && lhs.sp == rhs.sp && lhs.cycle == rhs.cycle;
+}
+
+static void print_trace_record(const char* prefix, uint32_t line, const noose::trace_record& r)
+{
+    printf("%s %6u  %04X  %02X  A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%u\n",
+        prefix, line, r.pc, r.opcode, r.a, r.x, r.y, r.p, r.sp, r.cycle);
+}
+
+static bool load_text_file(const char* path, char** buffer_out, uint32_t* buffer_size)
+{
+    uint8_t* buffer = 0;
+    if (!load_file(path, &buffer, buffer_size))
+    {
+        return false;
+    }
+
+    // Room for a terminator so lines can be walked with plain string functions
+    *buffer_out = (char*) realloc(buffer, *buffer_size + 1);
+    (*buffer_out)[*buffer_size] = '\0';
+    return true;
+}
+
+static const uint32_t VERIFY_CONTEXT_LINES = 8;
+
+static bool verify_records_quiet(noose::machine* m, const noose::trace_record* expected, uint32_t count)
+{
+    noose::trace_record history[VERIFY_CONTEXT_LINES];
+    uint32_t            cycle_count = 7;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const noose::cpu::instruction& next = noose::cpu::get_next_instruction(m);
+
+        noose::trace_record actual;
+        capture_trace_record(m, next, cycle_count, &actual);
+
+        if (!trace_records_equal(actual, expected[i]))
+        {
+            uint32_t first = i > VERIFY_CONTEXT_LINES ? i - VERIFY_CONTEXT_LINES : 0;
+            for (uint32_t c = first; c < i; ++c)
+            {
+                print_trace_record("  ", c + 1, history[c % VERIFY_CONTEXT_LINES]);
+            }
+            print_trace_record("- ", i + 1, expected[i]);
+            print_trace_record("+ ", i + 1, actual);
+
+            char msg[128];
+            sprintf(msg, "Trace diverged at line %u (pc $%04X)", i + 1, expected[i].pc);
+            noose::add_error(msg);
+            return false;
+        }
+
+        history[i % VERIFY_CONTEXT_LINES] = actual;
+
+        noose::cpu::execute(m, next);
+        cycle_count += next.cycle_count;
+    }
+
+    printf("Verified %u instructions\n", count);
+    return true;
+}
+
+static bool parse_log_text(char* text, noose::trace_record** records_out, uint32_t* count_out)
+{
+    // Every line is at least this long, good enough to size the record array
+    uint32_t             capacity = strlen(text) / 16 + 1;
+    noose::trace_record* records  = (noose::trace_record*) malloc(capacity * sizeof(noose::trace_record));
+    uint32_t             count    = 0;
+
+    char* line = text;
+    while(*line && count < capacity)
+    {
+        char* end = strchr(line, '\n');
+        if (end)
+        {
+            *end = '\0';
+        }
+
+        if (*line && *line != '\r')
+        {
+            if (!parse_log_line(line, &records[count]))
+            {
+                char msg[64];
+                sprintf(msg, "Malformed log line %u", count + 1);
+                noose::add_error(msg);
+                free(records);
+                return false;
+            }
+            count++;
+        }
+
+        if (!end)
+        {
+            break;
+        }
+        line = end + 1;
+    }
+
+    *records_out = records;
+    *count_out   = count;
+    return true;
+}
+
+/*
+Parsed reference logs are cached next to the text log as <log>.ntrc, a
+header followed by fixed-width trace_records. The cache is keyed by a hash
+of the text log and memory mapped on later runs, so only the hash has to
+touch the text.
+*/
+static const char     TRACE_CACHE_MAGIC[4]  = {'N', 'T', 'R', 'C'};
+static const uint32_t TRACE_CACHE_VERSION   = 1;
+
+struct s_trace_cache_header
+{
+    char     magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t record_size;
+    uint32_t record_count;
+};
+
+struct s_reference_trace
+{
+    const noose::trace_record* records;
+    uint32_t                   count;
+    noose::trace_record*       owned;        // parsed from text, or
+    uint8_t*                   mapping;      // mapped from the cache file
+    size_t                     mapping_size;
+};
+
+static bool hash_file(const char* path, uint64_t* hash_out)
+{
+    uint8_t* buffer      = 0;
+    uint32_t buffer_size = 0;
+
+    if (!map_file(path, &buffer, &buffer_size))
+    {
+        return false;
+    }
+
+    *hash_out = noose::hash_fnv1a(buffer, buffer_size);
+    munmap(buffer, buffer_size);
+    return true;
+}
+
+static bool open_trace_cache(const char* cache_path, uint64_t source_hash, s_reference_trace* out)
+{
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(s_trace_cache_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const s_trace_cache_header* header = (const s_trace_cache_header*) mem;
+    bool valid = memcmp(header->magic, TRACE_CACHE_MAGIC, sizeof(TRACE_CACHE_MAGIC)) == 0 &&
+        header->version      == TRACE_CACHE_VERSION &&
+        header->source_hash  == source_hash &&
+        header->record_size  == sizeof(noose::trace_record) &&
+        sizeof(s_trace_cache_header) + (size_t) header->record_count * sizeof(noose::trace_record) == (size_t) st.st_size;
+
+    if (!valid)
+    {
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    out->records      = (const noose::trace_record*) ((const uint8_t*) mem + sizeof(s_trace_cache_header));
+    out->count        = header->record_count;
+    out->mapping      = (uint8_t*) mem;
+    out->mapping_size = st.st_size;
+    return true;
+}
+
+static void write_trace_cache(const char* cache_path, uint64_t source_hash, const noose::trace_record* records, uint32_t count)
+{
+    s_trace_cache_header header;
+    memcpy(header.magic, TRACE_CACHE_MAGIC, sizeof(header.magic));
+    header.version      = TRACE_CACHE_VERSION;
+    header.source_hash  = source_hash;
+    header.record_size  = sizeof(noose::trace_record);
+    header.record_count = count;
+
+    // Write to a temporary and rename, concurrent runs never see a partial file
+    char tmp_path[512 + 16];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int) getpid()) >= (int) sizeof(tmp_path))
+    {
+        return;
+    }
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL)
+    {
+        return;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(records, sizeof(noose::trace_record), count, f) == count;
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok || rename(tmp_path, cache_path) != 0)
+    {
+        remove(tmp_path);
+    }
+}
+
+static bool open_reference_trace(const char* log_path, s_reference_trace* out)
+{
+    memset(out, 0, sizeof(*out));
+
+    uint64_t source_hash = 0;
+    if (!hash_file(log_path, &source_hash))
+    {
+        return false;
+    }
+
+    // A truncated name could be some other file, so long paths go without a cache
+    char cache_path[512];
+    bool use_cache = snprintf(cache_path, sizeof(cache_path), "%s.ntrc", log_path) < (int) sizeof(cache_path);
+
+    if (use_cache && open_trace_cache(cache_path, source_hash, out))
+    {
+        return true;
+    }
+
+    char*    text      = 0;
+    uint32_t text_size = 0;
+
+    if (!load_text_file(log_path, &text, &text_size))
+    {
+        return false;
+    }
+
+    bool parsed = parse_log_text(text, &out->owned, &out->count);
+    free(text);
+
+    if (!parsed)
+    {
+        return false;
+    }
+
+    out->records = out->owned;
+    if (use_cache)
+    {
+        write_trace_cache(cache_path, source_hash, out->records, out->count);
+    }
+    return true;
+}
+
+static void close_reference_trace(s_reference_trace* trace)
+{
+    if (trace->mapping)
+    {
+        munmap(trace->mapping, trace->mapping_size);
+    }
+
+    free(trace->owned);
+    memset(trace, 0, sizeof(*trace));
+}
 
+static bool verify_rom_quiet(noose::machine* m, const char* verify_log_path)
+{
+    s_reference_trace trace;
+
+    if (!open_reference_trace(verify_log_path, &trace))
+    {
+        noose::add_error("Unable to read verification log file");
+        return false;
+    }
+
+    bool ok = verify_records_quiet(m, trace.records, trace.count);
+    close_reference_trace(&trace);
+    return ok;
+}
+
+static bool verify_rom_loud(noose::machine* m, const char* verify_log_path)
+{
     FILE* f = fopen(verify_log_path, "r");
     if (f == NULL)
     {
-        add_error("Unable to open verification log file");
+        noose::add_error("Unable to open verification log file");
         return false;
     }
 
@@ -221,21 +718,21 @@ bool noose::verify_rom(const noose::rom* rom, const char* verify_log_path)
     char buffer_noose[256];
     while(fgets(buffer_log, sizeof(buffer_log), f) != NULL && !abort)
     {
-        noose::cpu::instruction next = noose::cpu::get_next_instruction();
-
-        uint16_t pc   = cpu::pc;
-        uint8_t reg_a = cpu::a;
-        uint8_t reg_x = cpu::x;
-        uint8_t reg_y = cpu::y;
-        uint8_t p     = cpu::p;
-        uint8_t sp    = cpu::sp;
+        const noose::cpu::instruction& next = noose::cpu::get_next_instruction(m);
+
+        uint16_t pc   = m->pc;
+        uint8_t reg_a = m->a;
+        uint8_t reg_x = m->x;
+        uint8_t reg_y = m->y;
+        uint8_t p     = noose::cpu::get_status(m);
+        uint8_t sp    = m->sp;
         uint8_t ppu_x = 0;
         uint8_t ppu_y = 0;
 
         char instruction_str[40] = {};
-        dbg_write_instruction_to_buffer(next, instruction_str);
+        dbg_write_instruction_to_buffer(m, next, instruction_str);
 
-        noose::cpu::execute(next);
+        noose::cpu::execute(m, next);
 
         print_debug_instruction(next);
 
@@ -290,8 +787,8 @@ bool noose::verify_rom(const noose::rom* rom, const char* verify_log_path)
 
         if (abort)
         {
-            add_error("Input string mismatch:");
-            add_error(buffer_noose);
+            noose::add_error("Input string mismatch:");
+            noose::add_error(buffer_noose);
         }
 
         #undef COLOR_NRM
@@ -306,6 +803,148 @@ bool noose::verify_rom(const noose::rom* rom, const char* verify_log_path)
     return !abort;
 }
 
+noose::machine* noose::create_machine(const noose::rom* rom)
+{
+    noose::machine* m = (noose::machine*) calloc(1, sizeof(noose::machine));
+    if (!m)
+    {
+        noose::add_error("Out of memory");
+        return 0;
+    }
+
+#if defined(NOOSE_PROFILE)
+    // Before the CPU, which already counts the reset vector fetch
+    noose::profile::initialize(m, rom);
+#endif
+
+    // The mapper has queued the reason
+    if (!noose::cpu::initialize(m, rom))
+    {
+        noose::destroy_machine(m);
+        return 0;
+    }
+
+    return m;
+}
+
+void noose::destroy_machine(noose::machine* m)
+{
+    if (!m)
+    {
+        return;
+    }
+
+#if defined(NOOSE_JIT_ENABLED)
+    noose::jit::release(m);
+#endif
+
+    noose::stop_trace(m);
+
+#if defined(NOOSE_PROFILE)
+    noose::profile::release(m);
+#endif
+
+    free(m->run_ahead_state);
+    free(m);
+}
+
+void noose::reset_machine(noose::machine* m)
+{
+    // Reset also reaches the PPU, which drops its control registers and the write toggle
+    noose::ppu::catch_up(m, m->cycles);
+    m->ppu_state.ctrl = 0;
+    m->ppu_state.mask = 0;
+    m->ppu_state.w    = 0;
+
+    // and silences the APU
+    noose::apu::catch_up(m, m->cycles);
+    noose::apu::write_register(m, 0x4015, 0);
+
+    noose::cpu::reset(m);
+}
+
+uint32_t noose::run_cycles(noose::machine* m, uint32_t cycles)
+{
+    if (cycles == 0)
+    {
+        return 0;
+    }
+
+    // Instructions aren't split, so the last one may run past the budget
+    return noose::cpu::run(m, cycles) - cycles;
+}
+
+uint32_t noose::run_until_frame(noose::machine* m)
+{
+    // Frames are counted in PPU dots so the fractional cycle carries over
+    uint64_t frame     = m->cycles * noose::PPU_DOTS_PER_CPU_CYCLE / noose::PPU_DOTS_PER_FRAME;
+    uint64_t frame_end = ((frame + 1) * noose::PPU_DOTS_PER_FRAME + noose::PPU_DOTS_PER_CPU_CYCLE - 1) / noose::PPU_DOTS_PER_CPU_CYCLE;
+
+    return noose::run_cycles(m, (uint32_t) (frame_end - m->cycles));
+}
+
+uint32_t noose::run_frame_ahead(noose::machine* m, uint32_t frames_ahead)
+{
+    uint32_t overshoot = noose::run_until_frame(m);
+    if (frames_ahead == 0)
+    {
+        return overshoot;
+    }
+
+    if (!m->run_ahead_state)
+    {
+        m->run_ahead_state = (noose::save_state_data*) malloc(sizeof(noose::save_state_data));
+    }
+
+    noose::save_state(m, m->run_ahead_state, sizeof(noose::save_state_data));
+
+    // The speculative frames are only seen, never heard. The audio of the
+    // real timeline carries on from the snapshot once it's restored.
+    noose::apu::s_blip blip        = m->apu_blip;
+    uint32_t           sample_rate = m->sample_rate;
+
+    m->sample_rate = 0;
+
+    for (uint32_t i = 0; i < frames_ahead; ++i)
+    {
+        noose::run_until_frame(m);
+    }
+
+    // The frame buffer isn't part of the state, so it keeps the last frame
+    noose::load_state(m, m->run_ahead_state, sizeof(noose::save_state_data));
+
+    m->sample_rate = sample_rate;
+    m->apu_blip    = blip;
+
+    return overshoot;
+}
+
+void noose::set_input(noose::machine* m, uint32_t port, uint8_t buttons)
+{
+    assert(port < 2);
+    m->pad_buttons[port] = buttons;
+}
+
+bool noose::verify_rom(const noose::rom* rom, const char* verify_log_path, uint32_t flags)
+{
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        return false;
+    }
+
+    // Start up state
+    noose::cpu::set_status(m, 0x24); // Should be 34, but not for nestest apparently..
+    m->pc = 0xC000;
+
+    bool ok = (flags & noose::VERIFY_QUIET) ?
+        verify_rom_quiet(m, verify_log_path) :
+        verify_rom_loud(m, verify_log_path);
+
+    noose::destroy_machine(m);
+    return ok;
+}
+
 void noose::debug(const char* debug_str)
 {
     printf("[DEBUG] %s\n", debug_str);
@@ -320,7 +959,22 @@ void noose::print_help()
 {
     printf("\n");
     printf("To use, call noose like this:\n");
-    printf("noose <path-to-nes-file>\n");
+    printf("noose <path-to-nes-file> [options]\n");
+    printf("noose -scan <dir> [-format csv|json] [-hash] [-threads <n>]\n");
+    printf("noose -batch <manifest> [-threads <n>]\n");
+    printf("noose -verify_ppu [-lines <n>]\n");
+    printf("noose -trace_format <file> [-format text|json] [-last <n>]\n");
+    printf("\n");
+    printf("  -verify <log>     Run the ROM and compare against a nestest style log\n");
+    printf("  -quiet            With -verify, compare fields and only print the first divergence\n");
+    printf("  -verify_blocks    Run the ROM through the block cache and JIT and compare with the interpreter [-frames <n>]\n");
+    printf("  -print_header     Print the iNES header\n");
+    printf("  -mmap             Map the ROM file read-only instead of copying it\n");
+    printf("  -wav <file>       Run the ROM headless and write its audio [-frames <n>] [-rate <hz>]\n");
+    printf("  -record <movie>   Run the ROM on generated input and save it as a movie [-frames <n>] [-seed <n>]\n");
+    printf("  -play <movie>     Replay a movie recorded on the ROM [-run_ahead <frames>]\n");
+    printf("  -trace <file>     Run the ROM and keep its last instructions in a trace file [-frames <n>] [-entries <n>]\n");
+    printf("  -profile <file>   Run the ROM and write execution counters, needs a NOOSE_PROFILE build [-frames <n>] [-format csv|folded]\n");
 }
 
 void noose::print_header(const noose::header header)
@@ -352,7 +1006,7 @@ void noose::print_header(const noose::header header)
     printf("Flag 10 (Bus Conflict)         : %s\n", noose::header::bus_conflict(header) ? "Has Conflict" : "No Conflict");
 }
 
-static char error_buffer[512];
+static __thread char error_buffer[512];
 
 bool noose::has_errors()
 {
@@ -27,20 +27,20 @@ namespace noose
         uint8_t flags_10;
         uint8_t unused[5];
 
-        static uint8_t nametable_mirroring_mode(const s_header h) { return (h.flags_6 & 0x01 >> 0); }
-        static uint8_t battery_backed_prg(const s_header h)       { return (h.flags_6 & 0x02 >> 1); }
-        static uint8_t has_trainer_data(const s_header h)         { return (h.flags_6 & 0x04 >> 2); }
-        static uint8_t ignore_mirror_control(const s_header h)    { return (h.flags_6 & 0x08 >> 3); }
-        static uint8_t mapper_number_lower(const s_header h)      { return (h.flags_6 & 0xf0 >> 4); }
-        static uint8_t vs_unisystem(const s_header h)             { return (h.flags_7 & 0x01 >> 0); }
-        static uint8_t playchoice_10(const s_header h)            { return (h.flags_7 & 0x02 >> 1); }
-        static uint8_t nes_2_0_bits(const s_header h)             { return (h.flags_7 & 0x0c >> 2); }
-        static uint8_t mapper_number_higher(const s_header h)     { return (h.flags_7 & 0xf0 >> 4); }
+        static uint8_t nametable_mirroring_mode(const s_header h) { return (h.flags_6 & 0x01); }
+        static uint8_t battery_backed_prg(const s_header h)       { return ((h.flags_6 & 0x02) >> 1); }
+        static uint8_t has_trainer_data(const s_header h)         { return ((h.flags_6 & 0x04) >> 2); }
+        static uint8_t ignore_mirror_control(const s_header h)    { return ((h.flags_6 & 0x08) >> 3); }
+        static uint8_t mapper_number_lower(const s_header h)      { return ((h.flags_6 & 0xf0) >> 4); }
+        static uint8_t vs_unisystem(const s_header h)             { return (h.flags_7 & 0x01); }
+        static uint8_t playchoice_10(const s_header h)            { return ((h.flags_7 & 0x02) >> 1); }
+        static uint8_t nes_2_0_bits(const s_header h)             { return ((h.flags_7 & 0x0c) >> 2); }
+        static uint8_t mapper_number_higher(const s_header h)     { return ((h.flags_7 & 0xf0) >> 4); }
         static uint8_t prg_ram_size(const s_header h)             { return (h.flags_8); }
         static uint8_t tv_system_1(const s_header h)              { return (h.flags_9 & 0x01); }
         static uint8_t tv_system_2(const s_header h)              { return (h.flags_10 & 0x03); }
-        static uint8_t prg_ram(const s_header h)                  { return (h.flags_10 & 0x10 >> 4); }
-        static uint8_t bus_conflict(const s_header h)             { return (h.flags_10 & 0x20 >> 5); }
+        static uint8_t prg_ram(const s_header h)                  { return ((h.flags_10 & 0x10) >> 4); }
+        static uint8_t bus_conflict(const s_header h)             { return ((h.flags_10 & 0x20) >> 5); }
     };
 
     struct s_rom
@@ -49,15 +49,127 @@ namespace noose
         uint8_t  data_trainer[512];
         uint8_t* data_prg;
         uint8_t* data_chr;
-        uint8_t  mapper_id;
+        uint16_t mapper_id;
+        uint32_t size_prg;     // in bytes, from the header the way decode_header reads it
+        uint32_t size_chr;
+        uint8_t* mapping;      // read-only file mapping backing data_prg/data_chr, if any
+        uint32_t mapping_size;
+        uint8_t* tiles_chr;    // data_chr decoded to one byte per pixel for the PPU
     };
 
-    typedef struct s_rom    rom;
-    typedef struct s_header header;
+    enum load_mode
+    {
+        LOAD_MODE_COPY, // PRG and CHR are read into their own allocations
+        LOAD_MODE_MMAP, // PRG and CHR point into a shared read-only mapping of the file
+    };
+
+    enum verify_flags
+    {
+        VERIFY_DEFAULT = 0,
+        VERIFY_QUIET   = 1, // compare parsed fields, only print around the first divergence
+    };
+
+    enum scan_format
+    {
+        SCAN_FORMAT_CSV,
+        SCAN_FORMAT_JSON,
+    };
+
+    static const uint32_t FRAME_WIDTH  = 256;
+    static const uint32_t FRAME_HEIGHT = 240;
+
+    // Bumped whenever the save state layout changes, older states are refused
+    static const uint32_t STATE_VERSION = 2;
+
+    // Standard controller, in the order the buttons are shifted out
+    enum button
+    {
+        BUTTON_A      = 0x01,
+        BUTTON_B      = 0x02,
+        BUTTON_SELECT = 0x04,
+        BUTTON_START  = 0x08,
+        BUTTON_UP     = 0x10,
+        BUTTON_DOWN   = 0x20,
+        BUTTON_LEFT   = 0x40,
+        BUTTON_RIGHT  = 0x80,
+    };
+
+    enum trace_format
+    {
+        TRACE_FORMAT_TEXT, // nestest style log lines
+        TRACE_FORMAT_JSON, // one object per line
+    };
+
+    enum profile_format
+    {
+        PROFILE_FORMAT_CSV,
+        PROFILE_FORMAT_FOLDED, // folded stacks weighted by cycles, for flame graphs
+    };
+
+    enum movie_anchor
+    {
+        MOVIE_ANCHOR_POWER_ON, // replays on a fresh machine
+        MOVIE_ANCHOR_STATE,    // replays from a save state stored in the movie
+    };
+
+    // One emulated console, see noose_internal.h
+    struct s_machine;
+
+    // Save state history for one machine, see noose_rewind.cpp
+    struct s_rewind_buffer;
+
+    // Recorded controller input, see noose_movie.cpp
+    struct s_movie;
+
+    typedef struct s_rom           rom;
+    typedef struct s_header        header;
+    typedef struct s_machine       machine;
+    typedef struct s_rewind_buffer rewind_buffer;
+    typedef struct s_movie         movie;
 
-    bool        load_rom(const char* path, rom* output);
+    bool        load_rom(const char* path, rom* output, load_mode mode = LOAD_MODE_COPY);
     void        reset_rom(noose::rom* rom);
-    bool        verify_rom(const noose::rom* rom, const char* verify_log_path);
+    machine*    create_machine(const noose::rom* rom);
+    void        destroy_machine(machine* m);
+    void        reset_machine(machine* m);               // the console's reset button
+    uint32_t    run_cycles(machine* m, uint32_t cycles); // returns the overshoot in cycles
+    uint32_t    run_until_frame(machine* m);             // runs to the next frame boundary, returns the overshoot
+    uint32_t    run_frame_ahead(machine* m, uint32_t frames_ahead); // like run_until_frame, but shows the frame that many frames later
+    void        set_input(machine* m, uint32_t port, uint8_t buttons); // BUTTON_* bits, port 0 or 1
+    void        set_audio_rate(machine* m, uint32_t sample_rate); // 0 stops producing samples
+    uint32_t    read_audio(machine* m, int16_t* out, uint32_t max_samples); // mono, safe from one other thread
+    void        get_frame_rgba(const machine* m, uint8_t* out); // 4 bytes per pixel
+    const uint8_t* get_frame(const machine* m);                 // FRAME_WIDTH x FRAME_HEIGHT NES colour indices
+    uint32_t    get_state_size();                                   // bytes save_state needs
+    bool        save_state(const machine* m, void* out, uint32_t size);
+    bool        load_state(machine* m, const void* state, uint32_t size); // same ROM only
+    rewind_buffer* create_rewind(uint32_t memory_budget, uint32_t keyframe_interval); // budget in bytes of history
+    void        destroy_rewind(rewind_buffer* r);
+    bool        push_rewind(rewind_buffer* r, const machine* m);         // once per frame
+    uint32_t    step_rewind(rewind_buffer* r, machine* m, uint32_t frame_count = 1); // returns the frames actually stepped
+    uint32_t    get_rewind_frames(const rewind_buffer* r);
+    movie*      create_movie(const machine* m, movie_anchor anchor); // power-on needs a machine that hasn't run yet
+    movie*      load_movie(const char* path);
+    bool        save_movie(const movie* mv, const char* path);
+    void        destroy_movie(movie* mv);
+    machine*    start_movie(movie* mv, const rom* rom);             // new machine at the movie's anchor
+    void        record_movie_frame(movie* mv, machine* m, uint8_t port_0, uint8_t port_1); // appends the input and runs the frame
+    bool        play_movie_frame(movie* mv, machine* m, uint32_t frames_ahead = 0);     // false once the movie has ended
+    uint32_t    get_movie_frames(const movie* mv);
+    bool        record_movie(const noose::rom* rom, const char* movie_path, uint32_t frame_count, uint32_t seed);
+    bool        play_movie(const noose::rom* rom, const char* movie_path, uint32_t frames_ahead);
+    bool        start_trace(machine* m, uint32_t entry_count, const char* path = 0); // keeps the last entry_count instructions, in a shared mapping of path if given
+    void        stop_trace(machine* m);
+    bool        save_trace(const machine* m, const char* path);
+    bool        format_trace(const char* path, trace_format format, uint32_t last_count = 0); // 0 prints all that are left in the ring
+    bool        record_trace(const noose::rom* rom, const char* path, uint32_t frame_count, uint32_t entry_count);
+    bool        record_profile(const noose::rom* rom, const char* path, uint32_t frame_count, profile_format format); // fails unless built with NOOSE_PROFILE
+    bool        verify_rom(const noose::rom* rom, const char* verify_log_path, uint32_t flags = VERIFY_DEFAULT);
+    bool        record_wav(const noose::rom* rom, const char* wav_path, uint32_t frame_count, uint32_t sample_rate);
+    bool        scan_roms(const char* dir_path, scan_format format, bool hash, uint32_t thread_count);
+    bool        run_batch(const char* manifest_path, uint32_t thread_count);
+    bool        verify_compose(uint32_t line_count); // checks every PPU compositor path against the scalar one
+    bool        verify_blocks(const noose::rom* rom, uint32_t frame_count); // checks the block cache and JIT against the single-step interpreter
     void        debug(const char* debug_str);
     void        error(const char* error_str);
     void        print_help();
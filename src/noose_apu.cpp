@@ -0,0 +1,985 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+2A03 sound: two pulse channels, triangle, noise and DMC, mixed through the
+usual non-linear lookup tables.
+
+Like the PPU, the APU lags behind the CPU and is caught up on register
+accesses, on its own events (frame counter steps, DMC fetches, see
+events::EVENT_APU) and at the end of cpu::run. Catching up doesn't tick every
+cycle, it jumps from one channel timer expiry to the next. Timers of
+channels that can't be heard (length counter at zero, muted by the sweep
+unit, triangle above the audible range) are parked until that changes.
+
+Whenever the mixed output changes, the difference goes into a blip buffer
+as a band-limited step at its exact sub-sample position. Samples are
+produced by integrating that buffer, so the cost scales with the number of
+output changes and samples rather than with the 1.79 MHz clock. Finished
+samples go into a lock-free single producer/single consumer ring that
+noose::read_audio drains, possibly from another thread.
+*/
+
+static const uint8_t length_table[32] =
+{
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const uint8_t duty_table[4][8] =
+{
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 },
+};
+
+static const uint8_t triangle_table[32] =
+{
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+};
+
+// In cpu cycles
+static const uint16_t noise_period_table[16] =
+{
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const uint16_t dmc_rate_table[16] =
+{
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+};
+
+// Frame counter steps in cpu cycles from the start of the sequence, 4 and 5 step mode
+static const uint32_t frame_step_cycles[2][5] =
+{
+    { 7457, 14913, 22371, 29829, 0     },
+    { 7457, 14913, 22371, 29829, 37281 },
+};
+
+static const uint32_t frame_step_count[2]   = { 4, 5 };
+static const uint32_t frame_period[2]       = { 29830, 37282 };
+
+enum frame_step_flags
+{
+    FRAME_QUARTER = 1, // envelopes and the triangle's linear counter
+    FRAME_HALF    = 2, // length counters and sweep units
+    FRAME_IRQ     = 4,
+};
+
+static const uint8_t frame_step_flags[2][5] =
+{
+    { FRAME_QUARTER, FRAME_QUARTER | FRAME_HALF, FRAME_QUARTER, FRAME_QUARTER | FRAME_HALF | FRAME_IRQ, 0 },
+    { FRAME_QUARTER, FRAME_QUARTER | FRAME_HALF, FRAME_QUARTER, 0, FRAME_QUARTER | FRAME_HALF },
+};
+
+enum status_flags
+{
+    STATUS_PULSE_1   = 0x01,
+    STATUS_PULSE_2   = 0x02,
+    STATUS_TRIANGLE  = 0x04,
+    STATUS_NOISE     = 0x08,
+    STATUS_DMC       = 0x10,
+    STATUS_FRAME_IRQ = 0x40,
+    STATUS_DMC_IRQ   = 0x80,
+};
+
+// Shared by every machine, built once like the CPU's decode table
+static float          blip_kernel[apu::BLIP_PHASES][apu::BLIP_WIDTH];
+static float          pulse_mix_table[31];
+static float          tnd_mix_table[203];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables()
+{
+    // Blackman windowed sinc, cut off a bit below Nyquist, one row per
+    // sub-sample phase. Each row sums to one so a step settles exactly.
+    const double cutoff = 0.9;
+    const double half   = apu::BLIP_WIDTH / 2;
+
+    for (uint32_t p = 0; p < apu::BLIP_PHASES; ++p)
+    {
+        double sum = 0.0;
+        double row[apu::BLIP_WIDTH];
+
+        for (uint32_t k = 0; k < apu::BLIP_WIDTH; ++k)
+        {
+            double x      = k - half + 1.0 - (double) p / apu::BLIP_PHASES;
+            double sinc   = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            double w      = (x + half) / apu::BLIP_WIDTH;
+            double window = 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+            row[k]        = sinc * window;
+            sum          += row[k];
+        }
+
+        for (uint32_t k = 0; k < apu::BLIP_WIDTH; ++k)
+        {
+            blip_kernel[p][k] = (float) (row[k] / sum);
+        }
+    }
+
+    pulse_mix_table[0] = 0.0f;
+    for (uint32_t i = 1; i < 31; ++i)
+    {
+        pulse_mix_table[i] = (float) (95.52 / (8128.0 / i + 100.0));
+    }
+
+    tnd_mix_table[0] = 0.0f;
+    for (uint32_t i = 1; i < 203; ++i)
+    {
+        tnd_mix_table[i] = (float) (163.67 / (24329.0 / i + 100.0));
+    }
+}
+
+static void blip_add_delta(machine* m, uint64_t cycle, float delta)
+{
+    apu::s_blip& b   = m->apu_blip;
+    uint64_t     pos = b.offset + (cycle - b.cycle) * b.factor;
+    uint32_t     i   = (uint32_t) (pos >> 32);
+
+    // Can't happen while the frame counter flushes on every step
+    if (i >= apu::BLIP_BUFFER_SIZE)
+    {
+        return;
+    }
+
+    const float* kernel = blip_kernel[((pos & 0xffffffff) * apu::BLIP_PHASES) >> 32];
+    float*       out    = &b.diff[i];
+
+    for (uint32_t k = 0; k < apu::BLIP_WIDTH; ++k)
+    {
+        out[k] += delta * kernel[k];
+    }
+}
+
+static void ring_push(apu::s_ring& r, const int16_t* samples, uint32_t count)
+{
+    uint32_t write = r.write_pos;
+    uint32_t read  = __atomic_load_n(&r.read_pos, __ATOMIC_ACQUIRE);
+    uint32_t space = apu::RING_SIZE - (write - read);
+
+    if (count > space)
+    {
+        r.dropped += count - space;
+        count      = space;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        r.samples[(write + i) & (apu::RING_SIZE - 1)] = samples[i];
+    }
+
+    __atomic_store_n(&r.write_pos, write + count, __ATOMIC_RELEASE);
+}
+
+// Every sample before cycle is final now, integrate them out of the buffer
+static void blip_flush(machine* m, uint64_t cycle)
+{
+    apu::s_blip& b     = m->apu_blip;
+    uint64_t     pos   = b.offset + (cycle - b.cycle) * b.factor;
+    uint32_t     count = (uint32_t) (pos >> 32);
+
+    if (count > apu::BLIP_BUFFER_SIZE)
+    {
+        count = apu::BLIP_BUFFER_SIZE;
+    }
+
+    // DC blocker around 20 Hz, the mixer output never goes negative
+    const float highpass_k = 1.0f - expf(-2.0f * (float) M_PI * 20.0f / m->sample_rate);
+
+    int16_t samples[apu::BLIP_BUFFER_SIZE];
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        b.integrator += b.diff[i];
+        b.highpass   += (b.integrator - b.highpass) * highpass_k;
+
+        float s    = (b.integrator - b.highpass) * 32767.0f;
+        samples[i] = (int16_t) (s > 32767.0f ? 32767.0f : (s < -32768.0f ? -32768.0f : s));
+    }
+
+    ring_push(m->audio_ring, samples, count);
+
+    // Nothing was added past count + BLIP_WIDTH, so only that much has to move
+    memmove(b.diff, b.diff + count, apu::BLIP_WIDTH * sizeof(float));
+    memset(b.diff + apu::BLIP_WIDTH, 0, count * sizeof(float));
+
+    b.offset = pos - ((uint64_t) count << 32);
+    b.cycle  = cycle;
+}
+
+static inline uint8_t get_envelope_volume(const apu::s_envelope& e)
+{
+    return e.constant ? e.volume : e.decay;
+}
+
+static void clock_envelope(apu::s_envelope& e)
+{
+    if (e.start)
+    {
+        e.start   = 0;
+        e.decay   = 15;
+        e.divider = e.volume;
+    }
+    else if (e.divider == 0)
+    {
+        e.divider = e.volume;
+        if (e.decay > 0)
+        {
+            e.decay--;
+        }
+        else if (e.loop)
+        {
+            e.decay = 15;
+        }
+    }
+    else
+    {
+        e.divider--;
+    }
+}
+
+static inline uint16_t get_sweep_target(const apu::s_pulse& p, uint32_t channel)
+{
+    uint16_t change = p.timer >> p.sweep_shift;
+    if (!p.sweep_negate)
+    {
+        return p.timer + change;
+    }
+
+    // Pulse 1 negates in ones' complement, pulse 2 in two's
+    uint16_t sub = change + (channel == 0 ? 1 : 0);
+    return sub > p.timer ? 0 : p.timer - sub;
+}
+
+static inline bool is_pulse_muted(const apu::s_pulse& p, uint32_t channel)
+{
+    return p.timer < 8 || get_sweep_target(p, channel) > 0x7ff;
+}
+
+static void clock_sweep(apu::s_pulse& p, uint32_t channel)
+{
+    if (p.sweep_divider == 0 && p.sweep_enabled && p.sweep_shift > 0 && !is_pulse_muted(p, channel))
+    {
+        p.timer = get_sweep_target(p, channel);
+    }
+
+    if (p.sweep_divider == 0 || p.sweep_reload)
+    {
+        p.sweep_divider = p.sweep_period;
+        p.sweep_reload  = 0;
+    }
+    else
+    {
+        p.sweep_divider--;
+    }
+}
+
+static void clock_linear_counter(apu::s_triangle& t)
+{
+    if (t.linear_reload)
+    {
+        t.linear = t.linear_load;
+    }
+    else if (t.linear > 0)
+    {
+        t.linear--;
+    }
+
+    if (!t.control)
+    {
+        t.linear_reload = 0;
+    }
+}
+
+static inline bool is_pulse_running(const apu::s_pulse& p, uint32_t channel)
+{
+    return p.length > 0 && !is_pulse_muted(p, channel);
+}
+
+static inline bool is_triangle_running(const apu::s_triangle& t)
+{
+    // Periods below 2 are ultrasonic, hold the current step instead
+    return t.length > 0 && t.linear > 0 && t.timer >= 2;
+}
+
+static inline bool is_dmc_running(const apu::s_dmc& d)
+{
+    return !d.silence || d.buffer_full || d.bytes_remaining > 0;
+}
+
+static inline uint64_t get_pulse_period(const apu::s_pulse& p)       { return ((uint64_t) p.timer + 1) * 2; }
+static inline uint64_t get_triangle_period(const apu::s_triangle& t) { return (uint64_t) t.timer + 1; }
+
+// Parks the timers of channels that can't change their output and restarts
+// the ones that can, from the current APU time
+static void update_timers(machine* m)
+{
+    apu::s_state& s   = m->apu_state;
+    uint64_t      now = m->apu_cycles;
+
+    for (uint32_t c = 0; c < 2; ++c)
+    {
+        apu::s_pulse& p = s.pulse[c];
+        if (!is_pulse_running(p, c))
+        {
+            p.next_clock = events::NEVER;
+        }
+        else if (p.next_clock == events::NEVER)
+        {
+            p.next_clock = now + get_pulse_period(p);
+        }
+    }
+
+    if (!is_triangle_running(s.triangle))
+    {
+        s.triangle.next_clock = events::NEVER;
+    }
+    else if (s.triangle.next_clock == events::NEVER)
+    {
+        s.triangle.next_clock = now + get_triangle_period(s.triangle);
+    }
+
+    if (s.noise.length == 0)
+    {
+        s.noise.next_clock = events::NEVER;
+    }
+    else if (s.noise.next_clock == events::NEVER)
+    {
+        s.noise.next_clock = now + noise_period_table[s.noise.period];
+    }
+
+    if (!is_dmc_running(s.dmc))
+    {
+        s.dmc.next_clock = events::NEVER;
+    }
+    else if (s.dmc.next_clock == events::NEVER)
+    {
+        s.dmc.next_clock = now + dmc_rate_table[s.dmc.rate];
+    }
+}
+
+static void dmc_fetch(machine* m)
+{
+    apu::s_dmc& d = m->apu_state.dmc;
+
+    if (d.buffer_full || d.bytes_remaining == 0)
+    {
+        return;
+    }
+
+    // The real thing also stalls the CPU for up to 4 cycles here
+    d.buffer      = cpu::read_memory(m, d.address);
+    d.buffer_full = 1;
+    d.address     = d.address == 0xffff ? 0x8000 : d.address + 1;
+
+    if (--d.bytes_remaining == 0)
+    {
+        if (d.loop)
+        {
+            d.address         = d.sample_address;
+            d.bytes_remaining = d.sample_length;
+        }
+        else if (d.irq_enabled)
+        {
+            m->apu_state.dmc_irq = 1;
+            events::signal_interrupt(m);
+        }
+    }
+}
+
+static void clock_dmc(machine* m)
+{
+    apu::s_dmc& d = m->apu_state.dmc;
+
+    if (!d.silence)
+    {
+        if (d.shift & 1)
+        {
+            if (d.level <= 125)
+            {
+                d.level += 2;
+            }
+        }
+        else if (d.level >= 2)
+        {
+            d.level -= 2;
+        }
+    }
+
+    d.shift >>= 1;
+
+    if (d.bits_remaining > 0)
+    {
+        d.bits_remaining--;
+    }
+
+    if (d.bits_remaining == 0)
+    {
+        d.bits_remaining = 8;
+        d.silence        = !d.buffer_full;
+        if (d.buffer_full)
+        {
+            d.shift       = d.buffer;
+            d.buffer_full = 0;
+            dmc_fetch(m);
+        }
+    }
+}
+
+static void clock_frame_counter(machine* m, uint8_t flags)
+{
+    apu::s_state& s = m->apu_state;
+
+    if (flags & FRAME_QUARTER)
+    {
+        clock_envelope(s.pulse[0].envelope);
+        clock_envelope(s.pulse[1].envelope);
+        clock_envelope(s.noise.envelope);
+        clock_linear_counter(s.triangle);
+    }
+
+    if (flags & FRAME_HALF)
+    {
+        for (uint32_t c = 0; c < 2; ++c)
+        {
+            apu::s_pulse& p = s.pulse[c];
+            if (p.length > 0 && !p.envelope.loop)
+            {
+                p.length--;
+            }
+            clock_sweep(p, c);
+        }
+
+        if (s.triangle.length > 0 && !s.triangle.control)
+        {
+            s.triangle.length--;
+        }
+
+        if (s.noise.length > 0 && !s.noise.envelope.loop)
+        {
+            s.noise.length--;
+        }
+    }
+
+    if ((flags & FRAME_IRQ) && !s.frame_irq_inhibit)
+    {
+        s.frame_irq = 1;
+        events::signal_interrupt(m);
+    }
+}
+
+static void step_frame_counter(machine* m)
+{
+    apu::s_state& s = m->apu_state;
+
+    clock_frame_counter(m, frame_step_flags[s.frame_mode][s.frame_step]);
+
+    if (++s.frame_step == frame_step_count[s.frame_mode])
+    {
+        s.frame_step   = 0;
+        s.frame_start += frame_period[s.frame_mode];
+    }
+
+    s.frame_next = s.frame_start + frame_step_cycles[s.frame_mode][s.frame_step];
+}
+
+static float get_amplitude(const apu::s_state& s)
+{
+    uint32_t pulse = 0;
+    for (uint32_t c = 0; c < 2; ++c)
+    {
+        const apu::s_pulse& p = s.pulse[c];
+        if (p.next_clock != events::NEVER && duty_table[p.duty][p.duty_pos])
+        {
+            pulse += get_envelope_volume(p.envelope);
+        }
+    }
+
+    uint32_t triangle = triangle_table[s.triangle.pos];
+    uint32_t noise    = (s.noise.length > 0 && !(s.noise.lfsr & 1)) ? get_envelope_volume(s.noise.envelope) : 0;
+
+    return pulse_mix_table[pulse] + tnd_mix_table[3 * triangle + 2 * noise + s.dmc.level];
+}
+
+static void update_output(machine* m, uint64_t cycle)
+{
+    apu::s_state& s         = m->apu_state;
+    float         amplitude = get_amplitude(s);
+
+    if (amplitude != s.amplitude)
+    {
+        if (m->sample_rate)
+        {
+            blip_add_delta(m, cycle, amplitude - s.amplitude);
+        }
+        s.amplitude = amplitude;
+    }
+}
+
+static uint64_t get_next_event_cycle(const machine* m)
+{
+    const apu::s_dmc& d    = m->apu_state.dmc;
+    uint64_t          next = m->apu_state.frame_next;
+
+    // The next fetch happens when the output unit runs out of bits
+    if (d.bytes_remaining > 0 && d.next_clock != events::NEVER)
+    {
+        uint64_t fetch = d.next_clock + (uint64_t) (d.bits_remaining ? d.bits_remaining - 1 : 0) * dmc_rate_table[d.rate];
+        next           = fetch < next ? fetch : next;
+    }
+
+    return next;
+}
+
+static inline uint64_t min_cycle(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+void apu::catch_up(machine* m, uint64_t cycle)
+{
+    apu::s_state& s = m->apu_state;
+
+    while(m->apu_cycles < cycle)
+    {
+        uint64_t next = min_cycle(cycle, s.frame_next);
+        next          = min_cycle(next, min_cycle(s.pulse[0].next_clock, s.pulse[1].next_clock));
+        next          = min_cycle(next, min_cycle(s.triangle.next_clock, s.noise.next_clock));
+        next          = min_cycle(next, s.dmc.next_clock);
+
+        m->apu_cycles = next;
+
+        for (uint32_t c = 0; c < 2; ++c)
+        {
+            apu::s_pulse& p = s.pulse[c];
+            if (p.next_clock == next)
+            {
+                p.duty_pos    = (p.duty_pos + 1) & 7;
+                p.next_clock += get_pulse_period(p);
+            }
+        }
+
+        if (s.triangle.next_clock == next)
+        {
+            s.triangle.pos         = (s.triangle.pos + 1) & 31;
+            s.triangle.next_clock += get_triangle_period(s.triangle);
+        }
+
+        if (s.noise.next_clock == next)
+        {
+            uint16_t lfsr          = s.noise.lfsr;
+            uint16_t feedback      = (lfsr ^ (lfsr >> (s.noise.mode ? 6 : 1))) & 1;
+            s.noise.lfsr           = (lfsr >> 1) | (feedback << 14);
+            s.noise.next_clock    += noise_period_table[s.noise.period];
+        }
+
+        if (s.dmc.next_clock == next)
+        {
+            clock_dmc(m);
+            s.dmc.next_clock += dmc_rate_table[s.dmc.rate];
+        }
+
+        if (s.frame_next == next)
+        {
+            step_frame_counter(m);
+            update_timers(m);
+
+            update_output(m, next);
+
+            // Keeps the distance between flushes well inside the blip buffer
+            if (m->sample_rate)
+            {
+                blip_flush(m, next);
+            }
+            continue;
+        }
+
+        if (s.dmc.next_clock != events::NEVER && !is_dmc_running(s.dmc))
+        {
+            update_timers(m);
+        }
+
+        update_output(m, next);
+    }
+
+    if (m->sample_rate && cycle > m->apu_blip.cycle)
+    {
+        blip_flush(m, cycle);
+    }
+
+    events::schedule(m, events::EVENT_APU, get_next_event_cycle(m));
+}
+
+void apu::catch_up_access(machine* m)
+{
+    // See ppu::catch_up_access
+    apu::catch_up(m, m->cycles > 0 ? m->cycles - 1 : 0);
+}
+
+static void write_envelope(apu::s_envelope& e, uint8_t data)
+{
+    e.loop     = (data >> 5) & 1;
+    e.constant = (data >> 4) & 1;
+    e.volume   = data & 0x0f;
+}
+
+static void write_pulse(machine* m, uint32_t channel, uint16_t addr, uint8_t data)
+{
+    apu::s_pulse& p = m->apu_state.pulse[channel];
+
+    switch(addr & 0x03)
+    {
+        case 0:
+            p.duty = data >> 6;
+            write_envelope(p.envelope, data);
+            break;
+        case 1:
+            p.sweep_enabled = data >> 7;
+            p.sweep_period  = (data >> 4) & 0x07;
+            p.sweep_negate  = (data >> 3) & 1;
+            p.sweep_shift   = data & 0x07;
+            p.sweep_reload  = 1;
+            break;
+        case 2:
+            p.timer = (p.timer & 0x0700) | data;
+            break;
+        case 3:
+            p.timer = (p.timer & 0x00ff) | ((uint16_t) (data & 0x07) << 8);
+            if (m->apu_state.enabled & (STATUS_PULSE_1 << channel))
+            {
+                p.length = length_table[data >> 3];
+            }
+            p.envelope.start = 1;
+            p.duty_pos       = 0;
+            break;
+    }
+}
+
+void apu::write_register(machine* m, uint16_t addr, uint8_t data)
+{
+    apu::s_state& s = m->apu_state;
+    apu::catch_up_access(m);
+
+    switch(addr)
+    {
+        case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+            write_pulse(m, 0, addr, data);
+            break;
+        case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+            write_pulse(m, 1, addr, data);
+            break;
+        case 0x4008:
+            s.triangle.control     = data >> 7;
+            s.triangle.linear_load = data & 0x7f;
+            break;
+        case 0x400A:
+            s.triangle.timer = (s.triangle.timer & 0x0700) | data;
+            break;
+        case 0x400B:
+            s.triangle.timer = (s.triangle.timer & 0x00ff) | ((uint16_t) (data & 0x07) << 8);
+            if (s.enabled & STATUS_TRIANGLE)
+            {
+                s.triangle.length = length_table[data >> 3];
+            }
+            s.triangle.linear_reload = 1;
+            break;
+        case 0x400C:
+            write_envelope(s.noise.envelope, data);
+            break;
+        case 0x400E:
+            s.noise.mode   = data >> 7;
+            s.noise.period = data & 0x0f;
+            break;
+        case 0x400F:
+            if (s.enabled & STATUS_NOISE)
+            {
+                s.noise.length = length_table[data >> 3];
+            }
+            s.noise.envelope.start = 1;
+            break;
+        case 0x4010:
+            s.dmc.irq_enabled = data >> 7;
+            s.dmc.loop        = (data >> 6) & 1;
+            s.dmc.rate        = data & 0x0f;
+            if (!s.dmc.irq_enabled)
+            {
+                s.dmc_irq = 0;
+            }
+            break;
+        case 0x4011:
+            s.dmc.level = data & 0x7f;
+            break;
+        case 0x4012:
+            s.dmc.sample_address = 0xc000 | ((uint16_t) data << 6);
+            break;
+        case 0x4013:
+            s.dmc.sample_length = ((uint16_t) data << 4) + 1;
+            break;
+        case 0x4015:
+            s.enabled = data & 0x1f;
+            if (!(data & STATUS_PULSE_1))  s.pulse[0].length = 0;
+            if (!(data & STATUS_PULSE_2))  s.pulse[1].length = 0;
+            if (!(data & STATUS_TRIANGLE)) s.triangle.length = 0;
+            if (!(data & STATUS_NOISE))    s.noise.length    = 0;
+
+            if (!(data & STATUS_DMC))
+            {
+                s.dmc.bytes_remaining = 0;
+            }
+            else if (s.dmc.bytes_remaining == 0)
+            {
+                s.dmc.address         = s.dmc.sample_address;
+                s.dmc.bytes_remaining = s.dmc.sample_length;
+                dmc_fetch(m);
+            }
+            s.dmc_irq = 0;
+            break;
+        case 0x4017:
+            s.frame_mode        = data >> 7;
+            s.frame_irq_inhibit = (data >> 6) & 1;
+            if (s.frame_irq_inhibit)
+            {
+                s.frame_irq = 0;
+            }
+
+            // The sequence restarts, 5 step mode clocks everything right away
+            s.frame_start = m->apu_cycles;
+            s.frame_step  = 0;
+            s.frame_next  = s.frame_start + frame_step_cycles[s.frame_mode][0];
+            if (s.frame_mode)
+            {
+                clock_frame_counter(m, FRAME_QUARTER | FRAME_HALF);
+            }
+            break;
+    }
+
+    update_timers(m);
+    update_output(m, m->apu_cycles);
+    events::schedule(m, events::EVENT_APU, get_next_event_cycle(m));
+}
+
+uint8_t apu::read_status(machine* m)
+{
+    apu::s_state& s = m->apu_state;
+    apu::catch_up_access(m);
+
+    uint8_t status = (s.pulse[0].length     ? STATUS_PULSE_1   : 0) |
+                     (s.pulse[1].length     ? STATUS_PULSE_2   : 0) |
+                     (s.triangle.length     ? STATUS_TRIANGLE  : 0) |
+                     (s.noise.length        ? STATUS_NOISE     : 0) |
+                     (s.dmc.bytes_remaining ? STATUS_DMC       : 0) |
+                     (s.frame_irq           ? STATUS_FRAME_IRQ : 0) |
+                     (s.dmc_irq             ? STATUS_DMC_IRQ   : 0);
+
+    s.frame_irq = 0;
+    return status;
+}
+
+uint32_t apu::get_ring_space(machine* m)
+{
+    const apu::s_ring& r = m->audio_ring;
+    return apu::RING_SIZE - (r.write_pos - __atomic_load_n(&r.read_pos, __ATOMIC_ACQUIRE));
+}
+
+void apu::initialize(machine* m)
+{
+    pthread_once(&tables_once, build_tables);
+
+    memset(&m->apu_state, 0, sizeof(m->apu_state));
+    memset(&m->apu_blip, 0, sizeof(m->apu_blip));
+    memset(&m->audio_ring, 0, sizeof(m->audio_ring));
+
+    apu::s_state& s = m->apu_state;
+    s.pulse[0].next_clock = events::NEVER;
+    s.pulse[1].next_clock = events::NEVER;
+    s.triangle.next_clock = events::NEVER;
+    s.noise.next_clock    = events::NEVER;
+    s.dmc.next_clock      = events::NEVER;
+    s.noise.lfsr          = 1;
+    s.dmc.silence         = 1;
+    s.dmc.bits_remaining  = 8;
+    s.dmc.sample_address  = 0xc000;
+    s.dmc.sample_length   = 1;
+    s.frame_start         = m->cycles;
+    s.frame_next          = m->cycles + frame_step_cycles[0][0];
+    s.amplitude           = get_amplitude(s);
+
+    m->apu_cycles = m->cycles;
+    noose::set_audio_rate(m, apu::DEFAULT_SAMPLE_RATE);
+
+    events::schedule(m, events::EVENT_APU, get_next_event_cycle(m));
+}
+
+// Drops whatever is still in the blip buffer and continues from the APU's
+// current time, for when that time jumps (rate change, state restore)
+void apu::restart_output(machine* m)
+{
+    apu::s_blip& b = m->apu_blip;
+
+    memset(b.diff, 0, sizeof(b.diff));
+    b.cycle  = m->apu_cycles;
+    b.offset = 0;
+}
+
+void noose::set_audio_rate(noose::machine* m, uint32_t sample_rate)
+{
+    apu::s_blip& b = m->apu_blip;
+
+    if (m->sample_rate)
+    {
+        apu::catch_up(m, m->cycles);
+    }
+
+    m->sample_rate = sample_rate;
+    b.factor       = (uint64_t) ((double) sample_rate / apu::CPU_CLOCK_RATE * 4294967296.0);
+    apu::restart_output(m);
+}
+
+uint32_t noose::read_audio(noose::machine* m, int16_t* out, uint32_t max_samples)
+{
+    apu::s_ring& r     = m->audio_ring;
+    uint32_t     read  = r.read_pos;
+    uint32_t     write = __atomic_load_n(&r.write_pos, __ATOMIC_ACQUIRE);
+    uint32_t     count = write - read;
+
+    if (count > max_samples)
+    {
+        count = max_samples;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        out[i] = r.samples[(read + i) & (apu::RING_SIZE - 1)];
+    }
+
+    __atomic_store_n(&r.read_pos, read + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/*
+Headless WAV capture. The emulation runs on its own thread and the calling
+thread drains the ring into the file, so both ends of the ring get
+exercised the way a frontend would use them. The producer waits for room
+instead of dropping samples.
+*/
+
+struct s_wav_capture
+{
+    machine*     m;
+    uint32_t     frame_count;
+    volatile int done;
+};
+
+static void write_u32(FILE* f, uint32_t v)
+{
+    uint8_t b[4] = { (uint8_t) v, (uint8_t) (v >> 8), (uint8_t) (v >> 16), (uint8_t) (v >> 24) };
+    fwrite(b, 1, 4, f);
+}
+
+static void write_u16(FILE* f, uint16_t v)
+{
+    uint8_t b[2] = { (uint8_t) v, (uint8_t) (v >> 8) };
+    fwrite(b, 1, 2, f);
+}
+
+static void write_wav_header(FILE* f, uint32_t sample_rate, uint32_t sample_count)
+{
+    uint32_t data_size = sample_count * 2;
+
+    fwrite("RIFF", 1, 4, f);
+    write_u32(f, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, f);
+    write_u32(f, 16);              // fmt chunk size
+    write_u16(f, 1);               // PCM
+    write_u16(f, 1);               // mono
+    write_u32(f, sample_rate);
+    write_u32(f, sample_rate * 2); // bytes per second
+    write_u16(f, 2);               // block align
+    write_u16(f, 16);              // bits per sample
+    fwrite("data", 1, 4, f);
+    write_u32(f, data_size);
+}
+
+static void* wav_producer_main(void* arg)
+{
+    s_wav_capture* capture = (s_wav_capture*) arg;
+
+    for (uint32_t i = 0; i < capture->frame_count; ++i)
+    {
+        // A frame is well under 1024 samples at any sane rate
+        while(apu::get_ring_space(capture->m) < 2048)
+        {
+            sched_yield();
+        }
+        noose::run_until_frame(capture->m);
+    }
+
+    __atomic_store_n(&capture->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+bool noose::record_wav(const noose::rom* rom, const char* wav_path, uint32_t frame_count, uint32_t sample_rate)
+{
+    FILE* f = fopen(wav_path, "wb");
+    if (!f)
+    {
+        noose::error("Unable to open WAV file for writing");
+        return false;
+    }
+
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        fclose(f);
+        return false;
+    }
+
+    noose::set_audio_rate(m, sample_rate);
+    write_wav_header(f, sample_rate, 0);
+
+    s_wav_capture capture = { m, frame_count, 0 };
+    pthread_t     producer;
+    pthread_create(&producer, 0, wav_producer_main, &capture);
+
+    uint32_t sample_count = 0;
+    int16_t  samples[4096];
+
+    while(true)
+    {
+        bool     done  = __atomic_load_n(&capture.done, __ATOMIC_ACQUIRE) != 0;
+        uint32_t count = noose::read_audio(m, samples, sizeof(samples) / sizeof(samples[0]));
+
+        // WAV is little endian, so is everything this builds on
+        fwrite(samples, sizeof(int16_t), count, f);
+        sample_count += count;
+
+        if (count == 0)
+        {
+            if (done)
+            {
+                break;
+            }
+            sched_yield();
+        }
+    }
+
+    pthread_join(producer, 0);
+
+    fseek(f, 0, SEEK_SET);
+    write_wav_header(f, sample_rate, sample_count);
+    fclose(f);
+
+    printf("Wrote %u samples (%.2f s at %u Hz) to %s\n", sample_count, (double) sample_count / sample_rate, sample_rate, wav_path);
+
+    noose::destroy_machine(m);
+    return true;
+}
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "noose.h"
+
+#include "noose_internal.h"
+
+/*
+Headless batch runner. The manifest has one job per line:
+
+    <rom path> <cycle budget> [input movie]
+
+The movie, if given, is replayed from its anchor until it ends or the budget
+runs out, the rest of the budget runs without input. Blank lines and lines starting with # are skipped. Jobs are dealt out in
+contiguous runs to per-worker deques; a worker pops from the back of its own
+deque and, once that is empty, steals from the front of the others. Every
+job gets its own machine, so workers never share emulator state.
+*/
+
+static const uint32_t BATCH_PATH_SIZE = 1024;
+
+enum batch_status
+{
+    BATCH_STATUS_PENDING,
+    BATCH_STATUS_OK,
+    BATCH_STATUS_FAILED,
+};
+
+struct s_batch_job
+{
+    char         rom_path[BATCH_PATH_SIZE];
+    char         input_path[BATCH_PATH_SIZE];
+    uint64_t     cycle_budget;
+    uint64_t     cycles;
+    double       seconds;
+    batch_status status;
+    char         error[128];
+};
+
+struct s_batch_queue
+{
+    pthread_mutex_t lock;
+    uint32_t*       jobs;
+    uint32_t        head; // thieves take from here
+    uint32_t        tail; // the owner takes from here
+};
+
+struct s_batch_pool
+{
+    s_batch_job*   jobs;
+    s_batch_queue* queues;
+    uint32_t       queue_count;
+};
+
+struct s_batch_worker
+{
+    s_batch_pool* pool;
+    uint32_t      index;
+    uint32_t      steals;
+    pthread_t     thread;
+};
+
+static bool parse_manifest_line(char* line, s_batch_job* out)
+{
+    char* rom_path = strtok(line, " \t\r\n");
+    if (!rom_path || rom_path[0] == '#')
+    {
+        return false;
+    }
+
+    char* budget     = strtok(0, " \t\r\n");
+    char* input_path = strtok(0, " \t\r\n");
+
+    memset(out, 0, sizeof(*out));
+    strncpy(out->rom_path, rom_path, sizeof(out->rom_path) - 1);
+    if (input_path)
+    {
+        strncpy(out->input_path, input_path, sizeof(out->input_path) - 1);
+    }
+
+    out->cycle_budget = budget ? strtoull(budget, 0, 10) : 0;
+    if (out->cycle_budget == 0)
+    {
+        out->status = BATCH_STATUS_FAILED;
+        strcpy(out->error, "Missing cycle budget");
+    }
+
+    return true;
+}
+
+static bool read_manifest(const char* manifest_path, s_batch_job** jobs_out, uint32_t* count_out)
+{
+    FILE* f = fopen(manifest_path, "r");
+    if (!f)
+    {
+        noose::error("Unable to open batch manifest");
+        return false;
+    }
+
+    s_batch_job* jobs     = 0;
+    uint32_t     count    = 0;
+    uint32_t     capacity = 0;
+    char         line[BATCH_PATH_SIZE * 2 + 64];
+
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs     = (s_batch_job*) realloc(jobs, capacity * sizeof(s_batch_job));
+        }
+
+        if (parse_manifest_line(line, &jobs[count]))
+        {
+            count++;
+        }
+    }
+
+    fclose(f);
+
+    *jobs_out  = jobs;
+    *count_out = count;
+    return true;
+}
+
+static void take_first_error(s_batch_job* job, const char* fallback)
+{
+    const char* e = noose::has_errors() ? noose::last_error() : fallback;
+    strncpy(job->error, e, sizeof(job->error) - 1);
+
+    // Drain the rest, the worker's queue is reused for the next job
+    while(noose::has_errors())
+    {
+        noose::last_error();
+    }
+}
+
+static void run_job(s_batch_job* job)
+{
+    if (job->status == BATCH_STATUS_FAILED)
+    {
+        return;
+    }
+
+    noose::movie* mv = 0;
+    if (job->input_path[0])
+    {
+        mv = noose::load_movie(job->input_path);
+        if (!mv)
+        {
+            job->status = BATCH_STATUS_FAILED;
+            take_first_error(job, "Unable to load input movie");
+            return;
+        }
+    }
+
+    noose::rom rom = {};
+    if (!noose::load_rom(job->rom_path, &rom, noose::LOAD_MODE_MMAP))
+    {
+        job->status = BATCH_STATUS_FAILED;
+        take_first_error(job, "Unable to load rom");
+        noose::destroy_movie(mv);
+        return;
+    }
+
+    noose::machine* m = mv ? noose::start_movie(mv, &rom) : noose::create_machine(&rom);
+    if (!m)
+    {
+        job->status = BATCH_STATUS_FAILED;
+        take_first_error(job, "Unable to create machine");
+        noose::destroy_movie(mv);
+        noose::reset_rom(&rom);
+        return;
+    }
+
+    double start = noose::get_time_seconds();
+
+    while(mv && m->cycles < job->cycle_budget && noose::play_movie_frame(mv, m))
+    {
+    }
+
+    // run_cycles takes 32 bit budgets, feed long jobs in slices
+    while(m->cycles < job->cycle_budget)
+    {
+        uint64_t left = job->cycle_budget - m->cycles;
+        noose::run_cycles(m, left > 0x10000000 ? 0x10000000 : (uint32_t) left);
+    }
+
+    job->seconds = noose::get_time_seconds() - start;
+    job->cycles  = m->cycles;
+    job->status  = BATCH_STATUS_OK;
+
+    noose::destroy_machine(m);
+    noose::destroy_movie(mv);
+    noose::reset_rom(&rom);
+}
+
+static bool pop_job(s_batch_queue* q, uint32_t* job_out)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+    {
+        *job_out = q->jobs[--q->tail];
+        found    = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+static bool steal_job(s_batch_queue* q, uint32_t* job_out)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+    {
+        *job_out = q->jobs[q->head++];
+        found    = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+static void* batch_worker_main(void* arg)
+{
+    s_batch_worker* worker = (s_batch_worker*) arg;
+    s_batch_pool*   pool   = worker->pool;
+    uint32_t        job;
+
+    while(true)
+    {
+        if (pop_job(&pool->queues[worker->index], &job))
+        {
+            run_job(&pool->jobs[job]);
+            continue;
+        }
+
+        // Jobs never spawn more jobs, so a full round of failed steals means
+        // everything has been handed out
+        bool stolen = false;
+        for (uint32_t i = 1; i < pool->queue_count && !stolen; ++i)
+        {
+            stolen = steal_job(&pool->queues[(worker->index + i) % pool->queue_count], &job);
+        }
+
+        if (!stolen)
+        {
+            break;
+        }
+
+        worker->steals++;
+        run_job(&pool->jobs[job]);
+    }
+
+    return 0;
+}
+
+static void print_batch_results(const s_batch_job* jobs, uint32_t job_count, uint32_t thread_count, uint32_t steals, double wall_seconds)
+{
+    uint64_t total_cycles = 0;
+    double   busy_seconds = 0.0;
+    uint32_t ok_count     = 0;
+
+    printf("rom,status,cycles,seconds,cycles_per_sec,error\n");
+
+    for (uint32_t i = 0; i < job_count; ++i)
+    {
+        const s_batch_job& job = jobs[i];
+        if (job.status == BATCH_STATUS_OK)
+        {
+            double cps = job.seconds > 0.0 ? job.cycles / job.seconds : 0.0;
+            printf("\"%s\",ok,%llu,%.6f,%.0f,\n", job.rom_path, (unsigned long long) job.cycles, job.seconds, cps);
+
+            total_cycles += job.cycles;
+            busy_seconds += job.seconds;
+            ok_count++;
+        }
+        else
+        {
+            printf("\"%s\",failed,0,0,0,\"%s\"\n", job.rom_path, job.error);
+        }
+    }
+
+    printf("\n");
+    printf("Jobs            : %u ok, %u failed\n", ok_count, job_count - ok_count);
+    printf("Threads         : %u (%u steals)\n", thread_count, steals);
+    printf("Emulated cycles : %llu\n", (unsigned long long) total_cycles);
+    printf("Wall time       : %.3f s\n", wall_seconds);
+    printf("Aggregate       : %.0f cycles/s\n", wall_seconds > 0.0 ? total_cycles / wall_seconds : 0.0);
+    printf("Per thread      : %.0f cycles/s\n", busy_seconds > 0.0 ? total_cycles / busy_seconds : 0.0);
+}
+
+bool noose::run_batch(const char* manifest_path, uint32_t thread_count)
+{
+    s_batch_job* jobs      = 0;
+    uint32_t     job_count = 0;
+
+    if (!read_manifest(manifest_path, &jobs, &job_count))
+    {
+        return false;
+    }
+
+    if (thread_count == 0)
+    {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count   = cpu_count > 0 ? (uint32_t) cpu_count : 1;
+    }
+
+    if (thread_count > job_count)
+    {
+        thread_count = job_count > 0 ? job_count : 1;
+    }
+
+    s_batch_pool pool;
+    pool.jobs        = jobs;
+    pool.queue_count = thread_count;
+    pool.queues      = (s_batch_queue*) malloc(thread_count * sizeof(s_batch_queue));
+
+    uint32_t* order = (uint32_t*) malloc((job_count > 0 ? job_count : 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < job_count; ++i)
+    {
+        order[i] = i;
+    }
+
+    // Contiguous runs keep neighbouring manifest entries on one worker
+    // until someone runs dry and starts stealing
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        s_batch_queue& q = pool.queues[i];
+        pthread_mutex_init(&q.lock, 0);
+        q.jobs = order;
+        q.head = (uint32_t) ((uint64_t) job_count * i / thread_count);
+        q.tail = (uint32_t) ((uint64_t) job_count * (i + 1) / thread_count);
+    }
+
+    s_batch_worker* workers = (s_batch_worker*) malloc(thread_count * sizeof(s_batch_worker));
+    double          start   = noose::get_time_seconds();
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        workers[i].pool   = &pool;
+        workers[i].index  = i;
+        workers[i].steals = 0;
+        pthread_create(&workers[i].thread, 0, batch_worker_main, &workers[i]);
+    }
+
+    uint32_t steals = 0;
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        pthread_join(workers[i].thread, 0);
+        steals += workers[i].steals;
+    }
+
+    print_batch_results(jobs, job_count, thread_count, steals, noose::get_time_seconds() - start);
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+
+    free(workers);
+    free(order);
+    free(pool.queues);
+    free(jobs);
+
+    return true;
+}
@@ -2,21 +2,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "noose_internal.h"
 
 using namespace noose;
 
-uint8_t  cpu::prg_rom[32767];
-uint8_t  cpu::ram[2048];
-uint8_t  cpu::a;
-uint8_t  cpu::x;
-uint8_t  cpu::y;
-uint8_t  cpu::p;
-uint8_t  cpu::sp;
-uint16_t cpu::pc;
+// Every opcode is decoded once into this table by the first cpu::initialize,
+// stepping is then just a lookup on the fetched opcode. The table is never
+// written again, so all machines share it.
+static cpu::instruction decode_table[256];
+static pthread_once_t   decode_table_once = PTHREAD_ONCE_INIT;
+
+#if defined(NOOSE_CPU_THREADED)
+// Direct-threaded back end: every action in the decode table is resolved to
+// a handler that has the address operands folded in, so execute can chain
+// handlers with computed gotos instead of switching on id/address/behaviour.
+enum threaded_op
+{
+    OP_END,
+    OP_NOP,
+    OP_INCREMENT_PC,
+    OP_COPY_SHORT_PC_PTR_ADVANCE_TO_TEMP,
+    OP_COPY_SHORT_TEMP_TO_PC,
+    OP_COPY_BYTE_PC_PTR_ADVANCE_TO_TEMP_LO,
+    OP_COPY_BYTE_PC_PTR_ADVANCE_TO_X_SET_FLAGS,
+    OP_WRITE_BYTE_X_TO_TEMP_LO,
+    OP_GENERIC, // anything without a fused handler goes through do_action
+};
 
-// Extra address locations
-static uint16_t address_temp;
+static uint8_t threaded_table[256][cpu::MAX_INSTRUCTION_CYCLES + 1];
+#endif
 
 static cpu::instruction_meta instruction_meta_table[] = {
     { "NOP",     cpu::FUNC_NOP },
@@ -50,6 +65,8 @@ static cpu::instruction_meta instruction_meta_table[] = {
     { "JSR",     cpu::FUNC_JSR },
     { "RTI",     cpu::FUNC_NOP },
     { "RTS",     cpu::FUNC_NOP },
+    // 11, all unofficial and decoded as a plain NOP
+    { "???",     cpu::FUNC_NOP },
 };
 
 struct address_mode_lut_entry
@@ -88,6 +105,16 @@ static address_mode_lut_entry address_mode_lut[] =
     {cpu::MODE_ZEROPAGE_X_INDEXED, "MODE_ZEROPAGE_X_INDEXED"},
     {cpu::MODE_UNUSED,             "MODE_UNUSED"},
     {cpu::MODE_ABSOLUTE_X_INDEXED, "MODE_ABSOLUTE_X_INDEXED"},
+
+    // CC 11
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
+    {cpu::MODE_UNUSED,             "MODE_UNUSED"},
 };
 
 #define ADD_ACTION_COPY(type, f, t, b) \
@@ -216,80 +243,201 @@ static uint8_t fill_action_list(const cpu::instruction_meta meta, cpu::address_m
 #undef ADD_ACTION_WRITE_BYTE
 #undef ADD_ACTION_NOP
 
-static void do_action_copy_short(const cpu::action action)
+static uint8_t get_instruction_length(const cpu::instruction& inst)
 {
-    uint16_t data = 0x0;
-    switch(action.copy_short_data.from)
+    switch(inst.code)
     {
-        case cpu::ADDRESS_PC_PTR_ADVANCE:
-            data     = ((uint16_t) cpu::read_memory(cpu::pc + 1) << 8) | cpu::read_memory(cpu::pc);
-            cpu::pc += 0x02;
-            break;
-        case cpu::ADDRESS_TEMP:
-            data = address_temp;
-            break;
+        case 0x00: return 1; // BRK
+        case 0x20: return 3; // JSR
+        case 0x40: return 1; // RTI
+        case 0x60: return 1; // RTS
     }
 
-    switch(action.copy_short_data.to)
+    // Branches are xxy10000
+    if ((inst.code & 0x1f) == 0x10)
     {
-        case cpu::ADDRESS_TEMP:
-            address_temp = data;
-            break;
-        case cpu::ADDRESS_PC:
-            cpu::pc = data;
-            break;
+        return 2;
     }
+
+    switch(inst.address_mode)
+    {
+        case cpu::MODE_ABSOLUTE:
+        case cpu::MODE_ABSOLUTE_X_INDEXED:
+        case cpu::MODE_ABSOLUTE_y_INDEXED:
+        case cpu::MODE_INDIRECT:
+            return 3;
+        case cpu::MODE_IMMEDIATE:
+        case cpu::MODE_X_INDEXED_INDIRECT:
+        case cpu::MODE_INDIRECT_Y_INDEXED:
+        case cpu::MODE_RELATIVE:
+        case cpu::MODE_ZEROPAGE:
+        case cpu::MODE_ZEROPAGE_X_INDEXED:
+        case cpu::MODE_ZEROPAGE_Y_INDEXED:
+            return 2;
+    }
+
+    return 1;
 }
 
-static void do_behaviour(const cpu::action_behaviour behaviour, uint8_t result)
+static void decode_instruction(uint8_t code, cpu::instruction* inst)
 {
-    switch(behaviour.id)
+    const uint8_t cc_bits  = 0x03;
+    const uint8_t bbb_bits = 0x07;
+    const uint8_t aaa_bits = 0x07;
+
+    *inst              = cpu::instruction();
+    inst->code         = code;
+    inst->bits.cc      = code & cc_bits;
+    inst->bits.bbb     = (code >> 2) & bbb_bits;
+    inst->bits.aaa     = (code >> 5) & aaa_bits;
+    inst->address_mode = cpu::get_address_mode(*inst);
+    inst->length       = get_instruction_length(*inst);
+
+    // fetching the instruction and increasing pc is always the first cycle
+    cpu::instruction_meta meta = cpu::get_instruction_meta(*inst);
+    inst->cycles[0]            = cpu::action(cpu::ID_INCREMENT_PC);
+    inst->cycle_count          = 1 + fill_action_list(meta, inst->address_mode, &inst->cycles[1]);
+
+    assert(inst->cycle_count <= cpu::MAX_INSTRUCTION_CYCLES);
+}
+
+#if defined(NOOSE_CPU_THREADED)
+static uint8_t resolve_threaded_op(const cpu::action& action)
+{
+    switch(action.id)
     {
-        case cpu::ID_SET_FLAGS:
+        case cpu::ID_NOP:          return OP_NOP;
+        case cpu::ID_INCREMENT_PC: return OP_INCREMENT_PC;
+        case cpu::ID_COPY_SHORT:
         {
-            uint8_t mask = behaviour.set_flags_data.mask;
-            /*
-            if (mask & cpu::CPU_FLAG_CARRY)
-            {
+            cpu::action_address from = action.copy_short_data.from;
+            cpu::action_address to   = action.copy_short_data.to;
 
+            if (action.behaviour.id != cpu::ID_NONE)
+            {
+                break;
             }
-            */
-            if (mask & cpu::CPU_FLAG_ZERO && result == 0x0)
+            if (from == cpu::ADDRESS_PC_PTR_ADVANCE && to == cpu::ADDRESS_TEMP)
             {
-                cpu::p |= cpu::CPU_FLAG_ZERO;
+                return OP_COPY_SHORT_PC_PTR_ADVANCE_TO_TEMP;
             }
-            /*
-            if (mask & cpu::CPU_FLAG_IR_DISABLED)
+            if (from == cpu::ADDRESS_TEMP && to == cpu::ADDRESS_PC)
             {
+                return OP_COPY_SHORT_TEMP_TO_PC;
+            }
+        } break;
+        case cpu::ID_COPY_BYTE:
+        {
+            cpu::action_address from = action.copy_byte_data.from;
+            cpu::action_address to   = action.copy_byte_data.to;
 
+            if (from != cpu::ADDRESS_PC_PTR_ADVANCE)
+            {
+                break;
             }
-            if (mask & cpu::CPU_FLAG_DECIMAL)
+            if (to == cpu::ADDRESS_TEMP_LO && action.behaviour.id == cpu::ID_NONE)
             {
-
+                return OP_COPY_BYTE_PC_PTR_ADVANCE_TO_TEMP_LO;
             }
-            if (mask & cpu::CPU_FLAG_OVERFLOW)
+            if (to == cpu::ADDRESS_X && action.behaviour.id == cpu::ID_SET_FLAGS)
             {
-
+                return OP_COPY_BYTE_PC_PTR_ADVANCE_TO_X_SET_FLAGS;
             }
-            if (mask & cpu::CPU_FLAG_NEGATIVE)
+        } break;
+        case cpu::ID_WRITE_BYTE:
+        {
+            if (action.write_byte_data.from == cpu::ADDRESS_X &&
+                action.write_byte_data.address == cpu::ADDRESS_TEMP_LO)
             {
-
+                return OP_WRITE_BYTE_X_TO_TEMP_LO;
             }
-            */
         } break;
     }
+
+    return OP_GENERIC;
+}
+#endif
+
+static void build_decode_table()
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        decode_instruction((uint8_t) i, &decode_table[i]);
+
+#if defined(NOOSE_CPU_THREADED)
+        const cpu::instruction& inst = decode_table[i];
+        for (int c = 0; c < inst.cycle_count; ++c)
+        {
+            threaded_table[i][c] = resolve_threaded_op(inst.cycles[c]);
+        }
+        threaded_table[i][inst.cycle_count] = OP_END;
+#endif
+    }
+}
+
+static void do_action_copy_short(machine* m, const cpu::action& action)
+{
+    uint16_t data = 0x0;
+    switch(action.copy_short_data.from)
+    {
+        case cpu::ADDRESS_PC_PTR_ADVANCE:
+            data  = ((uint16_t) cpu::read_memory(m, m->pc + 1) << 8) | cpu::read_memory(m, m->pc);
+            m->pc += 0x02;
+            break;
+        case cpu::ADDRESS_TEMP:
+            data = m->address_temp;
+            break;
+    }
+
+    switch(action.copy_short_data.to)
+    {
+        case cpu::ADDRESS_TEMP:
+            m->address_temp = data;
+            break;
+        case cpu::ADDRESS_PC:
+            m->pc = data;
+            break;
+    }
+}
+
+// Most flag updates are overwritten by the next instruction before anything
+// looks at p, so instructions only store their result and N/Z/C/V are worked
+// out in get_status. For an add the result would be a + b + carry in 16 bits
+// and overflow (a ^ result) & (b ^ result). Flags the new result doesn't
+// cover but that are still pending from the last one are settled first.
+static inline void defer_flags(machine* m, uint8_t mask, uint16_t result, uint8_t overflow = 0)
+{
+    if (m->flags_lazy & ~mask)
+    {
+        cpu::set_status(m, cpu::get_status(m));
+    }
+
+    m->flags_result   = result;
+    m->flags_overflow = overflow;
+    m->flags_lazy    |= mask;
 }
 
-static void do_action(const cpu::action action)
+static void do_behaviour(machine* m, const cpu::action_behaviour& behaviour, uint8_t result)
+{
+    switch(behaviour.id)
+    {
+        case cpu::ID_SET_FLAGS:
+        {
+            defer_flags(m, behaviour.set_flags_data.mask, result);
+        } break;
+    }
+}
+
+static void do_action(machine* m, const cpu::action& action)
 {
     switch(action.id)
     {
         case cpu::ID_INCREMENT_PC:
-            cpu::pc += 0x01;
+            m->pc += 0x01;
             break;
         case cpu::ID_COPY_SHORT:
         {
-            do_action_copy_short(action);
+            do_action_copy_short(m, action);
         } break;
         case cpu::ID_READ_BYTE:
         {
@@ -297,18 +445,18 @@ static void do_action(const cpu::action action)
             switch(action.read_byte_data.address)
             {
                 case cpu::ADDRESS_TEMP:
-                    data = address_temp;
+                    data = m->address_temp;
                     break;
             }
 
             switch(action.read_byte_data.to)
             {
                 case cpu::ADDRESS_X:
-                    cpu::x = data;
+                    m->x = data;
                     break;
             }
 
-            do_behaviour(action.behaviour, data);
+            do_behaviour(m, action.behaviour, data);
 
         } break;
         case cpu::ID_WRITE_BYTE:
@@ -317,14 +465,14 @@ static void do_action(const cpu::action action)
             switch(action.write_byte_data.from)
             {
                 case cpu::ADDRESS_X:
-                    data = cpu::x;
+                    data = m->x;
                     break;
             }
 
             switch(action.write_byte_data.address)
             {
                 case cpu::ADDRESS_TEMP_LO:
-                    cpu::write_memory((uint16_t) address_temp & 0xf, data);
+                    cpu::write_memory(m, (uint16_t) m->address_temp & 0xf, data);
                     break;
             }
         } break;
@@ -334,26 +482,26 @@ static void do_action(const cpu::action action)
             switch(action.copy_byte_data.from)
             {
                 case cpu::ADDRESS_PC_ADVANCE:
-                    data     = cpu::pc;
-                    cpu::pc += 0x01;
+                    data  = m->pc;
+                    m->pc += 0x01;
                     break;
                 case cpu::ADDRESS_PC_PTR_ADVANCE:
-                    data     = cpu::read_memory(cpu::pc);
-                    cpu::pc += 0x01;
+                    data  = cpu::read_memory(m, m->pc);
+                    m->pc += 0x01;
                     break;
             }
 
             switch(action.copy_byte_data.to)
             {
                 case cpu::ADDRESS_X:
-                    cpu::x = data;
+                    m->x = data;
                     break;
                 case cpu::ADDRESS_TEMP_LO:
-                    address_temp = (address_temp & 0xf0) + (uint16_t) data;
+                    m->address_temp = (m->address_temp & 0xf0) + (uint16_t) data;
                     break;
             }
 
-            do_behaviour(action.behaviour, data);
+            do_behaviour(m, action.behaviour, data);
 
         } break;
         case cpu::ID_NOP:
@@ -361,46 +509,211 @@ static void do_action(const cpu::action action)
     }
 }
 
-void cpu::initialize(const rom* rom)
+uint8_t cpu::open_bus_read(machine*, uint16_t addr)
+{
+    // Nothing drives the bus, what's left on it is the high byte of the address
+    return addr >> 8;
+}
+
+void cpu::open_bus_write(machine*, uint16_t, uint8_t)
+{
+}
+
+static uint8_t read_controller(machine* m, uint32_t port)
+{
+    // While strobed the shift register keeps reloading, so only A comes out
+    if (m->pad_strobe)
+    {
+        m->pad_shift[port] = m->pad_buttons[port];
+    }
+
+    // Ones come out after the eighth read, the upper bits are open bus
+    uint8_t bit        = m->pad_shift[port] & 1;
+    m->pad_shift[port] = (m->pad_shift[port] >> 1) | 0x80;
+    return bit | 0x40;
+}
+
+static uint8_t io_read(machine* m, uint16_t addr)
+{
+    if (addr == 0x4015)
+    {
+        return apu::read_status(m);
+    }
+    else if (addr == 0x4016 || addr == 0x4017)
+    {
+        return read_controller(m, addr - 0x4016);
+    }
+
+    return cpu::open_bus_read(m, addr);
+}
+
+static void io_write(machine* m, uint16_t addr, uint8_t data)
+{
+    if (addr == 0x4014)
+    {
+        ppu::oam_dma(m, data);
+    }
+    else if (addr == 0x4016)
+    {
+        m->pad_strobe = data & 1;
+        if (m->pad_strobe)
+        {
+            m->pad_shift[0] = m->pad_buttons[0];
+            m->pad_shift[1] = m->pad_buttons[1];
+        }
+    }
+    else if (addr <= 0x4017)
+    {
+        apu::write_register(m, addr, data);
+    }
+}
+
+static bool initialize_memory_map(machine* m, const rom* rom)
 {
-    memset(ram, 0, sizeof(ram));
-    memset(prg_rom, 0, sizeof(prg_rom));
-    a  = 0;
-    x  = 0;
-    y  = 0;
-    p  = 34;
-    sp = 0xFD;
-    pc = 0;
+    cpu::map_handler(m, 0x0000, 0x10000, cpu::open_bus_read, cpu::open_bus_write);
+
+    // $0000-$1FFF: 2kb of RAM mirrored four times
+    for (uint32_t mirror = 0x0000; mirror < 0x2000; mirror += sizeof(m->ram))
+    {
+        cpu::map_memory(m, mirror, sizeof(m->ram), m->ram, true);
+    }
+
+    // $2000-$3FFF
+    ppu::initialize(m);
 
-    memcpy(prg_rom, rom->data_prg, rom->header.page_count_prg * BLOCK_SIZE_PRG);
+    // $4000-$40FF: APU, OAM DMA and controllers
+    apu::initialize(m);
+    cpu::map_handler(m, 0x4000, 0x100, io_read, io_write);
+
+    // $6000-$FFFF belongs to the cartridge
+    return mapper::initialize(m, rom);
+}
+
+void cpu::initialize_tables()
+{
+    pthread_once(&decode_table_once, build_decode_table);
 }
 
-uint8_t cpu::read_memory(uint16_t addr)
+bool cpu::initialize(machine* m, const rom* rom)
 {
-    if (addr >= 0x8000)
+    memset(m->ram, 0, sizeof(m->ram));
+    m->a  = 0;
+    m->x  = 0;
+    m->y  = 0;
+    m->sp = 0xFD;
+    m->pc = 0;
+    cpu::set_status(m, 34);
+
+    m->cycles = 0;
+
+    cpu::initialize_tables();
+
+    events::initialize(m);
+
+    invalidate_blocks(m);
+
+#if defined(NOOSE_JIT_ENABLED)
+    jit::initialize(m);
+#endif
+
+    if (!initialize_memory_map(m, rom))
     {
-        return cpu::prg_rom[(addr - 0x8000) % 0x4000];
+        return false;
     }
-    else
+
+    // Start at the reset vector like the real thing, which also masks IRQs
+    m->pc  = ((uint16_t) read_memory(m, 0xFFFD) << 8) | read_memory(m, 0xFFFC);
+    m->p  |= CPU_FLAG_IR_DISABLED;
+    return true;
+}
+
+uint8_t cpu::read_memory(machine* m, uint16_t addr)
+{
+    const cpu::page& pg = m->page_table[addr >> 8];
+
+#if defined(NOOSE_PROFILE)
+    m->profile->page_reads[addr >> 8]++;
+    if (!pg.read && profile::get_io_register(addr) >= 0)
     {
-        assert(0 && "Not implemented!");
+        m->profile->io_reads[profile::get_io_register(addr)]++;
     }
+#endif
 
-    return 0;
+    if (pg.read)
+    {
+        return pg.read[addr & 0xff];
+    }
+    m->handler_accesses++;
+    return pg.on_read(m, addr);
+}
+
+void cpu::write_memory(machine* m, uint16_t addr, uint8_t data)
+{
+    const cpu::page& pg = m->page_table[addr >> 8];
+
+#if defined(NOOSE_PROFILE)
+    m->profile->page_writes[addr >> 8]++;
+    if (!pg.write && profile::get_io_register(addr) >= 0)
+    {
+        m->profile->io_writes[profile::get_io_register(addr)]++;
+    }
+#endif
+
+    if (pg.write)
+    {
+        // Only writable memory can change code, a mapper register write
+        // switches banks, which the bank key and bank_generation handle
+        if (m->block_code_pages[addr >> 8])
+        {
+            cpu::invalidate_blocks(m, addr);
+        }
+
+        pg.write[addr & 0xff] = data;
+        return;
+    }
+    m->handler_accesses++;
+    pg.on_write(m, addr, data);
+}
+
+void cpu::map_memory(machine* m, uint16_t addr, uint32_t size, uint8_t* mem, bool writable)
+{
+    assert((addr & 0xff) == 0 && (size & 0xff) == 0 && addr + size <= 0x10000);
+
+    for (uint32_t offset = 0; offset < size; offset += 0x100)
+    {
+        cpu::page& pg = m->page_table[(addr + offset) >> 8];
+        pg.read       = mem + offset;
+        pg.write      = writable ? mem + offset : 0;
+
+        // Writes to ROM are dropped unless someone installs a handler
+        if (!writable && !pg.on_write)
+        {
+            pg.on_write = cpu::open_bus_write;
+        }
+    }
 }
 
-void cpu::write_memory(uint16_t addr, uint8_t data)
+void cpu::map_handler(machine* m, uint16_t addr, uint32_t size, cpu::read_handler on_read, cpu::write_handler on_write)
 {
-    cpu::prg_rom[addr] = data;
+    assert((addr & 0xff) == 0 && (size & 0xff) == 0 && addr + size <= 0x10000);
+
+    for (uint32_t offset = 0; offset < size; offset += 0x100)
+    {
+        cpu::page& pg = m->page_table[(addr + offset) >> 8];
+        pg.read       = 0;
+        pg.write      = 0;
+        pg.on_read    = on_read;
+        pg.on_write   = on_write;
+    }
 }
 
-cpu::address_mode cpu::get_address_mode(const cpu::instruction inst)
+cpu::address_mode cpu::get_address_mode(const cpu::instruction& inst)
 {
     uint8_t lut_index = inst.bits.bbb + inst.bits.cc * 8;
     return address_mode_lut[lut_index].mode;
 }
 
-cpu::instruction_meta cpu::get_instruction_meta(const cpu::instruction inst)
+cpu::instruction_meta cpu::get_instruction_meta(const cpu::instruction& inst)
 {
     const uint8_t ccc_table_size     = 8;
     const uint8_t extra_table_offset = ccc_table_size * 3;
@@ -413,42 +726,228 @@ cpu::instruction_meta cpu::get_instruction_meta(const cpu::instruction inst)
         case 0x60: return instruction_meta_table[extra_table_offset + 3];
     }
 
+    if (inst.bits.cc == 3)
+    {
+        return instruction_meta_table[extra_table_offset + 4];
+    }
+
     return instruction_meta_table[inst.bits.aaa + inst.bits.cc * ccc_table_size];
 }
 
-const char* cpu::get_address_mode_str(const cpu::instruction inst)
+const char* cpu::get_address_mode_str(const cpu::instruction& inst)
 {
     uint8_t lut_index = inst.bits.bbb + inst.bits.cc * 8;
     return address_mode_lut[lut_index].mode_str;
 }
 
-cpu::instruction cpu::get_next_instruction()
+const cpu::instruction& cpu::get_decoded_instruction(uint8_t code)
 {
-    const uint8_t cc_bits  = 0x03;
-    const uint8_t bbb_bits = 0x07;
-    const uint8_t aaa_bits = 0x07;
+    return decode_table[code];
+}
 
-    cpu::instruction inst = {};
-    inst.code             = cpu::read_memory(pc);
-    inst.bits.cc          = inst.code & cc_bits;
-    inst.bits.bbb         = (inst.code >> 2) & bbb_bits;
-    inst.bits.aaa         = (inst.code >> 5) & aaa_bits;
-    inst.address_mode     = get_address_mode(inst);
+const cpu::instruction& cpu::get_next_instruction(machine* m)
+{
+    return decode_table[cpu::read_memory(m, m->pc)];
+}
 
-    // fetching the instruction and increasing pc is always the first cycle
-    cpu::instruction_meta meta  = get_instruction_meta(inst);
-    inst.cycles[0]              = cpu::action(cpu::ID_INCREMENT_PC);
-    inst.cycle_count            = 1 + fill_action_list(meta, get_address_mode(inst), &inst.cycles[1]);
+void cpu::execute_action(machine* m, const cpu::action& action)
+{
+    do_action(m, action);
+}
+
+#if defined(NOOSE_CPU_THREADED)
+
+#if !defined(__GNUC__)
+    #error "NOOSE_CPU_THREADED needs computed goto support (GCC or Clang)"
+#endif
 
-    return inst;
+void cpu::execute(machine* m, const cpu::instruction& inst)
+{
+    // Order must match enum threaded_op
+    static void* const handlers[] =
+    {
+        &&op_end,
+        &&op_nop,
+        &&op_increment_pc,
+        &&op_copy_short_pc_ptr_advance_to_temp,
+        &&op_copy_short_temp_to_pc,
+        &&op_copy_byte_pc_ptr_advance_to_temp_lo,
+        &&op_copy_byte_pc_ptr_advance_to_x_set_flags,
+        &&op_write_byte_x_to_temp_lo,
+        &&op_generic,
+    };
+
+    const uint8_t*     op     = threaded_table[inst.code];
+    const cpu::action* action = inst.cycles;
+
+    m->cycles += inst.cycle_count;
+
+    #define DISPATCH() goto *handlers[*op++]
+    #define NEXT()     action++; DISPATCH()
+
+    DISPATCH();
+
+op_nop:
+    NEXT();
+op_increment_pc:
+    m->pc += 0x01;
+    NEXT();
+op_copy_short_pc_ptr_advance_to_temp:
+    m->address_temp = ((uint16_t) cpu::read_memory(m, m->pc + 1) << 8) | cpu::read_memory(m, m->pc);
+    m->pc += 0x02;
+    NEXT();
+op_copy_short_temp_to_pc:
+    m->pc = m->address_temp;
+    NEXT();
+op_copy_byte_pc_ptr_advance_to_temp_lo:
+    m->address_temp = (m->address_temp & 0xf0) + (uint16_t) cpu::read_memory(m, m->pc);
+    m->pc += 0x01;
+    NEXT();
+op_copy_byte_pc_ptr_advance_to_x_set_flags:
+    m->x  = cpu::read_memory(m, m->pc);
+    m->pc += 0x01;
+    defer_flags(m, action->behaviour.set_flags_data.mask, m->x);
+    NEXT();
+op_write_byte_x_to_temp_lo:
+    cpu::write_memory(m, (uint16_t) m->address_temp & 0xf, m->x);
+    NEXT();
+op_generic:
+    do_action(m, *action);
+    NEXT();
+op_end:
+    return;
+
+    #undef NEXT
+    #undef DISPATCH
 }
 
-void cpu::execute(const cpu::instruction inst)
+#else
+
+void cpu::execute(machine* m, const cpu::instruction& inst)
 {
+    m->cycles += inst.cycle_count;
+
     uint8_t cycle = 0;
     while(cycle < inst.cycle_count)
     {
-        do_action(inst.cycles[cycle]);
+        do_action(m, inst.cycles[cycle]);
         cycle++;
     }
 }
+
+#endif
+
+uint32_t cpu::run(machine* m, uint32_t cycle_budget)
+{
+    uint64_t start = m->cycles;
+    uint64_t end   = start + cycle_budget;
+
+    // PPU and APU lag behind and only catch up when their registers are touched
+    // or when one of its events is due. Blocks return early once
+    // next_event_cycle is reached, so events land on instruction boundaries.
+    while(m->cycles < end)
+    {
+        // Only code in host memory is cached, reading ahead through a
+        // handler would trigger its side effects
+        if (m->page_table[m->pc >> 8].read)
+        {
+            execute_block(m, get_block(m, m->pc));
+        }
+        else
+        {
+            execute_uncached(m);
+        }
+        if (m->cycles >= m->next_event_cycle)
+        {
+            events::dispatch(m);
+        }
+    }
+
+    ppu::catch_up(m, m->cycles);
+    apu::catch_up(m, m->cycles);
+    return (uint32_t) (m->cycles - start);
+}
+
+static inline void push(machine* m, uint8_t data)
+{
+    cpu::write_memory(m, 0x0100 | m->sp, data);
+    m->sp--;
+}
+
+// The 7 cycle sequence shared by NMI and IRQ, BRK would be the same with the B flag set
+static void interrupt(machine* m, uint16_t vector)
+{
+    m->cycles += 7;
+
+    push(m, m->pc >> 8);
+    push(m, m->pc & 0xff);
+    push(m, (cpu::get_status(m) | 0x20) & ~0x10);
+
+    m->p  |= cpu::CPU_FLAG_IR_DISABLED;
+    m->pc  = ((uint16_t) cpu::read_memory(m, vector + 1) << 8) | cpu::read_memory(m, vector);
+}
+
+bool cpu::poll_interrupts(machine* m)
+{
+    // NMI is an edge, the PPU latches it until it is taken
+    if (m->ppu_state.nmi_pending)
+    {
+        m->ppu_state.nmi_pending = 0;
+        interrupt(m, 0xFFFA);
+    }
+
+    // IRQ is a level, it stays up until the source is acknowledged
+    if (!m->mapper_state.irq_pending && !m->apu_state.frame_irq && !m->apu_state.dmc_irq)
+    {
+        return false;
+    }
+
+    if (m->p & cpu::CPU_FLAG_IR_DISABLED)
+    {
+        return true;
+    }
+
+    interrupt(m, 0xFFFE);
+    return false;
+}
+
+uint8_t cpu::get_status(const machine* m)
+{
+    uint8_t lazy = m->flags_lazy;
+    if (!lazy)
+    {
+        return m->p;
+    }
+
+    uint8_t result = (uint8_t) m->flags_result;
+    uint8_t p      = m->p & ~lazy;
+    uint8_t flags  = (result & cpu::CPU_FLAG_NEGATIVE) |
+                     (result == 0 ? cpu::CPU_FLAG_ZERO : 0) |
+                     ((m->flags_result >> 8) & cpu::CPU_FLAG_CARRY) |
+                     ((m->flags_overflow >> 1) & cpu::CPU_FLAG_OVERFLOW);
+
+    return p | (flags & lazy);
+}
+
+void cpu::set_status(machine* m, uint8_t p)
+{
+    bool irq_unmasked = (m->p & cpu::CPU_FLAG_IR_DISABLED) && !(p & cpu::CPU_FLAG_IR_DISABLED);
+
+    m->p          = p;
+    m->flags_lazy = 0;
+
+    // A pending IRQ can be taken now, have the CPU loop look at it
+    if (irq_unmasked)
+    {
+        events::signal_interrupt(m);
+    }
+}
+
+void cpu::reset(machine* m)
+{
+    // Same bus activity as an interrupt, but the stack writes are turned into reads
+    m->cycles += 7;
+    m->sp     -= 3;
+    m->p      |= cpu::CPU_FLAG_IR_DISABLED;
+    m->pc      = ((uint16_t) read_memory(m, 0xFFFD) << 8) | read_memory(m, 0xFFFC);
+}
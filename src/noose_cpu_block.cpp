@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+static inline bool is_block_terminator(uint8_t code)
+{
+    switch(code)
+    {
+        case 0x00: // BRK
+        case 0x20: // JSR
+        case 0x40: // RTI
+        case 0x4C: // JMP
+        case 0x60: // RTS
+        case 0x6C: // JMP (indirect)
+            return true;
+    }
+
+    // Branches are xxy10000
+    return (code & 0x1f) == 0x10;
+}
+
+static inline uint16_t get_bank(machine* m, uint16_t addr)
+{
+    return mapper::get_prg_bank(m, addr);
+}
+
+static inline bool same_prg_window(uint32_t a, uint32_t b)
+{
+    return (a / mapper::PRG_WINDOW_SIZE) == (b / mapper::PRG_WINDOW_SIZE);
+}
+
+static inline uint32_t get_block_index(uint16_t addr, uint16_t bank)
+{
+    return (addr ^ (bank << 4)) & (cpu::BLOCK_CACHE_SIZE - 1);
+}
+
+// Blocks span at most two pages. Generations only grow, so the sum changes
+// whenever either page is written.
+static inline uint32_t get_code_generation(const machine* m, const cpu::block* b)
+{
+    uint8_t first = b->pc >> 8;
+    uint8_t last  = b->end_pc >> 8;
+    return m->code_generation[first] + (last != first ? m->code_generation[last] : 0);
+}
+
+// Opcodes are only ever read from host memory, see execute_uncached
+static void translate_block(machine* m, uint16_t addr, uint16_t bank, cpu::block* b)
+{
+    assert(m->page_table[addr >> 8].read);
+
+    b->pc                = addr;
+    b->bank              = bank;
+    b->instruction_count = 0;
+    b->hits              = 0;
+    b->touches_io        = 0;
+    b->native            = 0;
+
+    uint32_t cursor = addr;
+    while(b->instruction_count < cpu::BLOCK_MAX_INSTRUCTIONS)
+    {
+        const uint8_t*          page = m->page_table[(cursor >> 8) & 0xff].read;
+        const cpu::instruction& inst = cpu::get_decoded_instruction(page[cursor & 0xff]);
+
+        b->instructions[b->instruction_count] = &inst;
+        b->pcs[b->instruction_count]          = (uint16_t) cursor;
+        b->instruction_count++;
+
+        // Don't let a block wrap around the address space, continue into
+        // another PRG window since that one can be switched independently,
+        // or onto a page whose bytes come from a handler
+        uint32_t next = cursor + inst.length;
+        if (is_block_terminator(inst.code) || next > 0xffff || !same_prg_window(addr, next) ||
+            !m->page_table[next >> 8].read)
+        {
+            cursor = next;
+            break;
+        }
+
+        cursor = next;
+    }
+
+    b->end_pc     = (uint16_t) (cursor - 1);
+    b->valid      = 1;
+    b->generation = get_code_generation(m, b);
+
+    for (uint32_t page = b->pc >> 8; page <= (uint32_t) (b->end_pc >> 8); ++page)
+    {
+        m->block_code_pages[page] = 1;
+    }
+}
+
+cpu::block* cpu::get_block(machine* m, uint16_t addr)
+{
+    uint16_t   bank = get_bank(m, addr);
+    cpu::block* b   = &m->blocks[get_block_index(addr, bank)];
+
+#if defined(NOOSE_PROFILE)
+    m->profile->block_lookups++;
+#endif
+
+    if (!b->valid || b->pc != addr || b->bank != bank || b->generation != get_code_generation(m, b))
+    {
+        translate_block(m, addr, bank, b);
+
+#if defined(NOOSE_PROFILE)
+        m->profile->block_translations++;
+#endif
+    }
+
+    return b;
+}
+
+uint32_t cpu::execute_block(machine* m, cpu::block* b)
+{
+    m->block_bank_generation = m->bank_generation;
+    m->running_block         = b;
+
+#if defined(NOOSE_JIT_ENABLED)
+    if (b->native)
+    {
+#if defined(NOOSE_PROFILE)
+        m->profile->blocks_native++;
+#endif
+        return jit::execute(m, b);
+    }
+
+    // Register accesses go through the handlers either way, code doing a lot
+    // of them gains nothing from being compiled
+    if (++b->hits == jit::HOT_THRESHOLD && !b->touches_io)
+    {
+        jit::compile_result result = jit::compile(m, b);
+        if (result == jit::COMPILE_DONE)
+        {
+#if defined(NOOSE_PROFILE)
+            m->profile->jit_compiles++;
+            m->profile->blocks_native++;
+#endif
+            return jit::execute(m, b);
+        }
+
+        if (result == jit::COMPILE_FLUSHED)
+        {
+            b                = cpu::get_block(m, m->pc);
+            m->running_block = b;
+        }
+    }
+#endif
+
+#if defined(NOOSE_PROFILE)
+    m->profile->blocks_interpreted++;
+#endif
+
+    uint32_t cycles           = 0;
+    uint64_t handler_accesses = m->handler_accesses;
+
+    for (uint8_t i = 0; i < b->instruction_count; ++i)
+    {
+        // The block only describes where the code is expected to flow; if an
+        // instruction moved pc elsewhere, the block got invalidated by a write
+        // to its own bytes, or a mapper write switched banks under it, let the
+        // caller look up a fresh block.
+        if (m->pc != b->pcs[i] || !b->valid || m->bank_generation != m->block_bank_generation)
+        {
+            break;
+        }
+
+        const cpu::instruction& inst = *b->instructions[i];
+        if (m->trace)
+        {
+            trace::record(m, inst.code);
+        }
+
+#if defined(NOOSE_PROFILE)
+        profile::count_instruction(m, inst.code);
+#endif
+
+        cpu::execute(m, inst);
+        cycles += inst.cycle_count;
+
+        // Something is due, let cpu::run deal with it before going on
+        if (m->cycles >= m->next_event_cycle)
+        {
+            break;
+        }
+    }
+
+    if (m->handler_accesses != handler_accesses)
+    {
+        b->touches_io = 1;
+    }
+
+    return cycles;
+}
+
+void cpu::invalidate_blocks(machine* m)
+{
+    for (uint32_t i = 0; i < cpu::BLOCK_CACHE_SIZE; ++i)
+    {
+        m->blocks[i].valid = 0;
+    }
+
+    memset(m->block_code_pages, 0, sizeof(m->block_code_pages));
+}
+
+void cpu::invalidate_blocks(machine* m, uint16_t addr)
+{
+    uint8_t page = addr >> 8;
+
+    // Every block touching this page goes stale, get_block notices the new
+    // generation. Only the running block has to be stopped right away.
+    m->code_generation[page]++;
+    m->block_code_pages[page] = 0;
+
+    cpu::block* b = m->running_block;
+    if (b && (b->pc >> 8) <= page && page <= (b->end_pc >> 8))
+    {
+        b->valid = 0;
+    }
+}
+
+uint32_t cpu::execute_uncached(machine* m)
+{
+    m->running_block = 0;
+
+    const cpu::instruction& inst = cpu::get_next_instruction(m);
+    if (m->trace)
+    {
+        trace::record(m, inst.code);
+    }
+
+#if defined(NOOSE_PROFILE)
+    profile::count_instruction(m, inst.code);
+#endif
+
+    cpu::execute(m, inst);
+    return inst.cycle_count;
+}
+
+// The interpreter as verify_rom runs it, one instruction at a time
+static void step_instruction(machine* m)
+{
+    cpu::execute(m, cpu::get_next_instruction(m));
+    if (m->cycles >= m->next_event_cycle)
+    {
+        events::dispatch(m);
+    }
+}
+
+bool noose::verify_blocks(const noose::rom* rom, uint32_t frame_count)
+{
+    noose::machine* m         = noose::create_machine(rom);
+    noose::machine* reference = noose::create_machine(rom);
+    if (!m || !reference)
+    {
+        noose::destroy_machine(m);
+        noose::destroy_machine(reference);
+        return false;
+    }
+
+    save_state_data* state           = (save_state_data*) malloc(sizeof(save_state_data));
+    save_state_data* reference_state = (save_state_data*) malloc(sizeof(save_state_data));
+
+    uint64_t end    = (uint64_t) frame_count * PPU_DOTS_PER_FRAME / PPU_DOTS_PER_CPU_CYCLE;
+    uint32_t seed   = 0x6502;
+    bool     ok     = true;
+    uint32_t slices = 0;
+
+    // Uneven slices so blocks get cut off by the budget at every point
+    while(ok && m->cycles < end)
+    {
+        cpu::run(m, 1 + xorshift32(&seed) % 2048);
+
+        while(reference->cycles < m->cycles)
+        {
+            step_instruction(reference);
+        }
+        ppu::catch_up(reference, reference->cycles);
+        apu::catch_up(reference, reference->cycles);
+
+        noose::save_state(m, state, sizeof(save_state_data));
+        noose::save_state(reference, reference_state, sizeof(save_state_data));
+
+        if (memcmp(state, reference_state, sizeof(save_state_data)) != 0)
+        {
+            char buf[160];
+            snprintf(buf, sizeof(buf), "Blocks diverged from the interpreter after slice %u: pc $%04X cycle %llu, interpreter pc $%04X cycle %llu",
+                slices, m->pc, (unsigned long long) m->cycles, reference->pc, (unsigned long long) reference->cycles);
+            noose::add_error(buf);
+            ok = false;
+        }
+        slices++;
+    }
+
+    if (ok)
+    {
+        uint32_t native = 0;
+        for (uint32_t i = 0; i < cpu::BLOCK_CACHE_SIZE; ++i)
+        {
+            native += m->blocks[i].valid && m->blocks[i].native;
+        }
+        printf("Blocks match the interpreter over %llu cycles in %u slices, %u blocks compiled\n",
+            (unsigned long long) m->cycles, slices, native);
+    }
+
+    free(reference_state);
+    free(state);
+    noose::destroy_machine(reference);
+    noose::destroy_machine(m);
+    return ok;
+}
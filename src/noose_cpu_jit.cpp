@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+#if defined(NOOSE_JIT_ENABLED)
+
+#include <sys/mman.h>
+
+using namespace noose;
+
+/*
+Hot blocks from the block cache are turned into x86-64 functions taking the
+machine and returning the number of cycles they executed (System V ABI,
+machine in rdi, result in eax).
+
+    push rbx                    ; realign the stack for helper calls
+    mov  rbx, rdi               ; machine stays in rbx for the whole block
+    call trace::record          ; only compiled in while tracing
+    add  [rbx + cycles], <n0>   ; timestamp first, like cpu::execute
+    <actions of instruction 0>
+    add  [rbx + cycles], <n1>
+    <actions of instruction 1>
+    ...
+    mov  eax, <cycles>
+    pop  rbx
+    ret
+
+Operand fetches, register copies, stores to RAM and the deferred flag
+updates are emitted as native code. A block's code is in PRG ROM and pc is
+known at every point of it, so operands are loaded straight from the page
+table entry of their address. Stores go to the page's host memory when it
+has one and doesn't hold cached code, anything else (I/O registers, mapper
+registers) calls into cpu::execute_action like the interpreter would, so
+handlers see the exact same accesses. Actions without a native form call
+cpu::execute_action too. With NOOSE_PROFILE all memory accesses take the
+calls, so the page counters stay the same.
+
+After every instruction that writes memory the block's valid flag and the
+bank generation are re-checked, and a store that hit the block's own code or
+switched a bank returns to the interpreter with the cycles spent so far.
+Likewise every instruction compares the timestamp against next_event_cycle
+and returns early once an event or interrupt is due.
+Blocks outside of PRG ROM are never compiled, nor are blocks that went
+through a read or write handler while interpreted, since I/O register
+accesses cost the same either way. Registers and the valid flag
+are addressed relative to rbx, so every machine gets its own arena but the
+code itself doesn't depend on where the machine lives.
+*/
+
+static const size_t ARENA_SIZE          = 1 << 20;
+static const size_t MAX_BLOCK_CODE_SIZE = 16384;
+
+struct s_emitter
+{
+    uint8_t* cursor;
+};
+
+typedef uint32_t (*native_block_fn)(machine* m);
+
+static void jit_execute_action(machine* m, const cpu::action* action)
+{
+    cpu::execute_action(m, *action);
+}
+
+static void jit_settle_flags(machine* m)
+{
+    cpu::set_status(m, cpu::get_status(m));
+}
+
+static inline void emit_u8(s_emitter* e, uint8_t v)
+{
+    *e->cursor++ = v;
+}
+
+static inline void emit_u32(s_emitter* e, uint32_t v)
+{
+    memcpy(e->cursor, &v, sizeof(v));
+    e->cursor += sizeof(v);
+}
+
+static inline void emit_u64(s_emitter* e, uint64_t v)
+{
+    memcpy(e->cursor, &v, sizeof(v));
+    e->cursor += sizeof(v);
+}
+
+static inline void emit_mov_rax_imm64(s_emitter* e, const void* ptr)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0xb8);
+    emit_u64(e, (uint64_t) ptr);
+}
+
+static inline void emit_mov_rsi_imm64(s_emitter* e, const void* ptr)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0xbe);
+    emit_u64(e, (uint64_t) ptr);
+}
+
+// Offset of a machine field for [rbx + disp32] operands
+static inline uint32_t machine_offset(const machine* m, const void* field)
+{
+    return (uint32_t) ((const uint8_t*) field - (const uint8_t*) m);
+}
+
+static inline void emit_return(s_emitter* e, uint32_t cycles)
+{
+    emit_u8(e, 0xb8); emit_u32(e, cycles); // mov eax, cycles
+    emit_u8(e, 0x5b);                      // pop rbx
+    emit_u8(e, 0xc3);                      // ret
+}
+
+// Handlers catch the PPU up to the CPU's timestamp, so it has to be current
+// before an instruction touches memory
+static inline void emit_add_cycles(s_emitter* e, const machine* m, uint8_t cycles)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x83); emit_u8(e, 0x83); // add qword [rbx + cycles], imm8
+    emit_u32(e, machine_offset(m, &m->cycles));
+    emit_u8(e, cycles);
+}
+
+// Short forward jumps, patched once the target is known
+static inline uint8_t* emit_jump8(s_emitter* e, uint8_t opcode)
+{
+    emit_u8(e, opcode);
+    emit_u8(e, 0x00);
+    return e->cursor - 1;
+}
+
+static inline void patch_jump8(const s_emitter* e, uint8_t* rel)
+{
+    assert(e->cursor - (rel + 1) < 0x80);
+    *rel = (uint8_t) (e->cursor - (rel + 1));
+}
+
+static inline void emit_call(s_emitter* e, const void* fn)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x89); emit_u8(e, 0xdf); // mov rdi, rbx
+    emit_mov_rax_imm64(e, fn);
+    emit_u8(e, 0xff); emit_u8(e, 0xd0);                   // call rax
+}
+
+static void emit_call_action(s_emitter* e, const cpu::action& action)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x89); emit_u8(e, 0xdf); // mov rdi, rbx
+    emit_mov_rsi_imm64(e, &action);
+    emit_mov_rax_imm64(e, (const void*) &jit_execute_action);
+    emit_u8(e, 0xff); emit_u8(e, 0xd0);                   // call rax
+}
+
+static inline void emit_add_pc(s_emitter* e, const machine* m, uint8_t delta)
+{
+    emit_u8(e, 0x66); emit_u8(e, 0x83); emit_u8(e, 0x83); // add word [rbx + pc], delta
+    emit_u32(e, machine_offset(m, &m->pc));
+    emit_u8(e, delta);
+}
+
+// True if the byte at addr can be loaded straight from the page table. The
+// profile's page counters only see accesses through cpu::read_memory.
+#if defined(NOOSE_PROFILE)
+static inline bool has_direct_read(const machine*, uint16_t)
+{
+    return false;
+}
+#else
+static inline bool has_direct_read(const machine* m, uint16_t addr)
+{
+    return m->page_table[addr >> 8].read != 0;
+}
+#endif
+
+// movzx ecx or edx (reg 1 or 2), byte at addr
+static void emit_load_byte(s_emitter* e, const machine* m, uint16_t addr, uint8_t reg)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x8b); emit_u8(e, 0x83);            // mov rax, [rbx + page_table[addr >> 8].read]
+    emit_u32(e, machine_offset(m, &m->page_table[addr >> 8].read));
+    emit_u8(e, 0x0f); emit_u8(e, 0xb6); emit_u8(e, 0x80 | (reg << 3)); // movzx reg, byte [rax + addr & 0xff]
+    emit_u32(e, addr & 0xff);
+}
+
+// The first half of defer_flags, settling whatever the new result won't cover
+static void emit_settle_flags(s_emitter* e, const machine* m, uint8_t mask)
+{
+    emit_u8(e, 0xf6); emit_u8(e, 0x83);                   // test byte [rbx + flags_lazy], ~mask
+    emit_u32(e, machine_offset(m, &m->flags_lazy));
+    emit_u8(e, (uint8_t) ~mask);
+    uint8_t* skip = emit_jump8(e, 0x74);                  // jz over the call
+    emit_call(e, (const void*) &jit_settle_flags);
+    patch_jump8(e, skip);
+}
+
+// The second half of defer_flags, with the result in ecx
+static void emit_defer_flags(s_emitter* e, const machine* m, uint8_t mask)
+{
+    emit_u8(e, 0x66); emit_u8(e, 0x89); emit_u8(e, 0x8b); // mov word [rbx + flags_result], cx
+    emit_u32(e, machine_offset(m, &m->flags_result));
+    emit_u8(e, 0xc6); emit_u8(e, 0x83);                   // mov byte [rbx + flags_overflow], 0
+    emit_u32(e, machine_offset(m, &m->flags_overflow));
+    emit_u8(e, 0x00);
+    emit_u8(e, 0x80); emit_u8(e, 0x8b);                   // or byte [rbx + flags_lazy], mask
+    emit_u32(e, machine_offset(m, &m->flags_lazy));
+    emit_u8(e, mask);
+}
+
+// Stores the byte in ecx to a register, false for destinations without a native form
+static bool emit_store_byte(s_emitter* e, const machine* m, cpu::action_address to)
+{
+    switch(to)
+    {
+        case cpu::ADDRESS_X:
+            emit_u8(e, 0x88); emit_u8(e, 0x8b);                   // mov byte [rbx + x], cl
+            emit_u32(e, machine_offset(m, &m->x));
+            return true;
+        case cpu::ADDRESS_TEMP_LO:
+            emit_u8(e, 0x0f); emit_u8(e, 0xb7); emit_u8(e, 0x83); // movzx eax, word [rbx + address_temp]
+            emit_u32(e, machine_offset(m, &m->address_temp));
+            emit_u8(e, 0x25); emit_u32(e, 0xf0);                  // and eax, 0xf0
+            emit_u8(e, 0x01); emit_u8(e, 0xc8);                   // add eax, ecx
+            emit_u8(e, 0x66); emit_u8(e, 0x89); emit_u8(e, 0x83); // mov word [rbx + address_temp], ax
+            emit_u32(e, machine_offset(m, &m->address_temp));
+            return true;
+    }
+    return false;
+}
+
+static bool emit_copy_byte(s_emitter* e, const machine* m, const cpu::action& action, uint16_t pc)
+{
+    const cpu::action::copy_byte& data = action.copy_byte_data;
+
+    if (data.to != cpu::ADDRESS_X && data.to != cpu::ADDRESS_TEMP_LO)
+    {
+        return false;
+    }
+    if (data.from == cpu::ADDRESS_PC_PTR_ADVANCE ? !has_direct_read(m, pc) : data.from != cpu::ADDRESS_PC_ADVANCE)
+    {
+        return false;
+    }
+
+    bool set_flags = action.behaviour.id == cpu::ID_SET_FLAGS;
+    if (action.behaviour.id != cpu::ID_NONE && !set_flags)
+    {
+        return false;
+    }
+
+    if (set_flags)
+    {
+        emit_settle_flags(e, m, action.behaviour.set_flags_data.mask);
+    }
+
+    if (data.from == cpu::ADDRESS_PC_PTR_ADVANCE)
+    {
+        emit_load_byte(e, m, pc, 1);
+    }
+    else
+    {
+        emit_u8(e, 0xb9); emit_u32(e, pc & 0xff); // mov ecx, pc & 0xff
+    }
+
+    emit_add_pc(e, m, 1);
+    emit_store_byte(e, m, data.to);
+
+    if (set_flags)
+    {
+        emit_defer_flags(e, m, action.behaviour.set_flags_data.mask);
+    }
+    return true;
+}
+
+static bool emit_copy_short(s_emitter* e, const machine* m, const cpu::action& action, uint16_t pc)
+{
+    const cpu::action::copy_short& data = action.copy_short_data;
+
+    if (action.behaviour.id != cpu::ID_NONE)
+    {
+        return false;
+    }
+
+    if (data.from == cpu::ADDRESS_TEMP && data.to == cpu::ADDRESS_PC)
+    {
+        emit_u8(e, 0x0f); emit_u8(e, 0xb7); emit_u8(e, 0x8b); // movzx ecx, word [rbx + address_temp]
+        emit_u32(e, machine_offset(m, &m->address_temp));
+        emit_u8(e, 0x66); emit_u8(e, 0x89); emit_u8(e, 0x8b); // mov word [rbx + pc], cx
+        emit_u32(e, machine_offset(m, &m->pc));
+        return true;
+    }
+
+    if (data.from == cpu::ADDRESS_PC_PTR_ADVANCE && data.to == cpu::ADDRESS_TEMP &&
+        has_direct_read(m, pc) && has_direct_read(m, pc + 1))
+    {
+        emit_load_byte(e, m, pc, 1);
+        emit_load_byte(e, m, pc + 1, 2);
+        emit_u8(e, 0xc1); emit_u8(e, 0xe2); emit_u8(e, 0x08); // shl edx, 8
+        emit_u8(e, 0x09); emit_u8(e, 0xd1);                   // or ecx, edx
+        emit_u8(e, 0x66); emit_u8(e, 0x89); emit_u8(e, 0x8b); // mov word [rbx + address_temp], cx
+        emit_u32(e, machine_offset(m, &m->address_temp));
+        emit_add_pc(e, m, 2);
+        return true;
+    }
+    return false;
+}
+
+static bool emit_read_byte(s_emitter* e, const machine* m, const cpu::action& action)
+{
+    const cpu::action::read_byte& data = action.read_byte_data;
+
+    bool set_flags = action.behaviour.id == cpu::ID_SET_FLAGS;
+    if (data.address != cpu::ADDRESS_TEMP || data.to != cpu::ADDRESS_X ||
+        (action.behaviour.id != cpu::ID_NONE && !set_flags))
+    {
+        return false;
+    }
+
+    if (set_flags)
+    {
+        emit_settle_flags(e, m, action.behaviour.set_flags_data.mask);
+    }
+
+    emit_u8(e, 0x0f); emit_u8(e, 0xb6); emit_u8(e, 0x8b); // movzx ecx, byte [rbx + address_temp]
+    emit_u32(e, machine_offset(m, &m->address_temp));
+    emit_store_byte(e, m, data.to);
+
+    if (set_flags)
+    {
+        emit_defer_flags(e, m, action.behaviour.set_flags_data.mask);
+    }
+    return true;
+}
+
+#if !defined(NOOSE_PROFILE)
+// Stores to host memory inline, everything else (I/O registers, cached code) calls
+static bool emit_write_byte(s_emitter* e, const machine* m, const cpu::action& action)
+{
+    const cpu::action::write_byte& data = action.write_byte_data;
+
+    if (data.from != cpu::ADDRESS_X || data.address != cpu::ADDRESS_TEMP_LO || action.behaviour.id != cpu::ID_NONE)
+    {
+        return false;
+    }
+
+    // address_temp & 0xf is always on page 0
+    emit_u8(e, 0x80); emit_u8(e, 0xbb);                   // cmp byte [rbx + block_code_pages[0]], 0
+    emit_u32(e, machine_offset(m, &m->block_code_pages[0]));
+    emit_u8(e, 0x00);
+    uint8_t* code_page = emit_jump8(e, 0x75);             // jne to the call
+    emit_u8(e, 0x48); emit_u8(e, 0x8b); emit_u8(e, 0x83); // mov rax, [rbx + page_table[0].write]
+    emit_u32(e, machine_offset(m, &m->page_table[0].write));
+    emit_u8(e, 0x48); emit_u8(e, 0x85); emit_u8(e, 0xc0); // test rax, rax
+    uint8_t* handler = emit_jump8(e, 0x74);               // jz to the call
+    emit_u8(e, 0x0f); emit_u8(e, 0xb6); emit_u8(e, 0x93); // movzx edx, byte [rbx + address_temp]
+    emit_u32(e, machine_offset(m, &m->address_temp));
+    emit_u8(e, 0x83); emit_u8(e, 0xe2); emit_u8(e, 0x0f); // and edx, 0x0f
+    emit_u8(e, 0x0f); emit_u8(e, 0xb6); emit_u8(e, 0x8b); // movzx ecx, byte [rbx + x]
+    emit_u32(e, machine_offset(m, &m->x));
+    emit_u8(e, 0x88); emit_u8(e, 0x0c); emit_u8(e, 0x10); // mov [rax + rdx], cl
+    uint8_t* done = emit_jump8(e, 0xeb);                  // jmp over the call
+
+    patch_jump8(e, code_page);
+    patch_jump8(e, handler);
+    emit_call_action(e, action);
+    patch_jump8(e, done);
+    return true;
+}
+#endif
+
+// How far an action moves pc along the instruction's bytes
+static uint8_t get_pc_advance(const cpu::action& action)
+{
+    switch(action.id)
+    {
+        case cpu::ID_INCREMENT_PC:
+            return 1;
+        case cpu::ID_COPY_SHORT:
+            return action.copy_short_data.from == cpu::ADDRESS_PC_PTR_ADVANCE ? 2 : 0;
+        case cpu::ID_COPY_BYTE:
+            return action.copy_byte_data.from == cpu::ADDRESS_PC_ADVANCE ||
+                action.copy_byte_data.from == cpu::ADDRESS_PC_PTR_ADVANCE ? 1 : 0;
+    }
+    return 0;
+}
+
+// pc is where m->pc is when the action starts, known since blocks are straight-line code
+static void emit_action(s_emitter* e, const machine* m, const cpu::action& action, uint16_t pc)
+{
+    bool native = false;
+
+    switch(action.id)
+    {
+        case cpu::ID_NOP:
+            return;
+        case cpu::ID_INCREMENT_PC:
+            emit_add_pc(e, m, 1);
+            return;
+        case cpu::ID_COPY_BYTE:
+            native = emit_copy_byte(e, m, action, pc);
+            break;
+        case cpu::ID_COPY_SHORT:
+            native = emit_copy_short(e, m, action, pc);
+            break;
+        case cpu::ID_READ_BYTE:
+            native = emit_read_byte(e, m, action);
+            break;
+#if !defined(NOOSE_PROFILE)
+        case cpu::ID_WRITE_BYTE:
+            native = emit_write_byte(e, m, action);
+            break;
+#endif
+    }
+
+    if (!native)
+    {
+        emit_call_action(e, action);
+    }
+}
+
+// Compiled in only while tracing, start_trace and stop_trace drop all blocks
+static void emit_trace(s_emitter* e, const cpu::instruction& inst)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x89); emit_u8(e, 0xdf); // mov rdi, rbx
+    emit_u8(e, 0xbe); emit_u32(e, inst.code);             // mov esi, opcode
+    emit_mov_rax_imm64(e, (const void*) &trace::record);
+    emit_u8(e, 0xff); emit_u8(e, 0xd0);                   // call rax
+}
+
+#if defined(NOOSE_PROFILE)
+static void emit_profile(s_emitter* e, const cpu::instruction& inst)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x89); emit_u8(e, 0xdf); // mov rdi, rbx
+    emit_u8(e, 0xbe); emit_u32(e, inst.code);             // mov esi, opcode
+    emit_mov_rax_imm64(e, (const void*) &profile::count_instruction);
+    emit_u8(e, 0xff); emit_u8(e, 0xd0);                   // call rax
+}
+#endif
+
+static void emit_valid_check(s_emitter* e, const machine* m, const cpu::block* b, uint32_t cycles)
+{
+    emit_u8(e, 0x80); emit_u8(e, 0xbb); // cmp byte [rbx + valid], 0
+    emit_u32(e, machine_offset(m, &b->valid));
+    emit_u8(e, 0x00);
+    emit_u8(e, 0x75); emit_u8(e, 0x07); // jne over the return below
+    emit_return(e, cycles);
+}
+
+static void emit_bank_check(s_emitter* e, const machine* m, uint32_t cycles)
+{
+    emit_u8(e, 0x8b); emit_u8(e, 0x83);                   // mov eax, [rbx + bank_generation]
+    emit_u32(e, machine_offset(m, &m->bank_generation));
+    emit_u8(e, 0x3b); emit_u8(e, 0x83);                   // cmp eax, [rbx + block_bank_generation]
+    emit_u32(e, machine_offset(m, &m->block_bank_generation));
+    emit_u8(e, 0x74); emit_u8(e, 0x07);                   // je over the return below
+    emit_return(e, cycles);
+}
+
+static void emit_event_check(s_emitter* e, const machine* m, uint32_t cycles)
+{
+    emit_u8(e, 0x48); emit_u8(e, 0x8b); emit_u8(e, 0x83); // mov rax, [rbx + cycles]
+    emit_u32(e, machine_offset(m, &m->cycles));
+    emit_u8(e, 0x48); emit_u8(e, 0x3b); emit_u8(e, 0x83); // cmp rax, [rbx + next_event_cycle]
+    emit_u32(e, machine_offset(m, &m->next_event_cycle));
+    emit_u8(e, 0x72); emit_u8(e, 0x07);                   // jb over the return below
+    emit_return(e, cycles);
+}
+
+static bool writes_memory(const cpu::instruction& inst)
+{
+    for (uint8_t i = 0; i < inst.cycle_count; ++i)
+    {
+        if (inst.cycles[i].id == cpu::ID_WRITE_BYTE)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the actions of inst leave pc right after its operands, which
+// is what lets the following instruction be compiled into the same function.
+static bool falls_through(const cpu::instruction& inst)
+{
+    uint32_t delta = 0;
+
+    for (uint8_t i = 0; i < inst.cycle_count; ++i)
+    {
+        const cpu::action& action = inst.cycles[i];
+        if (action.id == cpu::ID_COPY_SHORT && action.copy_short_data.to == cpu::ADDRESS_PC)
+        {
+            return false;
+        }
+        delta += get_pc_advance(action);
+    }
+
+    return delta == inst.length;
+}
+
+// Forgets every compiled function and empties the arena
+static void flush_arena(machine* m)
+{
+    cpu::invalidate_blocks(m);
+    for (uint32_t i = 0; i < cpu::BLOCK_CACHE_SIZE; ++i)
+    {
+        m->blocks[i].native = 0;
+    }
+    m->jit_arena_used = 0;
+}
+
+void jit::initialize(machine* m)
+{
+    if (!m->jit_arena)
+    {
+        void* mem = mmap(0, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            return;
+        }
+        m->jit_arena = (uint8_t*) mem;
+    }
+
+    // cpu::initialize has dropped every block, so no code is referenced anymore
+    m->jit_arena_used = 0;
+}
+
+void jit::release(machine* m)
+{
+    if (m->jit_arena)
+    {
+        munmap(m->jit_arena, ARENA_SIZE);
+        m->jit_arena      = 0;
+        m->jit_arena_used = 0;
+    }
+}
+
+jit::compile_result jit::compile(machine* m, cpu::block* b)
+{
+    if (!m->jit_arena || b->pc < 0x8000)
+    {
+        return COMPILE_FAILED;
+    }
+
+    if (m->jit_arena_used + MAX_BLOCK_CODE_SIZE > ARENA_SIZE)
+    {
+        // Out of space, drop all compiled code and start over. This also
+        // invalidates b, so the caller looks it up again.
+        flush_arena(m);
+        return COMPILE_FLUSHED;
+    }
+
+    if (mprotect(m->jit_arena, ARENA_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        return COMPILE_FAILED;
+    }
+
+    s_emitter e      = { m->jit_arena + m->jit_arena_used };
+    uint8_t*  start  = e.cursor;
+    uint32_t  cycles = 0;
+
+    emit_u8(&e, 0x53);                                        // push rbx
+    emit_u8(&e, 0x48); emit_u8(&e, 0x89); emit_u8(&e, 0xfb); // mov rbx, rdi
+
+    for (uint8_t i = 0; i < b->instruction_count; ++i)
+    {
+        const cpu::instruction& inst = *b->instructions[i];
+
+        if (m->trace)
+        {
+            emit_trace(&e, inst);
+        }
+
+#if defined(NOOSE_PROFILE)
+        emit_profile(&e, inst);
+#endif
+
+        emit_add_cycles(&e, m, inst.cycle_count);
+
+        uint16_t pc = b->pcs[i];
+        for (uint8_t c = 0; c < inst.cycle_count; ++c)
+        {
+            emit_action(&e, m, inst.cycles[c], pc);
+            pc += get_pc_advance(inst.cycles[c]);
+        }
+
+        cycles += inst.cycle_count;
+
+        if (!falls_through(inst))
+        {
+            break;
+        }
+
+        if (i + 1 < b->instruction_count)
+        {
+            if (writes_memory(inst))
+            {
+                emit_valid_check(&e, m, b, cycles);
+                emit_bank_check(&e, m, cycles);
+            }
+            emit_event_check(&e, m, cycles);
+        }
+    }
+
+    emit_return(&e, cycles);
+
+    assert((size_t) (e.cursor - start) <= MAX_BLOCK_CODE_SIZE);
+    m->jit_arena_used += e.cursor - start;
+
+    if (mprotect(m->jit_arena, ARENA_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        // The arena is still writable and not executable, none of it can run
+        flush_arena(m);
+        return COMPILE_FLUSHED;
+    }
+
+    b->native = start;
+    return COMPILE_DONE;
+}
+
+uint32_t jit::execute(machine* m, const cpu::block* b)
+{
+    return ((native_block_fn) b->native)(m);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Timed hardware events, kept in a binary min-heap ordered by CPU cycle. Every
+device has at most one event in flight (scheduling it again moves it), so
+the heap never holds more than EVENT_COUNT entries.
+
+The CPU never looks at the heap itself. It compares machine::cycles against
+machine::next_event_cycle after every instruction and calls events::dispatch
+once that is reached. next_event_cycle is normally the top of the heap, but
+raising an interrupt line pulls it in to right now so the interrupt is taken
+at the next instruction boundary.
+*/
+
+static inline bool is_before(const events::event& a, const events::event& b)
+{
+    return a.cycle < b.cycle;
+}
+
+static void sift_up(events::event* heap, uint32_t i)
+{
+    while(i > 0)
+    {
+        uint32_t parent = (i - 1) / 2;
+        if (!is_before(heap[i], heap[parent]))
+        {
+            break;
+        }
+
+        events::event tmp = heap[i];
+        heap[i]           = heap[parent];
+        heap[parent]      = tmp;
+        i                 = parent;
+    }
+}
+
+static void sift_down(events::event* heap, uint32_t count, uint32_t i)
+{
+    while(true)
+    {
+        uint32_t first = i;
+        uint32_t left  = i * 2 + 1;
+        uint32_t right = i * 2 + 2;
+
+        if (left < count && is_before(heap[left], heap[first]))
+        {
+            first = left;
+        }
+        if (right < count && is_before(heap[right], heap[first]))
+        {
+            first = right;
+        }
+        if (first == i)
+        {
+            break;
+        }
+
+        events::event tmp = heap[i];
+        heap[i]           = heap[first];
+        heap[first]       = tmp;
+        i                 = first;
+    }
+}
+
+static void remove_at(machine* m, uint32_t i)
+{
+    m->event_heap[i] = m->event_heap[--m->event_count];
+    if (i < m->event_count)
+    {
+        sift_up(m->event_heap, i);
+        sift_down(m->event_heap, m->event_count, i);
+    }
+}
+
+static inline uint64_t get_heap_top(const machine* m)
+{
+    return m->event_count ? m->event_heap[0].cycle : events::NEVER;
+}
+
+static void run_event(machine* m, events::event_id id)
+{
+    switch(id)
+    {
+        case events::EVENT_PPU:
+            ppu::catch_up(m, m->cycles);
+            break;
+        case events::EVENT_APU:
+            apu::catch_up(m, m->cycles);
+            break;
+        default:
+            break;
+    }
+}
+
+void events::initialize(machine* m)
+{
+    m->event_count      = 0;
+    m->next_event_cycle = events::NEVER;
+}
+
+void events::schedule(machine* m, events::event_id id, uint64_t cycle)
+{
+    for (uint32_t i = 0; i < m->event_count; ++i)
+    {
+        if (m->event_heap[i].id == id)
+        {
+            remove_at(m, i);
+            break;
+        }
+    }
+
+    assert(m->event_count < events::EVENT_COUNT);
+
+    events::event& e = m->event_heap[m->event_count];
+    e.cycle          = cycle;
+    e.id             = id;
+    sift_up(m->event_heap, m->event_count++);
+
+    if (cycle < m->next_event_cycle)
+    {
+        m->next_event_cycle = cycle;
+    }
+}
+
+void events::cancel(machine* m, events::event_id id)
+{
+    for (uint32_t i = 0; i < m->event_count; ++i)
+    {
+        if (m->event_heap[i].id == id)
+        {
+            remove_at(m, i);
+            return;
+        }
+    }
+}
+
+void events::signal_interrupt(machine* m)
+{
+    m->next_event_cycle = 0;
+}
+
+void events::dispatch(machine* m)
+{
+    // Handlers may schedule again, possibly in the past, keep going until
+    // nothing is due anymore
+    while(m->event_count && m->event_heap[0].cycle <= m->cycles)
+    {
+        events::event_id id = (events::event_id) m->event_heap[0].id;
+        remove_at(m, 0);
+        run_event(m, id);
+    }
+
+    m->next_event_cycle = get_heap_top(m);
+
+    // An IRQ held off by the I flag waits for cpu::set_status to clear the
+    // flag, which signals again, instead of being polled every instruction
+    cpu::poll_interrupts(m);
+}
@@ -1,13 +1,119 @@
 #ifndef __NOOSE_INTERNAL_H__
 #define __NOOSE_INTERNAL_H__
 
+#include <time.h>
 #include "noose.h"
 
+#if defined(NOOSE_JIT) && defined(__x86_64__) && defined(__linux__)
+    #define NOOSE_JIT_ENABLED
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define NOOSE_PPU_SIMD_ENABLED
+#endif
+
 namespace noose
 {
     static const uint32_t BLOCK_SIZE_PRG = 16384;
     static const uint32_t BLOCK_SIZE_CHR = 8192;
 
+    // 64 bit FNV-1a, for cache keys and for telling ROMs and states apart
+    static inline uint64_t hash_fnv1a(const uint8_t* data, size_t size)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; ++i)
+        {
+            h = (h ^ data[i]) * 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    // Marsaglia xorshift, for generated test data and input. Never give it 0.
+    static inline uint32_t xorshift32(uint32_t* state)
+    {
+        uint32_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *state = x;
+        return x;
+    }
+
+    static inline double get_time_seconds()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    // CPU state at the start of an instruction, as found on a nestest log line
+    struct s_trace_record
+    {
+        uint16_t pc;
+        uint8_t  opcode;
+        uint8_t  a;
+        uint8_t  x;
+        uint8_t  y;
+        uint8_t  p;
+        uint8_t  sp;
+        uint32_t cycle;
+    };
+
+    typedef struct s_trace_record trace_record;
+
+    // One executed instruction in a trace ring (noose_trace.cpp), packed to
+    // 16 bytes so the hot path is a single small store
+    struct s_trace_entry
+    {
+        uint64_t cycle_pc;    // TRACE_OPERAND_UNKNOWN bits | cycle << 16 | pc, cycles wrap after 2^46
+        uint8_t  opcode;
+        uint8_t  operands[2]; // the two bytes after the opcode, used or not, 0 when unknown
+        uint8_t  a;
+        uint8_t  x;
+        uint8_t  y;
+        uint8_t  p;
+        uint8_t  sp;
+    };
+
+    // Start of a trace, in memory and in trace files alike. The ring of
+    // capacity entries follows right after it.
+    struct s_trace_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t entry_size;
+        uint32_t capacity; // a power of two
+        uint64_t count;    // entries ever written, the next goes to count & (capacity - 1)
+    };
+
+    typedef struct s_trace_entry  trace_entry;
+    typedef struct s_trace_header trace_header;
+
+    static const uint32_t TRACE_MAGIC   = 0x4254524e; // "NRTB"
+    static const uint32_t TRACE_VERSION = 2;
+
+    // Set in cycle_pc when an operand sits behind a read handler and wasn't recorded
+    static const uint64_t TRACE_OPERAND_UNKNOWN_0 = 1ull << 63;
+    static const uint64_t TRACE_OPERAND_UNKNOWN_1 = 1ull << 62;
+    static const uint64_t TRACE_CYCLE_PC_MASK     = TRACE_OPERAND_UNKNOWN_1 - 1;
+
+    // Queues a reason for noose::last_error, for failures the caller reports
+    void add_error(const char* error_str);
+
+    // What an iNES or NES 2.0 header says about the board. load_rom and the
+    // scanner both go through this so they never disagree about a file.
+    struct s_header_info
+    {
+        uint16_t mapper_id;
+        uint32_t size_prg; // bytes, 0xffffffff if the header asks for more than 4 GB
+        uint32_t size_chr;
+        bool     nes_2_0;
+    };
+
+    typedef struct s_header_info header_info;
+
+    header_info decode_header(const noose::header& h);
+
     namespace cpu
     {
         enum address_mode
@@ -55,7 +161,7 @@ namespace noose
             LO,
         };
 
-        enum action_address
+        enum action_address : uint8_t
         {
             ADDRESS_NONE,
             ADDRESS_A,
@@ -83,7 +189,7 @@ namespace noose
         };
         */
 
-        enum action_id
+        enum action_id : uint8_t
         {
             ID_NOP,
             ID_INCREMENT_PC,
@@ -93,7 +199,7 @@ namespace noose
             ID_WRITE_BYTE,
         };
 
-        enum action_behaviour_id
+        enum action_behaviour_id : uint8_t
         {
             ID_NONE,
             ID_SET_FLAGS,
@@ -177,12 +283,16 @@ namespace noose
             action(push_byte data)                              : id(ID_WRITE_BYTE), push_byte_data(data) {}
         };
 
+        // The longest 6502 instruction is 7 cycles, +1 slot to keep the table aligned
+        static const uint8_t MAX_INSTRUCTION_CYCLES = 8;
+
         struct s_instruction
         {
             address_mode address_mode;
-            action       cycles[16];
+            action       cycles[MAX_INSTRUCTION_CYCLES];
             uint8_t      cycle_count;
             uint8_t      code;
+            uint8_t      length; // opcode + operand bytes
             struct
             {
                 uint8_t aaa : 3;
@@ -197,27 +307,637 @@ namespace noose
             func_type   type;
         };
 
+        static const uint8_t  BLOCK_MAX_INSTRUCTIONS = 32;
+        static const uint16_t BLOCK_CACHE_SIZE       = 1024; // must be a power of two
+
+        // A straight-line run of decoded instructions, ending at the first
+        // branch, JMP, JSR, RTS, RTI or BRK. Keyed by start address and PRG bank,
+        // blocks never span two PRG windows so a bank switch can't make one stale.
+        // A block that switches its own window stops at the next instruction.
+        struct s_block
+        {
+            const s_instruction* instructions[BLOCK_MAX_INSTRUCTIONS];
+            uint16_t             pcs[BLOCK_MAX_INSTRUCTIONS];
+            uint16_t             pc;
+            uint16_t             end_pc; // last byte covered by the block
+            uint16_t             bank;
+            uint16_t             hits;   // executions, drives JIT compilation
+            uint8_t              instruction_count;
+            uint8_t              valid;
+            uint8_t              touches_io; // went through a read or write handler, never compiled
+            uint32_t             generation; // code_generation of its pages when translated
+            void*                native; // JIT compiled entry point, if any
+        };
+
+        typedef uint8_t (*read_handler)(machine* m, uint16_t addr);
+        typedef void    (*write_handler)(machine* m, uint16_t addr, uint8_t data);
+
+        // One entry per 256 byte page of the CPU address space. Pages backed
+        // by host memory point straight at it, everything else (PPU, APU and
+        // IO registers, open bus, mapper registers) goes through the handlers.
+        struct s_page
+        {
+            uint8_t*      read;  // 0 if reads go through on_read
+            uint8_t*      write; // 0 if writes go through on_write
+            read_handler  on_read;
+            write_handler on_write;
+        };
+
         typedef struct s_instruction_meta instruction_meta;
         typedef struct s_instruction      instruction;
+        typedef struct s_block            block;
+        typedef struct s_page             page;
+
+        bool               initialize(machine* m, const noose::rom* rom);
+        void               initialize_tables(); // done by initialize, for users without a machine
+        const instruction& get_next_instruction(machine* m);
+        const instruction& get_decoded_instruction(uint8_t code);
+        instruction_meta   get_instruction_meta(const instruction& inst);
+        address_mode       get_address_mode(const cpu::instruction& inst);
+        const char*        get_address_mode_str(const cpu::instruction& inst);
+        uint8_t            read_memory(machine* m, uint16_t addr);
+        void               write_memory(machine* m, uint16_t addr, uint8_t data);
+        void               map_memory(machine* m, uint16_t addr, uint32_t size, uint8_t* mem, bool writable);
+        void               map_handler(machine* m, uint16_t addr, uint32_t size, read_handler on_read, write_handler on_write);
+        uint8_t            open_bus_read(machine* m, uint16_t addr); // handlers for nothing on the bus
+        void               open_bus_write(machine* m, uint16_t addr, uint8_t data);
+        void               execute(machine* m, const instruction& inst);
+        void               execute_action(machine* m, const action& action);
+        uint32_t           run(machine* m, uint32_t cycle_budget);
+        void               reset(machine* m);
+        bool               poll_interrupts(machine* m); // true if an IRQ is held off by the I flag
+        uint8_t            get_status(const machine* m);  // p with N/Z/C/V worked out
+        void               set_status(machine* m, uint8_t p);
+
+        // Basic block cache (noose_cpu_block.cpp)
+        block*             get_block(machine* m, uint16_t addr);
+        uint32_t           execute_block(machine* m, block* b);
+        uint32_t           execute_uncached(machine* m); // one instruction at pc, for code behind read handlers
+        void               invalidate_blocks(machine* m);
+        void               invalidate_blocks(machine* m, uint16_t addr);
+    }
+
+    namespace mapper
+    {
+        enum mapper_id
+        {
+            MAPPER_NROM  = 0,
+            MAPPER_MMC1  = 1,
+            MAPPER_UXROM = 2,
+            MAPPER_CNROM = 3,
+            MAPPER_MMC3  = 4,
+        };
+
+        enum mirroring
+        {
+            MIRROR_HORIZONTAL  = 0,
+            MIRROR_VERTICAL    = 1,
+            MIRROR_SINGLE_LOW  = 2,
+            MIRROR_SINGLE_HIGH = 3,
+            MIRROR_FOUR_SCREEN = 4,
+        };
+
+        // Board registers only, the PRG/CHR windows are derived from these
+        // by apply_banks so the struct can be copied around as is.
+        struct s_state
+        {
+            uint8_t id;
+            uint8_t mirroring;
+            uint8_t prg_ram_enabled;
+            uint8_t irq_pending;
+
+            // UxROM, CNROM
+            uint8_t bank_select;
+
+            // MMC1
+            uint8_t mmc1_shift;
+            uint8_t mmc1_shift_count;
+            uint8_t mmc1_control;
+            uint8_t mmc1_chr_0;
+            uint8_t mmc1_chr_1;
+            uint8_t mmc1_prg;
+
+            // MMC3
+            uint8_t mmc3_bank_select;
+            uint8_t mmc3_banks[8];
+            uint8_t mmc3_irq_latch;
+            uint8_t mmc3_irq_counter;
+            uint8_t mmc3_irq_reload;
+            uint8_t mmc3_irq_enabled;
+        };
+
+        static const uint32_t CHR_WINDOW_SIZE = 1024;
+        static const uint32_t PRG_WINDOW_SIZE = 8192;
+
+        bool     initialize(machine* m, const noose::rom* rom);
+        void     apply_banks(machine* m);
+        uint16_t get_prg_bank(machine* m, uint16_t addr);
+        void     clock_scanline(machine* m);
+    }
+
+    namespace ppu
+    {
+        enum ctrl_flags
+        {
+            CTRL_NAMETABLE         = 0x03,
+            CTRL_INCREMENT_32      = 0x04,
+            CTRL_SPRITE_TABLE      = 0x08,
+            CTRL_BACKGROUND_TABLE  = 0x10,
+            CTRL_SPRITE_SIZE_16    = 0x20,
+            CTRL_NMI               = 0x80,
+        };
+
+        enum mask_flags
+        {
+            MASK_GRAYSCALE         = 0x01,
+            MASK_BACKGROUND_LEFT   = 0x02,
+            MASK_SPRITES_LEFT      = 0x04,
+            MASK_BACKGROUND        = 0x08,
+            MASK_SPRITES           = 0x10,
+        };
+
+        enum status_flags
+        {
+            STATUS_SPRITE_OVERFLOW = 0x20,
+            STATUS_SPRITE_ZERO_HIT = 0x40,
+            STATUS_VBLANK          = 0x80,
+        };
+
+        // Sprite pixel attributes in a line buffer
+        enum sprite_pixel_flags
+        {
+            SPRITE_PIXEL_PALETTE   = 0x1c,
+            SPRITE_PIXEL_BASE      = 0x10, // sprite palettes start at $3F10
+            SPRITE_PIXEL_ZERO      = 0x40,
+            SPRITE_PIXEL_BEHIND    = 0x80,
+        };
+
+        static const uint32_t TILE_SIZE          = 16; // bytes per 8x8 tile in CHR
+        static const uint32_t DECODED_TILE_SIZE  = 64; // one byte per pixel in the tile cache
+        static const uint32_t SCANLINE_DOTS      = 341;
+        static const uint32_t SCANLINE_COUNT     = 262;
+        static const uint32_t VBLANK_SCANLINE    = 241;
+        static const uint32_t PRERENDER_SCANLINE = 261;
+
+        // Registers and memory only, like mapper::s_state it can be copied as is
+        struct s_state
+        {
+            uint8_t  ctrl;
+            uint8_t  mask;
+            uint8_t  status;
+            uint8_t  oam_addr;
+            uint16_t v;           // current vram address
+            uint16_t t;           // temporary vram address
+            uint8_t  fine_x;
+            uint8_t  w;           // first/second write toggle
+            uint8_t  read_buffer; // $2007 reads lag one behind
+            uint8_t  bus;         // last value written to a register
+            uint8_t  nmi_pending;
+            uint16_t scanline;
+            uint16_t dot;
+            uint32_t frame;
+            uint8_t  oam[256];
+            uint8_t  palette[32];
+            uint8_t  vram[4096];  // four nametables, only four screen boards use the upper two
+        };
+
+        // One scanline split into what the compositor needs. Background
+        // pixels are fetched a whole tile at a time, fine_x picks the first.
+        struct s_line
+        {
+            uint8_t bg_pattern[FRAME_WIDTH + 16]; // 0-3, 0 is transparent
+            uint8_t bg_attr[FRAME_WIDTH + 16];    // palette << 2
+            uint8_t sprite_pattern[FRAME_WIDTH];  // 0-3, 0 is transparent
+            uint8_t sprite_attr[FRAME_WIDTH];     // sprite_pixel_flags
+            uint8_t fine_x;
+        };
+
+        typedef struct s_line line;
+
+        void initialize(machine* m);
+        void decode_tiles(const uint8_t* chr, uint32_t size, uint8_t* tiles_out);
+        void catch_up(machine* m, uint64_t cycle); // runs the PPU up to a CPU cycle
+        void catch_up_access(machine* m);          // same, for an access by the running instruction
+        void oam_dma(machine* m, uint8_t page);
+
+        // Compositor paths (noose_ppu_compose.cpp), compose_line goes through
+        // the fastest one the host supports. Returns true on a sprite 0 hit.
+        typedef bool (*compose_fn)(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out);
+
+        void select_compose();
+        bool compose_line(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out);
+        bool compose_line_scalar(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out);
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+        bool compose_line_sse2(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out);
+        bool compose_line_avx2(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out);
+#endif
+    }
+
+    namespace apu
+    {
+        static const uint32_t CPU_CLOCK_RATE      = 1789773; // NTSC
+        static const uint32_t DEFAULT_SAMPLE_RATE = 44100;
+        static const uint32_t BLIP_PHASES         = 32;   // sub-sample positions of a step
+        static const uint32_t BLIP_WIDTH          = 16;   // taps per band-limited step
+        static const uint32_t BLIP_BUFFER_SIZE    = 1024; // samples, more than between two frame counter steps
+        static const uint32_t RING_SIZE           = 16384; // must be a power of two
+
+        struct s_envelope
+        {
+            uint8_t start;
+            uint8_t loop;     // also halts the length counter
+            uint8_t constant;
+            uint8_t volume;   // constant volume or divider period
+            uint8_t divider;
+            uint8_t decay;
+        };
+
+        struct s_pulse
+        {
+            s_envelope envelope;
+            uint8_t    duty;
+            uint8_t    duty_pos;
+            uint8_t    length;
+            uint8_t    sweep_enabled;
+            uint8_t    sweep_period;
+            uint8_t    sweep_negate;
+            uint8_t    sweep_shift;
+            uint8_t    sweep_divider;
+            uint8_t    sweep_reload;
+            uint16_t   timer;
+            uint64_t   next_clock; // cpu cycle of the next sequencer step
+        };
+
+        struct s_triangle
+        {
+            uint8_t  control; // also halts the length counter
+            uint8_t  linear_load;
+            uint8_t  linear;
+            uint8_t  linear_reload;
+            uint8_t  length;
+            uint8_t  pos;
+            uint16_t timer;
+            uint64_t next_clock;
+        };
+
+        struct s_noise
+        {
+            s_envelope envelope;
+            uint8_t    mode;
+            uint8_t    period;
+            uint8_t    length;
+            uint16_t   lfsr;
+            uint64_t   next_clock;
+        };
+
+        struct s_dmc
+        {
+            uint8_t  irq_enabled;
+            uint8_t  loop;
+            uint8_t  rate;
+            uint8_t  level;
+            uint16_t sample_address;
+            uint16_t sample_length;
+            uint16_t address;
+            uint16_t bytes_remaining;
+            uint8_t  buffer;
+            uint8_t  buffer_full;
+            uint8_t  shift;
+            uint8_t  bits_remaining;
+            uint8_t  silence;
+            uint64_t next_clock; // next output bit
+        };
 
-        extern uint8_t  prg_rom[32767]; // $10000-$8000
-        extern uint8_t  ram[2048];      // 2kb main RAM
-        extern uint8_t  a;              // accumulator register
-        extern uint8_t  x;              // index register x
-        extern uint8_t  y;              // index register y
-        extern uint8_t  p;              // cpu status flags
-        extern uint8_t  sp;             // stack pointer
-        extern uint16_t pc;             // program counter
-
-        void             initialize(const noose::rom* rom);
-        instruction      get_next_instruction();
-        instruction_meta get_instruction_meta(const instruction inst);
-        address_mode     get_address_mode(const cpu::instruction inst);
-        const char*      get_address_mode_str(const cpu::instruction inst);
-        uint8_t          read_memory(uint16_t addr);
-        void             write_memory(uint16_t addr, uint8_t data);
-        void             execute(const instruction inst);
+        // Registers and channel state, like ppu::s_state it can be copied as is
+        struct s_state
+        {
+            s_pulse    pulse[2];
+            s_triangle triangle;
+            s_noise    noise;
+            s_dmc      dmc;
+            uint8_t    enabled;       // $4015 channel enables
+            uint8_t    frame_mode;    // 0: 4 step, 1: 5 step
+            uint8_t    frame_irq_inhibit;
+            uint8_t    frame_step;
+            uint8_t    frame_irq;
+            uint8_t    dmc_irq;
+            uint64_t   frame_start;   // cpu cycle the current frame counter sequence started
+            uint64_t   frame_next;    // cpu cycle of the next frame counter step
+            float      amplitude;     // mixer output after the last change
+        };
+
+        // Band-limited synthesis: amplitude changes go in as steps, filtered
+        // through a windowed sinc, and samples come out by integrating
+        struct s_blip
+        {
+            float    diff[BLIP_BUFFER_SIZE + BLIP_WIDTH];
+            uint64_t cycle;  // cpu cycle of the last flush
+            uint64_t offset; // 32.32 sample position of cycle, relative to diff[0]
+            uint64_t factor; // 32.32 samples per cpu cycle
+            float    integrator;
+            float    highpass;
+        };
+
+        // Single producer (the emulation thread), single consumer ring of
+        // mono samples. Positions only ever grow and wrap through the mask.
+        struct s_ring
+        {
+            int16_t  samples[RING_SIZE];
+            uint32_t write_pos __attribute__((aligned(64)));
+            uint32_t read_pos  __attribute__((aligned(64)));
+            uint32_t dropped; // samples lost because nobody was reading
+        };
+
+        void     initialize(machine* m);
+        void     catch_up(machine* m, uint64_t cycle);
+        void     catch_up_access(machine* m);
+        uint8_t  read_status(machine* m);
+        void     write_register(machine* m, uint16_t addr, uint8_t data);
+        uint32_t get_ring_space(machine* m);
+        void     restart_output(machine* m);
     }
+
+    // Timed hardware events (noose_events.cpp)
+    namespace events
+    {
+        enum event_id
+        {
+            EVENT_PPU,   // vblank NMI and the MMC3 scanline clock are due
+            EVENT_APU,   // frame counter step (and IRQ) or DMC sample fetch
+            EVENT_COUNT,
+        };
+
+        static const uint64_t NEVER = ~(uint64_t) 0;
+
+        struct s_event
+        {
+            uint64_t cycle;
+            uint8_t  id;
+        };
+
+        typedef struct s_event event;
+
+        void initialize(machine* m);
+        void schedule(machine* m, event_id id, uint64_t cycle);
+        void cancel(machine* m, event_id id);
+        void signal_interrupt(machine* m); // an NMI or IRQ line went active, or the I flag was cleared
+        void dispatch(machine* m);
+    }
+
+    // Instruction tracing (noose_trace.cpp)
+    namespace trace
+    {
+        void record(machine* m, uint8_t opcode); // before the instruction at pc runs
+    }
+
+#if defined(NOOSE_PROFILE)
+    // Execution counters (noose_profile.cpp), only in builds with NOOSE_PROFILE
+    namespace profile
+    {
+        static const uint32_t IO_REGISTER_COUNT = 8 + 32; // $2000-$2007, then $4000-$401F
+
+        struct s_counters
+        {
+            uint64_t  opcode_count[256];
+            uint64_t  opcode_cycles[256];
+            uint64_t* prg_pc_count;            // per PRG ROM byte, so per bank and offset
+            uint64_t  low_pc_count[0x8000];    // code below $8000, RAM and PRG RAM
+            uint64_t  page_reads[256];
+            uint64_t  page_writes[256];
+            uint64_t  io_reads[IO_REGISTER_COUNT];
+            uint64_t  io_writes[IO_REGISTER_COUNT];
+            uint64_t  block_lookups;
+            uint64_t  block_translations;
+            uint64_t  blocks_interpreted;
+            uint64_t  blocks_native;
+            uint64_t  jit_compiles;
+        };
+
+        typedef struct s_counters counters;
+
+        void initialize(machine* m, const noose::rom* rom);
+        void release(machine* m);
+        void count_instruction(machine* m, uint8_t opcode); // before the instruction at pc runs
+
+        // Handler pages are the I/O registers, mapper registers and open bus
+        static inline int32_t get_io_register(uint16_t addr)
+        {
+            if (addr >= 0x2000 && addr < 0x4000)
+            {
+                return addr & 7;
+            }
+            if (addr >= 0x4000 && addr < 0x4020)
+            {
+                return 8 + (addr & 0x1f);
+            }
+            return -1;
+        }
+    }
+#endif
+
+#if defined(NOOSE_JIT_ENABLED)
+    // Call-threaded x86-64 code for hot blocks (noose_cpu_jit.cpp)
+    namespace jit
+    {
+        static const uint16_t HOT_THRESHOLD = 16;
+
+        enum compile_result
+        {
+            COMPILE_FAILED,
+            COMPILE_DONE,
+            COMPILE_FLUSHED, // the arena was full, every block was dropped including this one
+        };
+
+        void           initialize(machine* m);
+        void           release(machine* m);
+        compile_result compile(machine* m, cpu::block* b);
+        uint32_t       execute(machine* m, const cpu::block* b);
+    }
+#endif
+
+    // NTSC timing, three PPU dots per CPU cycle
+    static const uint32_t PPU_DOTS_PER_FRAME     = 341 * 262;
+    static const uint32_t PPU_DOTS_PER_CPU_CYCLE = 3;
+
+    // Everything one emulated console owns. No state lives outside of this,
+    // so any number of machines can run side by side on different threads.
+    struct s_machine
+    {
+        // CPU
+        uint8_t           a;            // accumulator register
+        uint8_t           x;            // index register x
+        uint8_t           y;            // index register y
+        uint8_t           p;            // cpu status flags, stale where flags_lazy is set, see cpu::get_status
+        uint8_t           sp;           // stack pointer
+        uint8_t           flags_lazy;     // N/Z/C/V bits of p still to be derived from the two below
+        uint8_t           flags_overflow; // V is bit 7
+        uint16_t          flags_result;   // last result, N is bit 7, Z is the low byte being 0, C is bit 8
+        uint16_t          pc;           // program counter
+        uint16_t          address_temp; // scratch address used between cycles
+        uint64_t          cycles;       // cpu cycles since power on, includes the running instruction
+        uint8_t           ram[2048];    // 2kb main RAM
+        cpu::page         page_table[256];
+
+        // Cartridge
+        const noose::rom* rom;
+        uint8_t*          prg_data;
+        uint32_t          prg_size;
+        uint8_t*          chr_data;
+        uint32_t          chr_size;
+        mapper::s_state   mapper_state;
+        uint8_t*          chr_banks[8];  // 1kb windows of PPU $0000-$1FFF
+        uint8_t           chr_writable;  // set for boards with CHR RAM
+        uint8_t           prg_ram[8192]; // $6000-$7FFF
+        uint8_t           chr_ram[8192];
+        uint8_t*          chr_tile_data;     // decoded CHR ROM or chr_ram_tiles
+        uint8_t*          chr_tile_banks[8]; // decoded views of chr_banks
+        uint8_t           chr_ram_tiles[8192 * 4];
+
+        // PPU
+        ppu::s_state      ppu_state;
+        uint64_t          ppu_cycles;     // cpu cycle the PPU has been caught up to
+        uint8_t           frame_buffer[FRAME_WIDTH * FRAME_HEIGHT];
+
+        // APU
+        apu::s_state      apu_state;
+        uint64_t          apu_cycles; // cpu cycle the APU has been caught up to
+        uint32_t          sample_rate; // 0 if no samples are produced
+        apu::s_blip       apu_blip;
+        apu::s_ring       audio_ring;
+
+        // Events
+        events::event     event_heap[events::EVENT_COUNT];
+        uint32_t          event_count;
+        uint64_t          next_event_cycle; // the CPU loop checks for events and interrupts from here on
+
+        // Controllers
+        uint8_t           pad_buttons[2]; // as last set by noose::set_input
+        uint8_t           pad_shift[2];   // shifted out one bit per $4016/$4017 read
+        uint8_t           pad_strobe;
+
+        // Run-ahead snapshot, allocated on first use
+        struct s_save_state* run_ahead_state;
+
+        // Trace ring, 0 unless tracing
+        trace_header*     trace;
+        trace_entry*      trace_entries;
+        uint64_t          trace_mask;
+        size_t            trace_mapping_size;
+
+        // Block cache
+        uint8_t           block_code_pages[256]; // pages holding cached blocks
+        uint32_t          code_generation[256];  // bumped by writes to those, stales every block on the page
+        cpu::block*       running_block;         // the one execute_block was last called with
+        uint64_t          handler_accesses;      // reads and writes that went through a page handler
+        uint32_t          bank_generation;       // bumped by every mapper::apply_banks
+        uint32_t          block_bank_generation; // bank_generation when the running block was entered
+        cpu::block        blocks[cpu::BLOCK_CACHE_SIZE];
+
+        // JIT
+        uint8_t*          jit_arena;
+        size_t            jit_arena_used;
+
+#if defined(NOOSE_PROFILE)
+        profile::counters* profile;
+#endif
+    };
+
+    static const uint32_t STATE_MAGIC = 0x5453534e; // "NSST"
+
+    // Everything noose::save_state captures, in one flat block. Only plain
+    // data, bank pointers are rebuilt from the mapper registers on load. Any
+    // change to this or to the structs it embeds needs a new STATE_VERSION.
+    struct s_save_state
+    {
+        uint32_t          magic;
+        uint32_t          version;
+        uint32_t          size;
+        uint32_t          prg_size; // the cartridge the state was taken on
+        uint32_t          chr_size;
+
+        // CPU
+        uint8_t           a;
+        uint8_t           x;
+        uint8_t           y;
+        uint8_t           p;
+        uint8_t           sp;
+        uint16_t          pc;
+        uint16_t          address_temp;
+        uint64_t          cycles;
+        uint8_t           ram[2048];
+
+        // Cartridge
+        mapper::s_state   mapper_state;
+        uint8_t           prg_ram[8192];
+        uint8_t           chr_ram[8192];
+
+        // PPU
+        ppu::s_state      ppu_state;
+        uint64_t          ppu_cycles;
+
+        // APU
+        apu::s_state      apu_state;
+        uint64_t          apu_cycles;
+
+        // Events
+        events::event     event_heap[events::EVENT_COUNT];
+        uint32_t          event_count;
+        uint64_t          next_event_cycle;
+
+        // Controllers
+        uint8_t           pad_buttons[2];
+        uint8_t           pad_shift[2];
+        uint8_t           pad_strobe;
+    };
+
+    typedef struct s_save_state save_state_data;
+
+    // Byte ring of encoded save states, oldest at tail. While wrapped the
+    // entries run from tail to wrap_end and then from 0 to head.
+    struct s_rewind_buffer
+    {
+        uint8_t*          data;
+        uint32_t          capacity;
+        uint32_t          head;
+        uint32_t          tail;
+        uint32_t          wrap_end;
+        bool              wrapped;
+        uint32_t          count;
+        uint32_t          keyframe_interval;
+        uint32_t          since_keyframe;
+        save_state_data*  current; // state of the newest entry
+        save_state_data*  next;    // state being pushed
+        uint8_t*          encoded; // entry being pushed
+        uint32_t          encoded_capacity;
+    };
+
+    static const uint32_t MOVIE_MAGIC   = 0x1a564d4e; // "NMV\x1a"
+    static const uint32_t MOVIE_VERSION = 2;
+
+    // Start of a movie file, followed by state_size bytes of save state and
+    // then two bytes of controller input per frame
+    struct s_movie_header
+    {
+        uint32_t          magic;
+        uint32_t          version;
+        uint32_t          anchor;      // noose::movie_anchor
+        uint32_t          frame_count;
+        uint32_t          prg_size;    // the cartridge it was recorded on
+        uint32_t          chr_size;
+        uint64_t          prg_hash;
+        uint32_t          state_size;  // 0 for MOVIE_ANCHOR_POWER_ON
+    };
+
+    typedef struct s_movie_header movie_header;
+
+    struct s_movie
+    {
+        movie_header      header;
+        save_state_data*  state;          // MOVIE_ANCHOR_STATE only
+        uint8_t*          input;          // port 0 and port 1 per frame
+        uint32_t          frame_capacity;
+        uint32_t          position;       // next frame to play
+    };
 }
 
 #endif
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+PRG and CHR windows always point into the cartridge data loaded by load_rom
+(or into the on-board RAM), switching a bank only rewrites page table and
+chr_banks pointers, no bytes are copied. All of it lives in the machine.
+*/
+
+static inline uint32_t prg_bank_count_8k(const machine* m)
+{
+    return m->prg_size / mapper::PRG_WINDOW_SIZE;
+}
+
+static inline uint32_t chr_bank_count_1k(const machine* m)
+{
+    return m->chr_size / mapper::CHR_WINDOW_SIZE;
+}
+
+// An 8kb PRG has no whole 16kb bank, mapping bank 0 mirrors it instead
+static inline uint32_t last_prg_bank_16k(const machine* m)
+{
+    uint32_t count = prg_bank_count_8k(m) / 2;
+    return count > 0 ? count - 1 : 0;
+}
+
+// Maps a 8kb PRG bank into one of the four CPU windows at $8000-$FFFF
+static inline void map_prg_8k(machine* m, uint8_t window, uint32_t bank)
+{
+    bank %= prg_bank_count_8k(m);
+    cpu::map_memory(m, 0x8000 + window * mapper::PRG_WINDOW_SIZE, mapper::PRG_WINDOW_SIZE,
+        m->prg_data + bank * mapper::PRG_WINDOW_SIZE, false);
+}
+
+static inline void map_prg_16k(machine* m, uint8_t window, uint32_t bank)
+{
+    map_prg_8k(m, window * 2 + 0, bank * 2 + 0);
+    map_prg_8k(m, window * 2 + 1, bank * 2 + 1);
+}
+
+static inline void map_prg_32k(machine* m, uint32_t bank)
+{
+    map_prg_16k(m, 0, bank * 2 + 0);
+    map_prg_16k(m, 1, bank * 2 + 1);
+}
+
+// Maps a 1kb CHR bank into one of the eight PPU windows at $0000-$1FFF
+static inline void map_chr_1k(machine* m, uint8_t window, uint32_t bank)
+{
+    bank %= chr_bank_count_1k(m);
+    m->chr_banks[window]      = m->chr_data + bank * mapper::CHR_WINDOW_SIZE;
+    m->chr_tile_banks[window] = m->chr_tile_data + bank * mapper::CHR_WINDOW_SIZE * (ppu::DECODED_TILE_SIZE / ppu::TILE_SIZE);
+}
+
+static inline void map_chr_2k(machine* m, uint8_t window, uint32_t bank)
+{
+    map_chr_1k(m, window * 2 + 0, bank * 2 + 0);
+    map_chr_1k(m, window * 2 + 1, bank * 2 + 1);
+}
+
+static inline void map_chr_4k(machine* m, uint8_t window, uint32_t bank)
+{
+    map_chr_2k(m, window * 2 + 0, bank * 2 + 0);
+    map_chr_2k(m, window * 2 + 1, bank * 2 + 1);
+}
+
+static inline void map_chr_8k(machine* m, uint32_t bank)
+{
+    map_chr_4k(m, 0, bank * 2 + 0);
+    map_chr_4k(m, 1, bank * 2 + 1);
+}
+
+static void apply_banks_mmc1(machine* m)
+{
+    static const uint8_t mirroring_lut[] =
+    {
+        mapper::MIRROR_SINGLE_LOW,
+        mapper::MIRROR_SINGLE_HIGH,
+        mapper::MIRROR_VERTICAL,
+        mapper::MIRROR_HORIZONTAL,
+    };
+
+    mapper::s_state& s = m->mapper_state;
+    uint8_t prg_mode   = (s.mmc1_control >> 2) & 0x03;
+    uint8_t chr_mode   = (s.mmc1_control >> 4) & 0x01;
+    uint8_t prg_bank   = s.mmc1_prg & 0x0f;
+
+    s.mirroring       = mirroring_lut[s.mmc1_control & 0x03];
+    s.prg_ram_enabled = !(s.mmc1_prg & 0x10);
+
+    switch(prg_mode)
+    {
+        case 0:
+        case 1:
+            map_prg_32k(m, prg_bank >> 1);
+            break;
+        case 2:
+            map_prg_16k(m, 0, 0);
+            map_prg_16k(m, 1, prg_bank);
+            break;
+        case 3:
+            map_prg_16k(m, 0, prg_bank);
+            map_prg_16k(m, 1, last_prg_bank_16k(m));
+            break;
+    }
+
+    if (chr_mode)
+    {
+        map_chr_4k(m, 0, s.mmc1_chr_0);
+        map_chr_4k(m, 1, s.mmc1_chr_1);
+    }
+    else
+    {
+        map_chr_8k(m, s.mmc1_chr_0 >> 1);
+    }
+}
+
+static void apply_banks_mmc3(machine* m)
+{
+    mapper::s_state& s      = m->mapper_state;
+    uint32_t bank_count     = prg_bank_count_8k(m);
+    uint32_t second_to_last = bank_count > 1 ? bank_count - 2 : 0;
+    uint32_t last           = bank_count - 1;
+
+    if (s.mmc3_bank_select & 0x40)
+    {
+        map_prg_8k(m, 0, second_to_last);
+        map_prg_8k(m, 2, s.mmc3_banks[6]);
+    }
+    else
+    {
+        map_prg_8k(m, 0, s.mmc3_banks[6]);
+        map_prg_8k(m, 2, second_to_last);
+    }
+
+    map_prg_8k(m, 1, s.mmc3_banks[7]);
+    map_prg_8k(m, 3, last);
+
+    // A12 inversion swaps the 2kb and 1kb halves of the pattern tables
+    uint8_t inv = (s.mmc3_bank_select & 0x80) ? 4 : 0;
+    map_chr_1k(m, 0 ^ inv, s.mmc3_banks[0] & 0xfe);
+    map_chr_1k(m, 1 ^ inv, s.mmc3_banks[0] | 0x01);
+    map_chr_1k(m, 2 ^ inv, s.mmc3_banks[1] & 0xfe);
+    map_chr_1k(m, 3 ^ inv, s.mmc3_banks[1] | 0x01);
+    map_chr_1k(m, 4 ^ inv, s.mmc3_banks[2]);
+    map_chr_1k(m, 5 ^ inv, s.mmc3_banks[3]);
+    map_chr_1k(m, 6 ^ inv, s.mmc3_banks[4]);
+    map_chr_1k(m, 7 ^ inv, s.mmc3_banks[5]);
+}
+
+void mapper::apply_banks(machine* m)
+{
+    mapper::s_state& state = m->mapper_state;
+
+    // The running block may have come from a window that's switched below
+    m->bank_generation++;
+
+    switch(state.id)
+    {
+        case MAPPER_NROM:
+            map_prg_32k(m, 0);
+            map_chr_8k(m, 0);
+            break;
+        case MAPPER_MMC1:
+            apply_banks_mmc1(m);
+            break;
+        case MAPPER_UXROM:
+            map_prg_16k(m, 0, state.bank_select);
+            map_prg_16k(m, 1, last_prg_bank_16k(m));
+            map_chr_8k(m, 0);
+            break;
+        case MAPPER_CNROM:
+            map_prg_32k(m, 0);
+            map_chr_8k(m, state.bank_select);
+            break;
+        case MAPPER_MMC3:
+            apply_banks_mmc3(m);
+            break;
+    }
+
+    if (state.prg_ram_enabled)
+    {
+        cpu::map_memory(m, 0x6000, sizeof(m->prg_ram), m->prg_ram, true);
+    }
+    else
+    {
+        cpu::map_handler(m, 0x6000, sizeof(m->prg_ram), cpu::open_bus_read, cpu::open_bus_write);
+    }
+}
+
+static void write_mmc1(machine* m, uint16_t addr, uint8_t data)
+{
+    mapper::s_state& s = m->mapper_state;
+
+    if (data & 0x80)
+    {
+        s.mmc1_shift       = 0;
+        s.mmc1_shift_count = 0;
+        s.mmc1_control    |= 0x0c;
+        mapper::apply_banks(m);
+        return;
+    }
+
+    s.mmc1_shift = (s.mmc1_shift >> 1) | ((data & 0x01) << 4);
+
+    if (++s.mmc1_shift_count < 5)
+    {
+        return;
+    }
+
+    switch((addr >> 13) & 0x03)
+    {
+        case 0: s.mmc1_control = s.mmc1_shift; break;
+        case 1: s.mmc1_chr_0   = s.mmc1_shift; break;
+        case 2: s.mmc1_chr_1   = s.mmc1_shift; break;
+        case 3: s.mmc1_prg     = s.mmc1_shift; break;
+    }
+
+    s.mmc1_shift       = 0;
+    s.mmc1_shift_count = 0;
+    mapper::apply_banks(m);
+}
+
+static void write_mmc3(machine* m, uint16_t addr, uint8_t data)
+{
+    mapper::s_state& s = m->mapper_state;
+    bool odd           = addr & 0x01;
+
+    switch(addr & 0xe000)
+    {
+        case 0x8000:
+            if (odd)
+            {
+                s.mmc3_banks[s.mmc3_bank_select & 0x07] = data;
+            }
+            else
+            {
+                s.mmc3_bank_select = data;
+            }
+            mapper::apply_banks(m);
+            break;
+        case 0xA000:
+            if (odd)
+            {
+                s.prg_ram_enabled = (data & 0x80) != 0;
+                mapper::apply_banks(m);
+            }
+            else if (s.mirroring != mapper::MIRROR_FOUR_SCREEN)
+            {
+                s.mirroring = (data & 0x01) ? mapper::MIRROR_HORIZONTAL : mapper::MIRROR_VERTICAL;
+            }
+            break;
+        case 0xC000:
+            if (odd)
+            {
+                s.mmc3_irq_counter = 0;
+                s.mmc3_irq_reload  = 1;
+            }
+            else
+            {
+                s.mmc3_irq_latch = data;
+            }
+            break;
+        case 0xE000:
+            s.mmc3_irq_enabled = odd;
+            if (!odd)
+            {
+                s.irq_pending = 0;
+            }
+            break;
+    }
+}
+
+static void mapper_write(machine* m, uint16_t addr, uint8_t data)
+{
+    // Bank and IRQ registers change what the PPU renders and counts
+    ppu::catch_up_access(m);
+
+    switch(m->mapper_state.id)
+    {
+        case mapper::MAPPER_MMC1:
+            write_mmc1(m, addr, data);
+            break;
+        case mapper::MAPPER_UXROM:
+            m->mapper_state.bank_select = data & 0x0f;
+            mapper::apply_banks(m);
+            break;
+        case mapper::MAPPER_CNROM:
+            m->mapper_state.bank_select = data & 0x03;
+            mapper::apply_banks(m);
+            break;
+        case mapper::MAPPER_MMC3:
+            write_mmc3(m, addr, data);
+            break;
+    }
+}
+
+bool mapper::initialize(machine* m, const noose::rom* rom)
+{
+    switch(rom->mapper_id)
+    {
+        case MAPPER_NROM:
+        case MAPPER_MMC1:
+        case MAPPER_UXROM:
+        case MAPPER_CNROM:
+        case MAPPER_MMC3:
+            break;
+        default:
+        {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Unsupported mapper %u", (uint32_t) rom->mapper_id);
+            noose::add_error(msg);
+            return false;
+        }
+    }
+
+    // Bank numbers are taken modulo the bank count, an empty PRG has none
+    if (rom->size_prg == 0)
+    {
+        noose::add_error("ROM has no PRG data");
+        return false;
+    }
+
+    // NES 2.0 sizes can be anything, the windows need whole banks
+    if (rom->size_prg % PRG_WINDOW_SIZE != 0 || rom->size_chr % CHR_WINDOW_SIZE != 0)
+    {
+        noose::add_error("ROM PRG or CHR size isn't a whole number of banks");
+        return false;
+    }
+
+    mapper::s_state& state = m->mapper_state;
+
+    m->rom      = rom;
+    m->prg_data = rom->data_prg;
+    m->prg_size = rom->size_prg;
+
+    if (rom->size_chr > 0)
+    {
+        m->chr_data      = rom->data_chr;
+        m->chr_tile_data = rom->tiles_chr;
+        m->chr_size      = rom->size_chr;
+        m->chr_writable  = 0;
+    }
+    else
+    {
+        m->chr_data      = m->chr_ram;
+        m->chr_tile_data = m->chr_ram_tiles;
+        m->chr_size      = sizeof(m->chr_ram);
+        m->chr_writable  = 1;
+    }
+
+    memset(&state, 0, sizeof(state));
+    memset(m->prg_ram, 0, sizeof(m->prg_ram));
+    memset(m->chr_ram, 0, sizeof(m->chr_ram));
+    memset(m->chr_ram_tiles, 0, sizeof(m->chr_ram_tiles));
+
+    state.id              = (uint8_t) rom->mapper_id;
+    state.prg_ram_enabled = 1;
+
+    if (noose::header::ignore_mirror_control(rom->header))
+    {
+        state.mirroring = MIRROR_FOUR_SCREEN;
+    }
+    else
+    {
+        state.mirroring = noose::header::nametable_mirroring_mode(rom->header) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+    }
+
+    if (state.id == MAPPER_MMC1)
+    {
+        // Power on with the last bank fixed at $C000
+        state.mmc1_control = 0x0c;
+    }
+
+    // Register writes land on $8000-$FFFF, reads are replaced by the
+    // PRG windows in apply_banks
+    cpu::map_handler(m, 0x8000, 0x8000, cpu::open_bus_read, mapper_write);
+
+    apply_banks(m);
+
+    return true;
+}
+
+uint16_t mapper::get_prg_bank(machine* m, uint16_t addr)
+{
+    if (addr < 0x8000 || !m->rom)
+    {
+        return 0;
+    }
+
+    return (uint16_t) ((m->page_table[addr >> 8].read - m->prg_data) / PRG_WINDOW_SIZE);
+}
+
+void mapper::clock_scanline(machine* m)
+{
+    mapper::s_state& state = m->mapper_state;
+
+    if (state.id != MAPPER_MMC3)
+    {
+        return;
+    }
+
+    if (state.mmc3_irq_counter == 0 || state.mmc3_irq_reload)
+    {
+        state.mmc3_irq_counter = state.mmc3_irq_latch;
+        state.mmc3_irq_reload  = 0;
+    }
+    else
+    {
+        state.mmc3_irq_counter--;
+    }
+
+    if (state.mmc3_irq_counter == 0 && state.mmc3_irq_enabled)
+    {
+        state.irq_pending = 1;
+        events::signal_interrupt(m);
+    }
+}
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Input movies. A movie is a starting point, either power-on or a save state,
+and the controller bytes for every frame after it. The emulator is fully
+deterministic given those, so replaying a movie frame by frame through
+run_until_frame reproduces the recording bit for bit. Run-ahead only ever
+shows speculative frames and restores the real timeline, so it replays to
+the same state as well.
+
+The recording and replay commands print a hash of the final save state to
+compare runs with.
+*/
+
+static uint64_t get_state_hash(const machine* m)
+{
+    save_state_data* s = (save_state_data*) malloc(sizeof(save_state_data));
+    noose::save_state(m, s, sizeof(save_state_data));
+
+    uint64_t h = hash_fnv1a((const uint8_t*) s, sizeof(save_state_data));
+    free(s);
+    return h;
+}
+
+// False if the input buffer couldn't grow, mv is left as it was
+static bool reserve_frames(movie* mv, uint32_t frame_count)
+{
+    if (frame_count <= mv->frame_capacity)
+    {
+        return true;
+    }
+
+    size_t   doubled  = (size_t) mv->frame_capacity * 2;
+    size_t   capacity = frame_count > doubled ? frame_count : doubled;
+    uint8_t* input    = capacity <= 0xffffffff ? (uint8_t*) realloc(mv->input, capacity * 2) : 0;
+    if (!input)
+    {
+        return false;
+    }
+
+    mv->input          = input;
+    mv->frame_capacity = (uint32_t) capacity;
+    return true;
+}
+
+movie* noose::create_movie(const noose::machine* m, noose::movie_anchor anchor)
+{
+    if (anchor == noose::MOVIE_ANCHOR_POWER_ON && m->cycles != 0)
+    {
+        noose::error("Power-on movies need a machine that hasn't run yet");
+        return 0;
+    }
+
+    movie* mv = (movie*) calloc(1, sizeof(movie));
+
+    movie_header& h = mv->header;
+    h.magic         = MOVIE_MAGIC;
+    h.version       = MOVIE_VERSION;
+    h.anchor        = anchor;
+    h.prg_size      = m->prg_size;
+    h.chr_size      = m->chr_size;
+    h.prg_hash      = hash_fnv1a(m->prg_data, m->prg_size);
+
+    if (anchor == noose::MOVIE_ANCHOR_STATE)
+    {
+        h.state_size = sizeof(save_state_data);
+        mv->state    = (save_state_data*) calloc(1, sizeof(save_state_data));
+        noose::save_state(m, mv->state, h.state_size);
+    }
+
+    return mv;
+}
+
+void noose::destroy_movie(noose::movie* mv)
+{
+    if (!mv)
+    {
+        return;
+    }
+
+    free(mv->state);
+    free(mv->input);
+    free(mv);
+}
+
+movie* noose::load_movie(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        noose::error("Unable to open movie");
+        return 0;
+    }
+
+    movie* mv = (movie*) calloc(1, sizeof(movie));
+    bool   ok = fread(&mv->header, sizeof(movie_header), 1, f) == 1;
+
+    const movie_header& h = mv->header;
+
+    if (!ok || h.magic != MOVIE_MAGIC)
+    {
+        noose::error("Not a movie");
+        ok = false;
+    }
+    else if (h.version != MOVIE_VERSION)
+    {
+        noose::error("Movie version mismatch");
+        ok = false;
+    }
+    else if (h.anchor == noose::MOVIE_ANCHOR_STATE && h.state_size != sizeof(save_state_data))
+    {
+        noose::error("Movie save state doesn't match this build");
+        ok = false;
+    }
+
+    if (ok && h.anchor == noose::MOVIE_ANCHOR_STATE)
+    {
+        mv->state = (save_state_data*) malloc(sizeof(save_state_data));
+        ok        = fread(mv->state, sizeof(save_state_data), 1, f) == 1;
+    }
+
+    // frame_count comes from the file, it has to fit in what's left of it
+    struct stat st;
+    long        position = ftell(f);
+    if (ok && (fstat(fileno(f), &st) != 0 || position < 0 ||
+        (uint64_t) h.frame_count * 2 > (uint64_t) (st.st_size - position)))
+    {
+        noose::error("Movie is truncated");
+        ok = false;
+    }
+
+    if (ok && !reserve_frames(mv, h.frame_count))
+    {
+        noose::error("Not enough memory for the movie input");
+        ok = false;
+    }
+
+    if (ok)
+    {
+        ok = fread(mv->input, 2, h.frame_count, f) == h.frame_count;
+    }
+
+    fclose(f);
+
+    if (!ok)
+    {
+        noose::error("Unable to read movie");
+        noose::destroy_movie(mv);
+        return 0;
+    }
+
+    return mv;
+}
+
+bool noose::save_movie(const noose::movie* mv, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f)
+    {
+        noose::error("Unable to open movie for writing");
+        return false;
+    }
+
+    const movie_header& h = mv->header;
+
+    bool ok = fwrite(&h, sizeof(movie_header), 1, f) == 1;
+    if (ok && mv->state)
+    {
+        ok = fwrite(mv->state, h.state_size, 1, f) == 1;
+    }
+    if (ok && h.frame_count)
+    {
+        ok = fwrite(mv->input, 2, h.frame_count, f) == h.frame_count;
+    }
+
+    fclose(f);
+
+    if (!ok)
+    {
+        noose::error("Unable to write movie");
+    }
+    return ok;
+}
+
+machine* noose::start_movie(noose::movie* mv, const noose::rom* rom)
+{
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        return 0;
+    }
+
+    const movie_header& h = mv->header;
+    if (h.prg_size != m->prg_size || h.chr_size != m->chr_size || h.prg_hash != hash_fnv1a(m->prg_data, m->prg_size))
+    {
+        noose::error("Movie was recorded on a different ROM");
+        noose::destroy_machine(m);
+        return 0;
+    }
+
+    if (mv->state && !noose::load_state(m, mv->state, h.state_size))
+    {
+        noose::destroy_machine(m);
+        return 0;
+    }
+
+    mv->position = 0;
+    return m;
+}
+
+void noose::record_movie_frame(noose::movie* mv, noose::machine* m, uint8_t port_0, uint8_t port_1)
+{
+    movie_header& h = mv->header;
+
+    if (!reserve_frames(mv, h.frame_count + 1))
+    {
+        noose::error("Not enough memory for the movie input");
+        return;
+    }
+
+    mv->input[h.frame_count * 2 + 0] = port_0;
+    mv->input[h.frame_count * 2 + 1] = port_1;
+    h.frame_count++;
+    mv->position = h.frame_count;
+
+    noose::set_input(m, 0, port_0);
+    noose::set_input(m, 1, port_1);
+    noose::run_until_frame(m);
+}
+
+bool noose::play_movie_frame(noose::movie* mv, noose::machine* m, uint32_t frames_ahead)
+{
+    if (mv->position >= mv->header.frame_count)
+    {
+        return false;
+    }
+
+    const uint8_t* input = mv->input + mv->position * 2;
+    noose::set_input(m, 0, input[0]);
+    noose::set_input(m, 1, input[1]);
+    noose::run_frame_ahead(m, frames_ahead);
+
+    mv->position++;
+    return true;
+}
+
+uint32_t noose::get_movie_frames(const noose::movie* mv)
+{
+    return mv->header.frame_count;
+}
+
+// Buttons held for a few frames at a time, like a player mashing. Opposite
+// directions are left pressed together, the games don't get to pick.
+static uint8_t get_generated_input(uint32_t* seed, uint32_t frame, uint8_t last)
+{
+    if (frame % 8 != 0)
+    {
+        return last;
+    }
+
+    uint32_t x = xorshift32(seed);
+
+    // Start and select reset or pause most games, keep them rare
+    uint8_t buttons = (uint8_t) x & ~(noose::BUTTON_START | noose::BUTTON_SELECT);
+    if ((x >> 8) % 64 == 0)
+    {
+        buttons |= noose::BUTTON_START;
+    }
+    return buttons;
+}
+
+bool noose::record_movie(const noose::rom* rom, const char* movie_path, uint32_t frame_count, uint32_t seed)
+{
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        return false;
+    }
+
+    noose::set_audio_rate(m, 0);
+
+    noose::movie* mv = noose::create_movie(m, noose::MOVIE_ANCHOR_POWER_ON);
+
+    uint32_t state = seed ? seed : 1;
+    uint8_t  input = 0;
+    for (uint32_t i = 0; i < frame_count; ++i)
+    {
+        input = get_generated_input(&state, i, input);
+        noose::record_movie_frame(mv, m, input, 0);
+    }
+
+    bool ok = noose::save_movie(mv, movie_path);
+    if (ok)
+    {
+        printf("Recorded %u frames (%llu cycles) to %s, state hash %016llx\n", frame_count, (unsigned long long) m->cycles, movie_path, (unsigned long long) get_state_hash(m));
+    }
+
+    noose::destroy_movie(mv);
+    noose::destroy_machine(m);
+    return ok;
+}
+
+bool noose::play_movie(const noose::rom* rom, const char* movie_path, uint32_t frames_ahead)
+{
+    noose::movie* mv = noose::load_movie(movie_path);
+    if (!mv)
+    {
+        return false;
+    }
+
+    noose::machine* m = noose::start_movie(mv, rom);
+    if (!m)
+    {
+        noose::destroy_movie(mv);
+        return false;
+    }
+
+    noose::set_audio_rate(m, 0);
+
+    while(noose::play_movie_frame(mv, m, frames_ahead))
+    {
+    }
+
+    printf("Played %u frames (%llu cycles) from %s, state hash %016llx\n", mv->header.frame_count, (unsigned long long) m->cycles, movie_path, (unsigned long long) get_state_hash(m));
+
+    noose::destroy_machine(m);
+    noose::destroy_movie(mv);
+    return true;
+}
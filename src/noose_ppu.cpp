@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Scanline PPU. Each visible line is produced in one go at dot 257 from the
+current scroll registers: background and sprite pixels are fetched into a
+ppu::line and then composed into the frame buffer (noose_ppu_compose.cpp).
+Pattern data comes from a tile cache with one byte per pixel, CHR ROM is
+decoded once by load_rom and CHR RAM is re-decoded a row at a time as it is
+written, so fetching a tile row is an 8 byte copy.
+
+Everything else in the frame (vblank, the loopy scroll copies, the MMC3
+scanline clock) happens on the dot it would on hardware. The PPU doesn't run
+alongside the CPU though, it lags behind and is caught up to the CPU's
+timestamp (machine::cycles) only when that could be observed: on a register
+or mapper access, when something the CPU can't poll for is due (vblank NMI,
+MMC3 IRQ, see events::EVENT_PPU) and at the end of cpu::run. Since every
+access sees the PPU exactly where lockstep would have it, the result is the
+same as running both in step.
+*/
+
+// 2C02 colours, RGB
+static const uint8_t rgb_palette[64][3] =
+{
+    {0x66,0x66,0x66}, {0x00,0x2A,0x88}, {0x14,0x12,0xA7}, {0x3B,0x00,0xA4},
+    {0x5C,0x00,0x7E}, {0x6E,0x00,0x40}, {0x6C,0x06,0x00}, {0x56,0x1D,0x00},
+    {0x33,0x35,0x00}, {0x0B,0x48,0x00}, {0x00,0x52,0x00}, {0x00,0x4F,0x08},
+    {0x00,0x40,0x4D}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xAD,0xAD,0xAD}, {0x15,0x5F,0xD9}, {0x42,0x40,0xFF}, {0x75,0x27,0xFE},
+    {0xA0,0x1A,0xCC}, {0xB7,0x1E,0x7B}, {0xB5,0x31,0x20}, {0x99,0x4E,0x00},
+    {0x6B,0x6D,0x00}, {0x38,0x87,0x00}, {0x0C,0x93,0x00}, {0x00,0x8F,0x32},
+    {0x00,0x7C,0x8D}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xFF,0xFE,0xFF}, {0x64,0xB0,0xFF}, {0x92,0x90,0xFF}, {0xC6,0x76,0xFF},
+    {0xF3,0x6A,0xFF}, {0xFE,0x6E,0xCC}, {0xFE,0x81,0x70}, {0xEA,0x9E,0x22},
+    {0xBC,0xBE,0x00}, {0x88,0xD8,0x00}, {0x5C,0xE4,0x30}, {0x45,0xE0,0x82},
+    {0x48,0xCD,0xDE}, {0x4F,0x4F,0x4F}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+    {0xFF,0xFE,0xFF}, {0xC0,0xDF,0xFF}, {0xD3,0xD2,0xFF}, {0xE8,0xC8,0xFF},
+    {0xFB,0xC2,0xFF}, {0xFE,0xC4,0xEA}, {0xFE,0xCC,0xC5}, {0xF7,0xD8,0xA5},
+    {0xE4,0xE5,0x94}, {0xCF,0xEF,0x96}, {0xBD,0xF4,0xAB}, {0xB3,0xF3,0xCC},
+    {0xB5,0xEB,0xF2}, {0xB8,0xB8,0xB8}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+};
+
+// Physical nametable for each of the four logical ones, indexed by mapper::mirroring
+static const uint8_t nametable_lut[5][4] =
+{
+    {0, 0, 1, 1}, // horizontal
+    {0, 1, 0, 1}, // vertical
+    {0, 0, 0, 0}, // single screen, low
+    {1, 1, 1, 1}, // single screen, high
+    {0, 1, 2, 3}, // four screen
+};
+
+static inline void decode_tile_row(uint8_t lo, uint8_t hi, uint8_t* out)
+{
+    for (int c = 0; c < 8; ++c)
+    {
+        out[c] = ((lo >> (7 - c)) & 1) | (((hi >> (7 - c)) & 1) << 1);
+    }
+}
+
+void ppu::decode_tiles(const uint8_t* chr, uint32_t size, uint8_t* tiles_out)
+{
+    for (uint32_t tile = 0; tile < size / TILE_SIZE; ++tile)
+    {
+        const uint8_t* src = chr + tile * TILE_SIZE;
+        uint8_t*       dst = tiles_out + tile * DECODED_TILE_SIZE;
+
+        for (int row = 0; row < 8; ++row)
+        {
+            decode_tile_row(src[row], src[row + 8], dst + row * 8);
+        }
+    }
+}
+
+// 8 pixels of the tile row holding pattern address addr
+static inline const uint8_t* get_tile_row(const machine* m, uint16_t addr)
+{
+    uint32_t window_offset = addr & (mapper::CHR_WINDOW_SIZE - 1);
+    return m->chr_tile_banks[addr >> 10] + (window_offset / ppu::TILE_SIZE) * ppu::DECODED_TILE_SIZE + (addr & 0x07) * 8;
+}
+
+static inline uint8_t* get_nametable(machine* m, uint16_t addr)
+{
+    uint8_t table = nametable_lut[m->mapper_state.mirroring][(addr >> 10) & 0x03];
+    return &m->ppu_state.vram[table * 0x400 + (addr & 0x3ff)];
+}
+
+static inline uint8_t get_palette_index(uint16_t addr)
+{
+    // $3F10/$14/$18/$1C mirror the backdrop entries
+    uint8_t index = addr & 0x1f;
+    return (index & 0x13) == 0x10 ? index & 0x0f : index;
+}
+
+// Pattern table byte, only the low 13 bits of addr are used
+static inline uint8_t chr_read(const machine* m, uint16_t addr)
+{
+    return m->chr_banks[(addr >> 10) & 0x07][addr & 0x3ff];
+}
+
+static uint8_t vram_read(machine* m, uint16_t addr)
+{
+    addr &= 0x3fff;
+
+    if (addr < 0x2000)
+    {
+        return chr_read(m, addr);
+    }
+    if (addr < 0x3f00)
+    {
+        return *get_nametable(m, addr);
+    }
+    return m->ppu_state.palette[get_palette_index(addr)];
+}
+
+static void vram_write(machine* m, uint16_t addr, uint8_t data)
+{
+    addr &= 0x3fff;
+
+    if (addr < 0x2000)
+    {
+        if (!m->chr_writable)
+        {
+            return;
+        }
+
+        uint8_t* window = m->chr_banks[(addr >> 10) & 0x07];
+        uint16_t offset = addr & 0x3ff;
+        window[offset]  = data;
+
+        // Both bitplanes of the row feed the decoded pixels
+        uint16_t row_lo = offset & ~0x08;
+        decode_tile_row(window[row_lo], window[row_lo + 8], (uint8_t*) get_tile_row(m, addr));
+        return;
+    }
+    if (addr < 0x3f00)
+    {
+        *get_nametable(m, addr) = data;
+        return;
+    }
+    m->ppu_state.palette[get_palette_index(addr)] = data & 0x3f;
+}
+
+static inline bool is_rendering(const ppu::s_state& s)
+{
+    return (s.mask & (ppu::MASK_BACKGROUND | ppu::MASK_SPRITES)) != 0;
+}
+
+static inline void increment_y(ppu::s_state& s)
+{
+    if ((s.v & 0x7000) != 0x7000)
+    {
+        s.v += 0x1000;
+        return;
+    }
+
+    s.v &= ~0x7000;
+    uint16_t coarse_y = (s.v >> 5) & 0x1f;
+    if (coarse_y == 29)
+    {
+        coarse_y = 0;
+        s.v     ^= 0x0800;
+    }
+    else if (coarse_y == 31)
+    {
+        coarse_y = 0;
+    }
+    else
+    {
+        coarse_y++;
+    }
+    s.v = (s.v & ~0x03e0) | (coarse_y << 5);
+}
+
+static void fetch_background(machine* m, ppu::line* l)
+{
+    const ppu::s_state& s = m->ppu_state;
+    uint16_t v            = s.v;
+    uint16_t table        = (s.ctrl & ppu::CTRL_BACKGROUND_TABLE) ? 0x1000 : 0x0000;
+    uint16_t fine_y       = (v >> 12) & 0x07;
+
+    for (uint32_t tile = 0; tile < FRAME_WIDTH / 8 + 1; ++tile)
+    {
+        uint8_t index = *get_nametable(m, 0x2000 | (v & 0x0fff));
+        uint8_t attr  = *get_nametable(m, 0x23c0 | (v & 0x0c00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+        uint8_t pal   = (attr >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03;
+
+        memcpy(&l->bg_pattern[tile * 8], get_tile_row(m, table + index * ppu::TILE_SIZE + fine_y), 8);
+        memset(&l->bg_attr[tile * 8], pal << 2, 8);
+
+        if ((v & 0x1f) == 31)
+        {
+            v &= ~0x1f;
+            v ^= 0x0400;
+        }
+        else
+        {
+            v++;
+        }
+    }
+
+    l->fine_x = s.fine_x;
+
+    if (!(s.mask & ppu::MASK_BACKGROUND))
+    {
+        memset(l->bg_pattern, 0, sizeof(l->bg_pattern));
+    }
+    else if (!(s.mask & ppu::MASK_BACKGROUND_LEFT))
+    {
+        memset(&l->bg_pattern[l->fine_x], 0, 8);
+    }
+}
+
+static void fetch_sprites(machine* m, uint32_t scanline, ppu::line* l)
+{
+    ppu::s_state& s = m->ppu_state;
+
+    memset(l->sprite_pattern, 0, sizeof(l->sprite_pattern));
+    memset(l->sprite_attr, 0, sizeof(l->sprite_attr));
+
+    if (!(s.mask & ppu::MASK_SPRITES))
+    {
+        return;
+    }
+
+    int      height = (s.ctrl & ppu::CTRL_SPRITE_SIZE_16) ? 16 : 8;
+    uint32_t found  = 0;
+
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        const uint8_t* sprite = &s.oam[i * 4];
+
+        // Sprites show up one line below their Y coordinate
+        int row = (int) scanline - (int) sprite[0] - 1;
+        if (row < 0 || row >= height)
+        {
+            continue;
+        }
+
+        if (++found > 8)
+        {
+            s.status |= ppu::STATUS_SPRITE_OVERFLOW;
+            break;
+        }
+
+        uint8_t tile = sprite[1];
+        uint8_t attr = sprite[2];
+        uint8_t x    = sprite[3];
+
+        if (attr & 0x80)
+        {
+            row = height - 1 - row;
+        }
+
+        uint16_t addr;
+        if (height == 16)
+        {
+            addr = ((tile & 0x01) ? 0x1000 : 0x0000) + ((tile & 0xfe) + (row >> 3)) * ppu::TILE_SIZE + (row & 0x07);
+        }
+        else
+        {
+            addr = ((s.ctrl & ppu::CTRL_SPRITE_TABLE) ? 0x1000 : 0x0000) + tile * ppu::TILE_SIZE + row;
+        }
+
+        const uint8_t* pixels = get_tile_row(m, addr);
+        uint8_t        flags  = ppu::SPRITE_PIXEL_BASE | ((attr & 0x03) << 2) |
+            ((attr & 0x20) ? ppu::SPRITE_PIXEL_BEHIND : 0) |
+            (i == 0 ? ppu::SPRITE_PIXEL_ZERO : 0);
+
+        // Lower OAM entries win, so only fill pixels nobody has claimed yet
+        for (uint32_t p = 0; p < 8 && x + p < FRAME_WIDTH; ++p)
+        {
+            uint8_t pattern = pixels[(attr & 0x40) ? 7 - p : p];
+            if (pattern && !l->sprite_pattern[x + p])
+            {
+                l->sprite_pattern[x + p] = pattern;
+                l->sprite_attr[x + p]    = flags;
+            }
+        }
+    }
+
+    if (!(s.mask & ppu::MASK_SPRITES_LEFT))
+    {
+        memset(l->sprite_pattern, 0, 8);
+    }
+
+    // Sprite 0 never hits on the last pixel
+    l->sprite_attr[FRAME_WIDTH - 1] &= ~ppu::SPRITE_PIXEL_ZERO;
+}
+
+static void render_scanline(machine* m, uint32_t scanline)
+{
+    ppu::s_state& s          = m->ppu_state;
+    uint8_t*      out        = &m->frame_buffer[scanline * FRAME_WIDTH];
+    uint8_t       color_mask = (s.mask & ppu::MASK_GRAYSCALE) ? 0x30 : 0x3f;
+
+    if (!is_rendering(s))
+    {
+        memset(out, s.palette[0] & color_mask, FRAME_WIDTH);
+        return;
+    }
+
+    ppu::line l;
+    fetch_background(m, &l);
+    fetch_sprites(m, scanline, &l);
+
+    if (ppu::compose_line(l, s.palette, color_mask, out))
+    {
+        s.status |= ppu::STATUS_SPRITE_ZERO_HIT;
+    }
+}
+
+// Dots within a scanline where something happens, the last one wraps
+static const uint16_t event_dots[] = { 1, 257, 260, 280, ppu::SCANLINE_DOTS };
+
+static inline uint16_t get_next_event_dot(uint16_t dot)
+{
+    for (uint32_t i = 0; i < sizeof(event_dots) / sizeof(event_dots[0]); ++i)
+    {
+        if (event_dots[i] > dot)
+        {
+            return event_dots[i];
+        }
+    }
+    return ppu::SCANLINE_DOTS;
+}
+
+static void run_event(machine* m)
+{
+    ppu::s_state& s         = m->ppu_state;
+    bool          visible   = s.scanline < FRAME_HEIGHT;
+    bool          prerender = s.scanline == ppu::PRERENDER_SCANLINE;
+    bool          rendering = is_rendering(s);
+
+    switch(s.dot)
+    {
+        case 1:
+            if (s.scanline == ppu::VBLANK_SCANLINE)
+            {
+                s.status |= ppu::STATUS_VBLANK;
+                if (s.ctrl & ppu::CTRL_NMI)
+                {
+                    s.nmi_pending = 1;
+                    events::signal_interrupt(m);
+                }
+            }
+            else if (prerender)
+            {
+                s.status &= ~(ppu::STATUS_VBLANK | ppu::STATUS_SPRITE_ZERO_HIT | ppu::STATUS_SPRITE_OVERFLOW);
+            }
+            break;
+        case 257:
+            if (visible)
+            {
+                render_scanline(m, s.scanline);
+            }
+            if (rendering && (visible || prerender))
+            {
+                increment_y(s);
+                s.v = (s.v & ~0x041f) | (s.t & 0x041f);
+            }
+            break;
+        case 260:
+            if (rendering && (visible || prerender))
+            {
+                mapper::clock_scanline(m);
+            }
+            break;
+        case 280:
+            if (rendering && prerender)
+            {
+                s.v = (s.v & ~0x7be0) | (s.t & 0x7be0);
+            }
+            break;
+        case ppu::SCANLINE_DOTS:
+            s.dot = 0;
+            if (++s.scanline == ppu::SCANLINE_COUNT)
+            {
+                s.scanline = 0;
+                s.frame++;
+            }
+            break;
+    }
+}
+
+static void advance(machine* m, uint32_t dots)
+{
+    ppu::s_state& s = m->ppu_state;
+
+    while(dots > 0)
+    {
+        uint16_t next = get_next_event_dot(s.dot);
+        uint32_t step = next - s.dot;
+
+        if (step > dots)
+        {
+            s.dot += dots;
+            return;
+        }
+
+        dots  -= step;
+        s.dot  = next;
+        run_event(m);
+    }
+}
+
+// Dots from the current position up to, but not including, the next time the
+// PPU reaches (scanline, dot). A full frame if it's there right now.
+static inline uint32_t get_dots_until(const ppu::s_state& s, uint32_t scanline, uint32_t dot)
+{
+    uint32_t now    = s.scanline * ppu::SCANLINE_DOTS + s.dot;
+    uint32_t target = scanline * ppu::SCANLINE_DOTS + dot;
+    return target > now ? target - now : target + PPU_DOTS_PER_FRAME - now;
+}
+
+static uint64_t get_next_sync_cycle(const machine* m)
+{
+    const ppu::s_state& s    = m->ppu_state;
+    uint32_t            dots = get_dots_until(s, ppu::VBLANK_SCANLINE, 1);
+
+    // The scanline counter only clocks while rendering, otherwise it waits
+    // for a $2001 write which catches up anyway
+    if (m->mapper_state.id == mapper::MAPPER_MMC3 && is_rendering(s))
+    {
+        uint32_t to_clock = s.dot < 260 ? 260 - s.dot : 260 + ppu::SCANLINE_DOTS - s.dot;
+        dots              = to_clock < dots ? to_clock : dots;
+    }
+
+    return m->ppu_cycles + (dots + PPU_DOTS_PER_CPU_CYCLE - 1) / PPU_DOTS_PER_CPU_CYCLE;
+}
+
+void ppu::catch_up(machine* m, uint64_t cycle)
+{
+    if (cycle > m->ppu_cycles)
+    {
+        advance(m, (uint32_t) (cycle - m->ppu_cycles) * PPU_DOTS_PER_CPU_CYCLE);
+        m->ppu_cycles = cycle;
+    }
+    events::schedule(m, events::EVENT_PPU, get_next_sync_cycle(m));
+}
+
+void ppu::catch_up_access(machine* m)
+{
+    // The timestamp already covers the whole instruction, loads and stores
+    // do their access on its last cycle
+    ppu::catch_up(m, m->cycles > 0 ? m->cycles - 1 : 0);
+}
+
+static uint8_t register_read(machine* m, uint16_t addr)
+{
+    ppu::s_state& s = m->ppu_state;
+    ppu::catch_up_access(m);
+
+    switch(addr & 0x07)
+    {
+        case 2:
+            // Low bits are whatever was last left on the PPU bus
+            s.bus     = (s.status & 0xe0) | (s.bus & 0x1f);
+            s.status &= ~ppu::STATUS_VBLANK;
+            s.w       = 0;
+            break;
+        case 4:
+            s.bus = s.oam[s.oam_addr];
+            break;
+        case 7:
+        {
+            uint16_t vram_addr = s.v & 0x3fff;
+            if (vram_addr >= 0x3f00)
+            {
+                // Palette reads skip the buffer, which picks up the nametable below
+                s.bus         = vram_read(m, vram_addr);
+                s.read_buffer = vram_read(m, vram_addr - 0x1000);
+            }
+            else
+            {
+                s.bus         = s.read_buffer;
+                s.read_buffer = vram_read(m, vram_addr);
+            }
+            s.v += (s.ctrl & ppu::CTRL_INCREMENT_32) ? 32 : 1;
+        } break;
+    }
+
+    return s.bus;
+}
+
+static void register_write(machine* m, uint16_t addr, uint8_t data)
+{
+    ppu::s_state& s = m->ppu_state;
+    ppu::catch_up_access(m);
+
+    s.bus = data;
+
+    switch(addr & 0x07)
+    {
+        case 0:
+            // Turning NMIs on during vblank fires one straight away
+            if (!(s.ctrl & ppu::CTRL_NMI) && (data & ppu::CTRL_NMI) && (s.status & ppu::STATUS_VBLANK))
+            {
+                s.nmi_pending = 1;
+                events::signal_interrupt(m);
+            }
+            s.ctrl = data;
+            s.t    = (s.t & ~0x0c00) | ((data & ppu::CTRL_NAMETABLE) << 10);
+            break;
+        case 1:
+            s.mask = data;
+            break;
+        case 3:
+            s.oam_addr = data;
+            break;
+        case 4:
+            s.oam[s.oam_addr++] = data;
+            break;
+        case 5:
+            if (!s.w)
+            {
+                s.t      = (s.t & ~0x001f) | (data >> 3);
+                s.fine_x = data & 0x07;
+            }
+            else
+            {
+                s.t = (s.t & ~0x73e0) | ((data & 0x07) << 12) | ((data & 0xf8) << 2);
+            }
+            s.w ^= 1;
+            break;
+        case 6:
+            if (!s.w)
+            {
+                s.t = (s.t & 0x00ff) | ((data & 0x3f) << 8);
+            }
+            else
+            {
+                s.t = (s.t & 0xff00) | data;
+                s.v = s.t;
+            }
+            s.w ^= 1;
+            break;
+        case 7:
+            vram_write(m, s.v, data);
+            s.v += (s.ctrl & ppu::CTRL_INCREMENT_32) ? 32 : 1;
+            break;
+    }
+}
+
+// $4014, copies a whole CPU page starting at the current OAM address
+void ppu::oam_dma(machine* m, uint8_t page)
+{
+    ppu::s_state& s = m->ppu_state;
+    ppu::catch_up_access(m);
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        s.oam[(uint8_t) (s.oam_addr + i)] = cpu::read_memory(m, (page << 8) | i);
+    }
+}
+
+void ppu::initialize(machine* m)
+{
+    memset(&m->ppu_state, 0, sizeof(m->ppu_state));
+    memset(m->frame_buffer, 0, sizeof(m->frame_buffer));
+    ppu::select_compose();
+
+    m->ppu_cycles = m->cycles;
+    events::schedule(m, events::EVENT_PPU, get_next_sync_cycle(m));
+
+    // $2000-$3FFF: eight registers mirrored every 8 bytes
+    cpu::map_handler(m, 0x2000, 0x2000, register_read, register_write);
+}
+
+const uint8_t* noose::get_frame(const noose::machine* m)
+{
+    return m->frame_buffer;
+}
+
+void noose::get_frame_rgba(const noose::machine* m, uint8_t* out)
+{
+    for (uint32_t i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; ++i)
+    {
+        const uint8_t* rgb = rgb_palette[m->frame_buffer[i]];
+        out[i * 4 + 0]     = rgb[0];
+        out[i * 4 + 1]     = rgb[1];
+        out[i * 4 + 2]     = rgb[2];
+        out[i * 4 + 3]     = 0xff;
+    }
+}
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "noose_internal.h"
+
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+    #include <immintrin.h>
+#endif
+
+using namespace noose;
+
+/*
+Scanline compositor. Every pixel picks between the background and the sprite
+pixel on its column, looks the result up in palette RAM and flags a sprite 0
+hit when both are opaque. The scalar version is the reference, the SSE2 and
+AVX2 versions do the same thing 16 and 32 pixels at a time and must match it
+byte for byte (see noose::verify_compose). The fastest path the host supports
+is picked once, when the first PPU is initialized.
+*/
+
+static inline uint8_t compose_pixel(uint8_t bg, uint8_t bg_attr, uint8_t sprite, uint8_t sprite_attr)
+{
+    if (sprite && (!bg || !(sprite_attr & ppu::SPRITE_PIXEL_BEHIND)))
+    {
+        return (sprite_attr & (ppu::SPRITE_PIXEL_BASE | ppu::SPRITE_PIXEL_PALETTE)) | sprite;
+    }
+    else if (bg)
+    {
+        return bg_attr | bg;
+    }
+    return 0;
+}
+
+bool ppu::compose_line_scalar(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out)
+{
+    const uint8_t* bg_pattern = &l.bg_pattern[l.fine_x];
+    const uint8_t* bg_attr    = &l.bg_attr[l.fine_x];
+    bool           hit        = false;
+
+    for (uint32_t x = 0; x < FRAME_WIDTH; ++x)
+    {
+        uint8_t bg     = bg_pattern[x];
+        uint8_t sprite = l.sprite_pattern[x];
+        uint8_t attr   = l.sprite_attr[x];
+
+        if (bg && sprite && (attr & SPRITE_PIXEL_ZERO))
+        {
+            hit = true;
+        }
+
+        out[x] = palette[compose_pixel(bg, bg_attr[x], sprite, attr)] & color_mask;
+    }
+
+    return hit;
+}
+
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+bool ppu::compose_line_sse2(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out)
+{
+    const uint8_t* bg_pattern = &l.bg_pattern[l.fine_x];
+    const uint8_t* bg_attr    = &l.bg_attr[l.fine_x];
+    const __m128i  zero       = _mm_setzero_si128();
+    const __m128i  behind     = _mm_set1_epi8((char) SPRITE_PIXEL_BEHIND);
+    const __m128i  sprite_0   = _mm_set1_epi8((char) SPRITE_PIXEL_ZERO);
+    const __m128i  sp_palette = _mm_set1_epi8((char) SPRITE_PIXEL_PALETTE);
+    const __m128i  sp_base    = _mm_set1_epi8((char) SPRITE_PIXEL_BASE);
+    int            hit        = 0;
+
+    // No byte shuffle before SSSE3, the palette lookup stays scalar
+    uint8_t index[16];
+
+    for (uint32_t x = 0; x < FRAME_WIDTH; x += 16)
+    {
+        __m128i bg = _mm_loadu_si128((const __m128i*) &bg_pattern[x]);
+        __m128i ba = _mm_loadu_si128((const __m128i*) &bg_attr[x]);
+        __m128i sp = _mm_loadu_si128((const __m128i*) &l.sprite_pattern[x]);
+        __m128i sa = _mm_loadu_si128((const __m128i*) &l.sprite_attr[x]);
+
+        __m128i bg_clear   = _mm_cmpeq_epi8(bg, zero);
+        __m128i sp_clear   = _mm_cmpeq_epi8(sp, zero);
+        __m128i in_front   = _mm_cmpeq_epi8(_mm_and_si128(sa, behind), zero);
+        __m128i use_sprite = _mm_andnot_si128(sp_clear, _mm_or_si128(bg_clear, in_front));
+
+        __m128i is_zero = _mm_cmpeq_epi8(_mm_and_si128(sa, sprite_0), sprite_0);
+        hit |= _mm_movemask_epi8(_mm_andnot_si128(bg_clear, _mm_andnot_si128(sp_clear, is_zero)));
+
+        __m128i sp_index = _mm_or_si128(_mm_or_si128(_mm_and_si128(sa, sp_palette), sp_base), sp);
+        __m128i bg_index = _mm_andnot_si128(bg_clear, _mm_or_si128(ba, bg));
+        __m128i result   = _mm_or_si128(_mm_and_si128(use_sprite, sp_index), _mm_andnot_si128(use_sprite, bg_index));
+
+        _mm_storeu_si128((__m128i*) index, result);
+        for (uint32_t i = 0; i < 16; ++i)
+        {
+            out[x + i] = palette[index[i]] & color_mask;
+        }
+    }
+
+    return hit != 0;
+}
+
+__attribute__((target("avx2")))
+bool ppu::compose_line_avx2(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out)
+{
+    const uint8_t* bg_pattern = &l.bg_pattern[l.fine_x];
+    const uint8_t* bg_attr    = &l.bg_attr[l.fine_x];
+    const __m256i  zero       = _mm256_setzero_si256();
+    const __m256i  behind     = _mm256_set1_epi8((char) SPRITE_PIXEL_BEHIND);
+    const __m256i  sprite_0   = _mm256_set1_epi8((char) SPRITE_PIXEL_ZERO);
+    const __m256i  sp_palette = _mm256_set1_epi8((char) SPRITE_PIXEL_PALETTE);
+    const __m256i  mask       = _mm256_set1_epi8((char) color_mask);
+    int            hit        = 0;
+
+    // vpshufb looks up within 16 byte lanes, so the background and sprite
+    // halves of palette RAM each get broadcast to both lanes
+    const __m256i bg_colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) &palette[0]));
+    const __m256i sp_colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) &palette[16]));
+
+    for (uint32_t x = 0; x < FRAME_WIDTH; x += 32)
+    {
+        __m256i bg = _mm256_loadu_si256((const __m256i*) &bg_pattern[x]);
+        __m256i ba = _mm256_loadu_si256((const __m256i*) &bg_attr[x]);
+        __m256i sp = _mm256_loadu_si256((const __m256i*) &l.sprite_pattern[x]);
+        __m256i sa = _mm256_loadu_si256((const __m256i*) &l.sprite_attr[x]);
+
+        __m256i bg_clear   = _mm256_cmpeq_epi8(bg, zero);
+        __m256i sp_clear   = _mm256_cmpeq_epi8(sp, zero);
+        __m256i in_front   = _mm256_cmpeq_epi8(_mm256_and_si256(sa, behind), zero);
+        __m256i use_sprite = _mm256_andnot_si256(sp_clear, _mm256_or_si256(bg_clear, in_front));
+
+        __m256i is_zero = _mm256_cmpeq_epi8(_mm256_and_si256(sa, sprite_0), sprite_0);
+        hit |= _mm256_movemask_epi8(_mm256_andnot_si256(bg_clear, _mm256_andnot_si256(sp_clear, is_zero)));
+
+        // Both indices are below 16 here, use_sprite picks the palette half
+        __m256i sp_index = _mm256_or_si256(_mm256_and_si256(sa, sp_palette), sp);
+        __m256i bg_index = _mm256_andnot_si256(bg_clear, _mm256_or_si256(ba, bg));
+        __m256i sp_color = _mm256_shuffle_epi8(sp_colors, sp_index);
+        __m256i bg_color = _mm256_shuffle_epi8(bg_colors, bg_index);
+        __m256i color    = _mm256_blendv_epi8(bg_color, sp_color, use_sprite);
+
+        _mm256_storeu_si256((__m256i*) &out[x], _mm256_and_si256(color, mask));
+    }
+
+    return hit != 0;
+}
+#endif
+
+static ppu::compose_fn compose_impl = ppu::compose_line_scalar;
+static pthread_once_t  compose_once = PTHREAD_ONCE_INIT;
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+static bool            compose_avx2 = false; // host support, as found by select_compose_impl
+#endif
+
+static void select_compose_impl()
+{
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+    __builtin_cpu_init();
+    compose_avx2 = __builtin_cpu_supports("avx2") != 0;
+    if (compose_avx2)
+    {
+        compose_impl = ppu::compose_line_avx2;
+    }
+    else
+    {
+        // Always there on x86-64
+        compose_impl = ppu::compose_line_sse2;
+    }
+#endif
+}
+
+// Called from ppu::initialize, so every machine sees the final choice
+void ppu::select_compose()
+{
+    pthread_once(&compose_once, select_compose_impl);
+}
+
+bool ppu::compose_line(const line& l, const uint8_t* palette, uint8_t color_mask, uint8_t* out)
+{
+    return compose_impl(l, palette, color_mask, out);
+}
+
+// Lines look roughly like a game's: mostly opaque background and a few
+// sprite runs, with every attribute combination showing up somewhere
+static void random_line(uint32_t* seed, ppu::line* l, uint8_t* palette)
+{
+    for (uint32_t x = 0; x < FRAME_WIDTH + 16; ++x)
+    {
+        l->bg_pattern[x] = xorshift32(seed) & 3;
+        l->bg_attr[x]    = (xorshift32(seed) & 3) << 2;
+    }
+
+    memset(l->sprite_pattern, 0, sizeof(l->sprite_pattern));
+    memset(l->sprite_attr, 0, sizeof(l->sprite_attr));
+
+    uint32_t sprite_count = xorshift32(seed) % 9;
+    for (uint32_t i = 0; i < sprite_count; ++i)
+    {
+        uint32_t x     = xorshift32(seed) % FRAME_WIDTH;
+        uint8_t  flags = xorshift32(seed) & (ppu::SPRITE_PIXEL_PALETTE | ppu::SPRITE_PIXEL_ZERO | ppu::SPRITE_PIXEL_BEHIND);
+        for (uint32_t p = 0; p < 8 && x + p < FRAME_WIDTH; ++p)
+        {
+            l->sprite_pattern[x + p] = xorshift32(seed) & 3;
+            l->sprite_attr[x + p]    = flags | ppu::SPRITE_PIXEL_BASE;
+        }
+    }
+
+    l->fine_x = xorshift32(seed) & 7;
+
+    for (uint32_t i = 0; i < 32; ++i)
+    {
+        palette[i] = xorshift32(seed) & 0x3f;
+    }
+}
+
+struct s_compose_path
+{
+    const char*     name;
+    ppu::compose_fn fn;
+    bool            supported;
+};
+
+bool noose::verify_compose(uint32_t line_count)
+{
+    ppu::select_compose();
+
+    s_compose_path paths[] =
+    {
+        { "scalar", ppu::compose_line_scalar, true },
+#if defined(NOOSE_PPU_SIMD_ENABLED)
+        { "sse2",   ppu::compose_line_sse2,   true },
+        { "avx2",   ppu::compose_line_avx2,   compose_avx2 },
+#endif
+    };
+
+    const uint32_t path_count = sizeof(paths) / sizeof(paths[0]);
+
+    ppu::line* lines    = (ppu::line*) malloc(line_count * sizeof(ppu::line));
+    uint8_t*   palettes = (uint8_t*) malloc(line_count * 32);
+    uint8_t*   expected = (uint8_t*) malloc(line_count * FRAME_WIDTH);
+    bool*      hits     = (bool*) malloc(line_count * sizeof(bool));
+    uint32_t   seed     = 0x2c02;
+    bool       ok       = true;
+
+    for (uint32_t i = 0; i < line_count; ++i)
+    {
+        random_line(&seed, &lines[i], &palettes[i * 32]);
+    }
+
+    for (uint32_t p = 0; p < path_count && ok; ++p)
+    {
+        if (!paths[p].supported)
+        {
+            printf("%-8s: not supported on this host\n", paths[p].name);
+            continue;
+        }
+
+        uint8_t  out[FRAME_WIDTH];
+        uint32_t hit_count = 0;
+        double   start     = get_time_seconds();
+
+        for (uint32_t i = 0; i < line_count; ++i)
+        {
+            uint8_t color_mask = (i & 1) ? 0x30 : 0x3f;
+            uint8_t* result    = p == 0 ? &expected[i * FRAME_WIDTH] : out;
+            bool     hit       = paths[p].fn(lines[i], &palettes[i * 32], color_mask, result);
+
+            hit_count += hit;
+
+            if (p == 0)
+            {
+                hits[i] = hit;
+            }
+            else if (hit != hits[i] || memcmp(out, &expected[i * FRAME_WIDTH], FRAME_WIDTH) != 0)
+            {
+                char buf[128];
+                snprintf(buf, sizeof(buf), "Compositor mismatch: %s differs from scalar on line %u", paths[p].name, i);
+                noose::error(buf);
+                ok = false;
+                break;
+            }
+        }
+
+        if (ok)
+        {
+            double seconds = get_time_seconds() - start;
+            printf("%-8s: %.1f ns/line, %u hits%s\n", paths[p].name, seconds * 1e9 / (line_count ? line_count : 1),
+                hit_count, paths[p].fn == compose_impl ? " (selected)" : "");
+        }
+    }
+
+    free(hits);
+    free(expected);
+    free(palettes);
+    free(lines);
+
+    return ok;
+}
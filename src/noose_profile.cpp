@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Execution profile, compiled in only with NOOSE_PROFILE so the hot paths
+carry no trace of it otherwise. The CPU counts executed opcodes and their
+cycles, the executed pc (per PRG ROM byte, which is per bank and offset,
+or per address below $8000), memory accesses per page and per I/O register,
+and how blocks were looked up and run. The JIT compiles a counter call into
+every instruction, so native code is profiled exactly like interpreted code.
+
+Reports are CSV, one counter per row, or folded stacks weighted by cycles
+(bank;page;pc_mnemonic cycles) for flamegraph.pl and friends.
+*/
+
+#if defined(NOOSE_PROFILE)
+
+void profile::initialize(machine* m, const noose::rom* rom)
+{
+    m->profile = (profile::counters*) calloc(1, sizeof(profile::counters));
+    m->profile->prg_pc_count = (uint64_t*) calloc(rom->size_prg + 1, sizeof(uint64_t));
+}
+
+void profile::release(machine* m)
+{
+    if (m->profile)
+    {
+        free(m->profile->prg_pc_count);
+        free(m->profile);
+        m->profile = 0;
+    }
+}
+
+void profile::count_instruction(machine* m, uint8_t opcode)
+{
+    profile::counters*      c    = m->profile;
+    const cpu::instruction& inst = cpu::get_decoded_instruction(opcode);
+
+    c->opcode_count[opcode]++;
+    c->opcode_cycles[opcode] += inst.cycle_count;
+
+    // PRG pages point straight into the ROM, which gives bank and offset
+    const cpu::page& pg = m->page_table[m->pc >> 8];
+    if (m->pc >= 0x8000 && pg.read)
+    {
+        c->prg_pc_count[(pg.read - m->prg_data) + (m->pc & 0xff)]++;
+    }
+    else
+    {
+        c->low_pc_count[m->pc & 0x7fff]++;
+    }
+}
+
+static const char* get_opcode_name(uint8_t opcode)
+{
+    return cpu::get_instruction_meta(cpu::get_decoded_instruction(opcode)).name;
+}
+
+static void get_io_register_name(uint32_t reg, char* out)
+{
+    sprintf(out, "$%04X", reg < 8 ? 0x2000 + reg : 0x4000 + (reg - 8));
+}
+
+// Code below $8000 has no bank, what's there now is the best guess at what ran
+static uint8_t get_low_opcode(const machine* m, uint16_t addr)
+{
+    if (addr < 0x2000)
+    {
+        return m->ram[addr & 0x7ff];
+    }
+    if (addr >= 0x6000)
+    {
+        return m->prg_ram[addr & 0x1fff];
+    }
+    return 0;
+}
+
+static void write_csv(const machine* m, FILE* f)
+{
+    const profile::counters* c = m->profile;
+    char                     name[16];
+
+    fprintf(f, "section,key,count,cycles\n");
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        if (c->opcode_count[i])
+        {
+            fprintf(f, "opcode,%02X %s,%llu,%llu\n", i, get_opcode_name(i),
+                (unsigned long long) c->opcode_count[i], (unsigned long long) c->opcode_cycles[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < m->prg_size; ++i)
+    {
+        if (c->prg_pc_count[i])
+        {
+            const cpu::instruction& inst = cpu::get_decoded_instruction(m->prg_data[i]);
+            fprintf(f, "pc,prg %02X:%04X,%llu,%llu\n", i / mapper::PRG_WINDOW_SIZE, i % mapper::PRG_WINDOW_SIZE,
+                (unsigned long long) c->prg_pc_count[i], (unsigned long long) c->prg_pc_count[i] * inst.cycle_count);
+        }
+    }
+
+    for (uint32_t i = 0; i < 0x8000; ++i)
+    {
+        if (c->low_pc_count[i])
+        {
+            const cpu::instruction& inst = cpu::get_decoded_instruction(get_low_opcode(m, i));
+            fprintf(f, "pc,$%04X,%llu,%llu\n", i,
+                (unsigned long long) c->low_pc_count[i], (unsigned long long) c->low_pc_count[i] * inst.cycle_count);
+        }
+    }
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        if (c->page_reads[i])
+        {
+            fprintf(f, "page_read,$%02X00,%llu,\n", i, (unsigned long long) c->page_reads[i]);
+        }
+        if (c->page_writes[i])
+        {
+            fprintf(f, "page_write,$%02X00,%llu,\n", i, (unsigned long long) c->page_writes[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < profile::IO_REGISTER_COUNT; ++i)
+    {
+        get_io_register_name(i, name);
+        if (c->io_reads[i])
+        {
+            fprintf(f, "io_read,%s,%llu,\n", name, (unsigned long long) c->io_reads[i]);
+        }
+        if (c->io_writes[i])
+        {
+            fprintf(f, "io_write,%s,%llu,\n", name, (unsigned long long) c->io_writes[i]);
+        }
+    }
+
+    fprintf(f, "block,lookups,%llu,\n",      (unsigned long long) c->block_lookups);
+    fprintf(f, "block,translations,%llu,\n", (unsigned long long) c->block_translations);
+    fprintf(f, "block,interpreted,%llu,\n",  (unsigned long long) c->blocks_interpreted);
+    fprintf(f, "block,native,%llu,\n",       (unsigned long long) c->blocks_native);
+    fprintf(f, "block,jit_compiles,%llu,\n", (unsigned long long) c->jit_compiles);
+}
+
+static void write_folded(const machine* m, FILE* f)
+{
+    const profile::counters* c = m->profile;
+
+    for (uint32_t i = 0; i < m->prg_size; ++i)
+    {
+        if (c->prg_pc_count[i])
+        {
+            uint8_t  opcode = m->prg_data[i];
+            uint32_t offset = i % mapper::PRG_WINDOW_SIZE;
+            fprintf(f, "prg_%02X;page_%04X;%04X_%s %llu\n", i / mapper::PRG_WINDOW_SIZE, offset & 0xff00, offset, get_opcode_name(opcode),
+                (unsigned long long) c->prg_pc_count[i] * cpu::get_decoded_instruction(opcode).cycle_count);
+        }
+    }
+
+    for (uint32_t i = 0; i < 0x8000; ++i)
+    {
+        if (c->low_pc_count[i])
+        {
+            uint8_t opcode = get_low_opcode(m, i);
+            const char* area = i < 0x2000 ? "ram" : (i < 0x6000 ? "io" : "prg_ram");
+            fprintf(f, "%s;page_%04X;%04X_%s %llu\n", area, i & 0xff00, i, get_opcode_name(opcode),
+                (unsigned long long) c->low_pc_count[i] * cpu::get_decoded_instruction(opcode).cycle_count);
+        }
+    }
+}
+
+bool noose::record_profile(const noose::rom* rom, const char* path, uint32_t frame_count, noose::profile_format format)
+{
+    FILE* f = fopen(path, "w");
+    if (!f)
+    {
+        noose::error("Unable to open profile for writing");
+        return false;
+    }
+
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        fclose(f);
+        return false;
+    }
+
+    noose::set_audio_rate(m, 0);
+
+    for (uint32_t i = 0; i < frame_count; ++i)
+    {
+        noose::run_until_frame(m);
+    }
+
+    if (format == noose::PROFILE_FORMAT_FOLDED)
+    {
+        write_folded(m, f);
+    }
+    else
+    {
+        write_csv(m, f);
+    }
+
+    fclose(f);
+
+    const profile::counters* c = m->profile;
+    printf("Profiled %u frames (%llu cycles) to %s, %.1f%% block cache hits, %.1f%% of blocks native\n",
+        frame_count, (unsigned long long) m->cycles, path,
+        c->block_lookups ? 100.0 * (c->block_lookups - c->block_translations) / c->block_lookups : 0.0,
+        c->block_lookups ? 100.0 * c->blocks_native / c->block_lookups : 0.0);
+
+    noose::destroy_machine(m);
+    return true;
+}
+
+#else
+
+bool noose::record_profile(const noose::rom*, const char*, uint32_t, noose::profile_format)
+{
+    noose::error("Profiling needs a build with NOOSE_PROFILE");
+    return false;
+}
+
+#endif
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Rewind history. Every pushed frame becomes one entry in a byte ring holding
+the XOR of its save state against the one pushed before it, run-length
+coded, so a frame where only a few hundred bytes changed costs a few
+hundred bytes. The newest state is kept decoded, and since XOR is its own
+inverse, stepping back one frame is applying the newest delta to it and
+dropping that entry.
+
+Every keyframe_interval frames the entry also carries the whole state. That
+bounds stepping back many frames at once: instead of applying every delta
+from the newest state down, decoding starts at the keyframe nearest to the
+target. When the ring is full the oldest entries are dropped, the deltas
+only ever point backwards so nothing newer depends on them.
+
+Encoded data is a sequence of tokens: u16 count of zero bytes to skip, u16
+count of literal bytes, then the literal bytes.
+*/
+
+struct s_entry_header
+{
+    uint32_t size;       // whole entry, also repeated in the last 4 bytes
+    uint32_t delta_size; // 0 for the first entry after the buffer was empty
+    uint32_t full_size;  // 0 unless ENTRY_KEYFRAME
+    uint32_t flags;
+};
+
+typedef struct s_entry_header entry_header;
+
+enum entry_flags
+{
+    ENTRY_KEYFRAME = 1, // the full state follows the delta
+};
+
+static const uint32_t STATE_SIZE    = sizeof(save_state_data);
+static const uint32_t MAX_RUN       = 0xffff;
+static const uint32_t MIN_ZERO_RUN  = 8; // shorter runs go into the literals, a token costs 4 bytes
+static const uint32_t NO_ENTRY      = ~0u;
+
+static inline uint8_t get_xor(const uint8_t* a, const uint8_t* b, uint32_t i)
+{
+    return b ? a[i] ^ b[i] : a[i];
+}
+
+static inline bool is_zero_word(const uint8_t* a, const uint8_t* b, uint32_t i)
+{
+    uint64_t wa, wb = 0;
+    memcpy(&wa, a + i, 8);
+    if (b)
+    {
+        memcpy(&wb, b + i, 8);
+    }
+    return (wa ^ wb) == 0;
+}
+
+// Encodes a ^ b, or just a when b is NULL, returns the encoded size
+static uint32_t encode_xor(const uint8_t* a, const uint8_t* b, uint32_t size, uint8_t* out)
+{
+    uint32_t i = 0;
+    uint32_t o = 0;
+
+    while(i < size)
+    {
+        uint32_t zeros = 0;
+        while(i + zeros + 8 <= size && zeros + 8 <= MAX_RUN && is_zero_word(a, b, i + zeros))
+        {
+            zeros += 8;
+        }
+        while(i + zeros < size && zeros < MAX_RUN && get_xor(a, b, i + zeros) == 0)
+        {
+            ++zeros;
+        }
+        i += zeros;
+
+        // Literals run until the next zero run long enough to be worth a token
+        uint32_t literals = 0;
+        while(i + literals < size)
+        {
+            uint32_t run = 0;
+            while(run < MIN_ZERO_RUN && i + literals + run < size && get_xor(a, b, i + literals + run) == 0)
+            {
+                ++run;
+            }
+
+            if (run == MIN_ZERO_RUN || i + literals + run == size || literals + run + 1 > MAX_RUN)
+            {
+                break;
+            }
+
+            literals += run + 1;
+        }
+
+        uint16_t token[2] = { (uint16_t) zeros, (uint16_t) literals };
+        memcpy(out + o, token, sizeof(token));
+        o += sizeof(token);
+
+        for (uint32_t j = 0; j < literals; ++j)
+        {
+            out[o++] = get_xor(a, b, i + j);
+        }
+        i += literals;
+    }
+
+    return o;
+}
+
+static void apply_xor(uint8_t* dst, const uint8_t* in, uint32_t in_size)
+{
+    const uint8_t* end = in + in_size;
+    while(in < end)
+    {
+        uint16_t token[2];
+        memcpy(token, in, sizeof(token));
+        in  += sizeof(token);
+        dst += token[0];
+
+        for (uint32_t j = 0; j < token[1]; ++j)
+        {
+            *dst++ ^= *in++;
+        }
+    }
+}
+
+static inline const entry_header* get_entry(const rewind_buffer* r, uint32_t offset)
+{
+    return (const entry_header*) (r->data + offset);
+}
+
+// Offset of the entry that ends at end, 0 means the end of the upper part
+static uint32_t get_entry_before(const rewind_buffer* r, uint32_t end)
+{
+    if (end == 0)
+    {
+        assert(r->wrapped);
+        end = r->wrap_end;
+    }
+
+    uint32_t size;
+    memcpy(&size, r->data + end - sizeof(size), sizeof(size));
+    return end - size;
+}
+
+static void clear(rewind_buffer* r)
+{
+    r->head           = 0;
+    r->tail           = 0;
+    r->wrap_end       = 0;
+    r->wrapped        = false;
+    r->count          = 0;
+    r->since_keyframe = 0;
+}
+
+static void drop_oldest(rewind_buffer* r)
+{
+    r->tail += get_entry(r, r->tail)->size;
+    if (r->wrapped && r->tail == r->wrap_end)
+    {
+        r->tail    = 0;
+        r->wrapped = false;
+    }
+
+    if (--r->count == 0)
+    {
+        clear(r);
+    }
+}
+
+static void drop_newest(rewind_buffer* r)
+{
+    uint32_t offset = get_entry_before(r, r->head);
+    if (r->head == 0)
+    {
+        r->wrapped = false;
+    }
+    r->head = offset;
+
+    if (--r->count == 0)
+    {
+        clear(r);
+    }
+}
+
+// Makes room for size contiguous bytes at head, dropping the oldest entries
+static bool reserve(rewind_buffer* r, uint32_t size)
+{
+    if (size > r->capacity)
+    {
+        return false;
+    }
+
+    while(r->count)
+    {
+        if (!r->wrapped)
+        {
+            if (r->capacity - r->head >= size)
+            {
+                return true;
+            }
+            if (r->tail >= size)
+            {
+                r->wrap_end = r->head;
+                r->head     = 0;
+                r->wrapped  = true;
+                return true;
+            }
+        }
+        else if (r->tail - r->head >= size)
+        {
+            return true;
+        }
+
+        drop_oldest(r);
+    }
+
+    return true;
+}
+
+static uint32_t count_since_keyframe(const rewind_buffer* r)
+{
+    uint32_t offset = r->head;
+    for (uint32_t i = 0; i < r->count && i < r->keyframe_interval; ++i)
+    {
+        offset = get_entry_before(r, offset);
+        if (get_entry(r, offset)->flags & ENTRY_KEYFRAME)
+        {
+            return i;
+        }
+    }
+    return r->keyframe_interval;
+}
+
+rewind_buffer* noose::create_rewind(uint32_t memory_budget, uint32_t keyframe_interval)
+{
+    if (memory_budget < STATE_SIZE * 2)
+    {
+        noose::error("Rewind budget too small to hold a single frame");
+        return 0;
+    }
+
+    rewind_buffer* r = (rewind_buffer*) calloc(1, sizeof(rewind_buffer));
+
+    // Worst case a token per MIN_ZERO_RUN + 1 bytes, for the delta and the full state
+    r->encoded_capacity  = sizeof(entry_header) + 2 * (STATE_SIZE + STATE_SIZE / 2 + 16) + sizeof(uint32_t);
+    r->data              = (uint8_t*) malloc(memory_budget);
+    r->capacity          = memory_budget;
+    r->keyframe_interval = keyframe_interval;
+    r->current           = (save_state_data*) malloc(STATE_SIZE);
+    r->next              = (save_state_data*) malloc(STATE_SIZE);
+    r->encoded           = (uint8_t*) malloc(r->encoded_capacity);
+
+    clear(r);
+    return r;
+}
+
+void noose::destroy_rewind(rewind_buffer* r)
+{
+    free(r->data);
+    free(r->current);
+    free(r->next);
+    free(r->encoded);
+    free(r);
+}
+
+uint32_t noose::get_rewind_frames(const rewind_buffer* r)
+{
+    return r->count;
+}
+
+bool noose::push_rewind(rewind_buffer* r, const machine* m)
+{
+    noose::save_state(m, r->next, STATE_SIZE);
+
+    bool first    = r->count == 0;
+    bool keyframe = first || (r->keyframe_interval && r->since_keyframe + 1 >= r->keyframe_interval);
+
+    entry_header* h = (entry_header*) r->encoded;
+    uint8_t* out    = r->encoded + sizeof(entry_header);
+
+    h->delta_size = first ? 0 : encode_xor((const uint8_t*) r->next, (const uint8_t*) r->current, STATE_SIZE, out);
+    h->flags      = keyframe ? ENTRY_KEYFRAME : 0;
+
+    h->full_size  = keyframe ? encode_xor((const uint8_t*) r->next, 0, STATE_SIZE, out + h->delta_size) : 0;
+
+    uint32_t size = sizeof(entry_header) + h->delta_size + h->full_size;
+
+    // Keep headers aligned, the size goes last as well for walking backwards
+    size     = ((size + 3) & ~3u) + sizeof(uint32_t);
+    h->size  = size;
+    memcpy(r->encoded + size - sizeof(uint32_t), &size, sizeof(uint32_t));
+    assert(size <= r->encoded_capacity);
+
+    if (!reserve(r, size))
+    {
+        noose::error("Rewind frame larger than the whole budget");
+        return false;
+    }
+
+    memcpy(r->data + r->head, r->encoded, size);
+    r->head += size;
+    r->count++;
+    r->since_keyframe = keyframe ? 0 : r->since_keyframe + 1;
+
+    save_state_data* tmp = r->current;
+    r->current           = r->next;
+    r->next              = tmp;
+    return true;
+}
+
+uint32_t noose::step_rewind(rewind_buffer* r, machine* m, uint32_t frame_count)
+{
+    if (frame_count > r->count)
+    {
+        frame_count = r->count;
+    }
+
+    if (frame_count == 0)
+    {
+        return 0;
+    }
+
+    // Find the entry to restore, and the keyframe closest above it
+    uint32_t newest            = get_entry_before(r, r->head);
+    uint32_t target            = newest;
+    uint32_t keyframe          = NO_ENTRY;
+    uint32_t keyframe_distance = 0;
+
+    for (uint32_t i = 0; ; ++i)
+    {
+        if (get_entry(r, target)->flags & ENTRY_KEYFRAME)
+        {
+            keyframe          = target;
+            keyframe_distance = frame_count - 1 - i;
+        }
+
+        if (i == frame_count - 1)
+        {
+            break;
+        }
+        target = get_entry_before(r, target);
+    }
+
+    // Decode into the scratch state so a failed load leaves everything as is.
+    // Restoring just the newest frame needs no decoding at all.
+    uint8_t* state = (uint8_t*) r->current;
+    uint32_t from  = newest;
+    uint32_t steps = frame_count - 1;
+
+    if (keyframe != NO_ENTRY && keyframe_distance < steps)
+    {
+        const entry_header* h = get_entry(r, keyframe);
+
+        state = (uint8_t*) r->next;
+        memset(state, 0, STATE_SIZE);
+        apply_xor(state, (const uint8_t*) (h + 1) + h->delta_size, h->full_size);
+
+        from  = keyframe;
+        steps = keyframe_distance;
+    }
+    else if (steps)
+    {
+        state = (uint8_t*) r->next;
+        memcpy(state, r->current, STATE_SIZE);
+    }
+
+    for (uint32_t i = 0; i < steps; ++i)
+    {
+        const entry_header* h = get_entry(r, from);
+        apply_xor(state, (const uint8_t*) (h + 1), h->delta_size);
+        from = get_entry_before(r, from);
+    }
+    assert(from == target);
+
+    if (!noose::load_state(m, state, STATE_SIZE))
+    {
+        return 0;
+    }
+
+    if (state != (uint8_t*) r->current)
+    {
+        save_state_data* tmp = r->current;
+        r->current           = r->next;
+        r->next              = tmp;
+    }
+
+    // The restored frame is handed out, step the decoded state past it too
+    const entry_header* h = get_entry(r, target);
+    apply_xor((uint8_t*) r->current, (const uint8_t*) (h + 1), h->delta_size);
+
+    for (uint32_t i = 0; i < frame_count; ++i)
+    {
+        drop_newest(r);
+    }
+
+    r->since_keyframe = count_since_keyframe(r);
+    return frame_count;
+}
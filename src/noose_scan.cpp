@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "noose.h"
+
+#include "noose_internal.h"
+
+/*
+Bulk header scanner. The directory tree is collected up front, then a pool
+of workers pulls paths off a shared counter, reads the 16 byte header with
+a single pread (PRG/CHR are mapped only when hashing is requested) and
+formats one row into a per-worker buffer. Buffers are written out under a
+lock whenever they fill up, so rows stream out in completion order.
+*/
+
+static const uint32_t SCAN_ROW_SIZE    = 1024;
+static const uint32_t SCAN_BUFFER_SIZE = 64 * 1024;
+
+struct s_scan_job
+{
+    char**             paths;
+    uint32_t           path_count;
+    uint32_t           path_capacity;
+    volatile uint32_t  next_path;
+    noose::scan_format format;
+    bool               hash;
+    pthread_mutex_t    output_lock;
+};
+
+struct s_scan_worker
+{
+    s_scan_job* job;
+    pthread_t   thread;
+    char        buffer[SCAN_BUFFER_SIZE];
+    uint32_t    buffer_used;
+};
+
+static uint32_t crc32_table[256];
+
+static void crc32_initialize()
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+        {
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc32_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t* data, uint32_t size)
+{
+    uint32_t c = 0xffffffff;
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        c = crc32_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+}
+
+static bool has_rom_extension(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".nes") == 0;
+}
+
+static void add_path(s_scan_job* job, const char* path)
+{
+    if (job->path_count == job->path_capacity)
+    {
+        job->path_capacity = job->path_capacity ? job->path_capacity * 2 : 1024;
+        job->paths         = (char**) realloc(job->paths, job->path_capacity * sizeof(char*));
+    }
+
+    job->paths[job->path_count++] = strdup(path);
+}
+
+static void collect_paths(s_scan_job* job, const char* dir_path)
+{
+    DIR* dir = opendir(dir_path);
+    if (!dir)
+    {
+        return;
+    }
+
+    char path[4096];
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir)
+        {
+            collect_paths(job, path);
+        }
+        else if (has_rom_extension(entry->d_name))
+        {
+            add_path(job, path);
+        }
+    }
+
+    closedir(dir);
+}
+
+static void flush_worker(s_scan_worker* worker)
+{
+    if (worker->buffer_used == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&worker->job->output_lock);
+    fwrite(worker->buffer, 1, worker->buffer_used, stdout);
+    pthread_mutex_unlock(&worker->job->output_lock);
+
+    worker->buffer_used = 0;
+}
+
+// Quotes for CSV or escapes for JSON, depending on the output format
+static uint32_t write_path(char* out, uint32_t out_size, const char* path, noose::scan_format format)
+{
+    uint32_t n = 0;
+    out[n++]   = '"';
+
+    for (const char* c = path; *c && n + 8 < out_size; ++c)
+    {
+        if (format == noose::SCAN_FORMAT_CSV)
+        {
+            if (*c == '"')
+            {
+                out[n++] = '"';
+            }
+            out[n++] = *c;
+        }
+        else if (*c == '"' || *c == '\\')
+        {
+            out[n++] = '\\';
+            out[n++] = *c;
+        }
+        else if ((uint8_t) *c < 0x20)
+        {
+            n += sprintf(&out[n], "\\u%04x", (uint8_t) *c);
+        }
+        else
+        {
+            out[n++] = *c;
+        }
+    }
+
+    out[n++] = '"';
+    out[n]   = '\0';
+    return n;
+}
+
+static void scan_file(s_scan_worker* worker, const char* path)
+{
+    s_scan_job* job = worker->job;
+
+    if (SCAN_BUFFER_SIZE - worker->buffer_used < SCAN_ROW_SIZE)
+    {
+        flush_worker(worker);
+    }
+
+    char     path_str[SCAN_ROW_SIZE / 2];
+    char*    row      = &worker->buffer[worker->buffer_used];
+    uint32_t row_size = 0;
+
+    write_path(path_str, sizeof(path_str), path, job->format);
+
+    noose::header header;
+    struct stat   st;
+    int fd = open(path, O_RDONLY);
+
+    bool valid = fd >= 0 &&
+        fstat(fd, &st) == 0 &&
+        pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, "NES\x1a", 4) == 0;
+
+    if (!valid)
+    {
+        if (job->format == noose::SCAN_FORMAT_CSV)
+        {
+            row_size = sprintf(row, "%s,0,,,,,,,,,\n", path_str);
+        }
+        else
+        {
+            row_size = sprintf(row, "{\"path\":%s,\"valid\":false}\n", path_str);
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        worker->buffer_used += row_size;
+        return;
+    }
+
+    noose::header_info info = noose::decode_header(header);
+
+    bool     nes_2_0  = info.nes_2_0;
+    uint16_t mapper   = info.mapper_id;
+    uint32_t size_prg = info.size_prg;
+    uint32_t size_chr = info.size_chr;
+
+    const char* mirroring = noose::header::ignore_mirror_control(header) ? "four_screen" :
+        noose::header::nametable_mirroring_mode(header) ? "vertical" : "horizontal";
+
+    char hash_prg[16] = "";
+    char hash_chr[16] = "";
+
+    if (job->hash)
+    {
+        uint32_t offset = sizeof(header) + (noose::header::has_trainer_data(header) ? 512 : 0);
+
+        if ((uint64_t) offset + size_prg + size_chr <= (uint64_t) st.st_size)
+        {
+            void* mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem != MAP_FAILED)
+            {
+                const uint8_t* data = (const uint8_t*) mem + offset;
+                sprintf(hash_prg, "%08x", crc32(data, size_prg));
+                if (size_chr > 0)
+                {
+                    sprintf(hash_chr, "%08x", crc32(data + size_prg, size_chr));
+                }
+                munmap(mem, st.st_size);
+            }
+        }
+    }
+
+    close(fd);
+
+    if (job->format == noose::SCAN_FORMAT_CSV)
+    {
+        row_size = sprintf(row, "%s,1,%u,%s,%u,%u,%u,%u,%u,%s,%s\n",
+            path_str, mapper, mirroring,
+            noose::header::battery_backed_prg(header),
+            noose::header::has_trainer_data(header),
+            size_prg, size_chr, nes_2_0, hash_prg, hash_chr);
+    }
+    else
+    {
+        row_size = sprintf(row,
+            "{\"path\":%s,\"valid\":true,\"mapper\":%u,\"mirroring\":\"%s\",\"battery\":%s,\"trainer\":%s,"
+            "\"prg_size\":%u,\"chr_size\":%u,\"nes_2_0\":%s,\"prg_crc32\":\"%s\",\"chr_crc32\":\"%s\"}\n",
+            path_str, mapper, mirroring,
+            noose::header::battery_backed_prg(header) ? "true" : "false",
+            noose::header::has_trainer_data(header) ? "true" : "false",
+            size_prg, size_chr, nes_2_0 ? "true" : "false", hash_prg, hash_chr);
+    }
+
+    worker->buffer_used += row_size;
+}
+
+static void* scan_worker_main(void* arg)
+{
+    s_scan_worker* worker = (s_scan_worker*) arg;
+    s_scan_job*    job    = worker->job;
+
+    while(true)
+    {
+        uint32_t index = __sync_fetch_and_add(&job->next_path, 1);
+        if (index >= job->path_count)
+        {
+            break;
+        }
+
+        scan_file(worker, job->paths[index]);
+    }
+
+    flush_worker(worker);
+    return 0;
+}
+
+bool noose::scan_roms(const char* dir_path, noose::scan_format format, bool hash, uint32_t thread_count)
+{
+    s_scan_job job = {};
+    job.format     = format;
+    job.hash       = hash;
+
+    DIR* dir = opendir(dir_path);
+    if (!dir)
+    {
+        noose::error("Unable to open scan directory");
+        return false;
+    }
+    closedir(dir);
+
+    collect_paths(&job, dir_path);
+    crc32_initialize();
+
+    if (thread_count == 0)
+    {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count   = cpu_count > 0 ? (uint32_t) cpu_count : 1;
+    }
+
+    if (thread_count > job.path_count)
+    {
+        thread_count = job.path_count > 0 ? job.path_count : 1;
+    }
+
+    if (format == noose::SCAN_FORMAT_CSV)
+    {
+        printf("path,valid,mapper,mirroring,battery,trainer,prg_size,chr_size,nes_2_0,prg_crc32,chr_crc32\n");
+    }
+
+    pthread_mutex_init(&job.output_lock, 0);
+
+    s_scan_worker* workers = (s_scan_worker*) malloc(thread_count * sizeof(s_scan_worker));
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        workers[i].job         = &job;
+        workers[i].buffer_used = 0;
+        pthread_create(&workers[i].thread, 0, scan_worker_main, &workers[i]);
+    }
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        pthread_join(workers[i].thread, 0);
+    }
+
+    fflush(stdout);
+    pthread_mutex_destroy(&job.output_lock);
+
+    for (uint32_t i = 0; i < job.path_count; ++i)
+    {
+        free(job.paths[i]);
+    }
+
+    free(job.paths);
+    free(workers);
+
+    return true;
+}
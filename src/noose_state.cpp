@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Save states. A state is a save_state_data copied field by field out of the
+machine, so taking or restoring one is a few memcpys of at most a few kb
+each. Derived data isn't stored. On load the PRG/CHR windows are rebuilt
+from the mapper registers, the CHR RAM tile cache is decoded again, and
+blocks cached from RAM are dropped. The frame buffer and pending audio are
+output, not state, and are left alone.
+*/
+
+uint32_t noose::get_state_size()
+{
+    return sizeof(save_state_data);
+}
+
+bool noose::save_state(const noose::machine* m, void* out, uint32_t size)
+{
+    if (size < sizeof(save_state_data))
+    {
+        noose::error("Save state buffer too small");
+        return false;
+    }
+
+    save_state_data* s = (save_state_data*) out;
+
+    // Padding between fields too, so equal states are equal bytes for hashing and rewind deltas
+    memset(s, 0, sizeof(save_state_data));
+
+    s->magic    = STATE_MAGIC;
+    s->version  = STATE_VERSION;
+    s->size     = sizeof(save_state_data);
+    s->prg_size = m->prg_size;
+    s->chr_size = m->chr_size;
+
+    s->a            = m->a;
+    s->x            = m->x;
+    s->y            = m->y;
+    s->p            = cpu::get_status(m);
+    s->sp           = m->sp;
+    s->pc           = m->pc;
+    s->address_temp = m->address_temp;
+    s->cycles       = m->cycles;
+    memcpy(s->ram, m->ram, sizeof(s->ram));
+
+    s->mapper_state = m->mapper_state;
+    memcpy(s->prg_ram, m->prg_ram, sizeof(s->prg_ram));
+    memcpy(s->chr_ram, m->chr_ram, sizeof(s->chr_ram));
+
+    s->ppu_state  = m->ppu_state;
+    s->ppu_cycles = m->ppu_cycles;
+
+    s->apu_state  = m->apu_state;
+    s->apu_cycles = m->apu_cycles;
+
+    memcpy(s->event_heap, m->event_heap, sizeof(s->event_heap));
+    s->event_count      = m->event_count;
+    s->next_event_cycle = m->next_event_cycle;
+
+    memcpy(s->pad_buttons, m->pad_buttons, sizeof(s->pad_buttons));
+    memcpy(s->pad_shift, m->pad_shift, sizeof(s->pad_shift));
+    s->pad_strobe = m->pad_strobe;
+
+    return true;
+}
+
+bool noose::load_state(noose::machine* m, const void* state, uint32_t size)
+{
+    const save_state_data* s = (const save_state_data*) state;
+
+    if (size < sizeof(save_state_data) || s->magic != STATE_MAGIC || s->size != sizeof(save_state_data))
+    {
+        noose::error("Not a save state");
+        return false;
+    }
+
+    if (s->version != STATE_VERSION)
+    {
+        noose::error("Save state version mismatch");
+        return false;
+    }
+
+    if (s->prg_size != m->prg_size || s->chr_size != m->chr_size || s->mapper_state.id != m->mapper_state.id)
+    {
+        noose::error("Save state is from a different ROM");
+        return false;
+    }
+
+    m->a            = s->a;
+    m->x            = s->x;
+    m->y            = s->y;
+    cpu::set_status(m, s->p);
+    m->sp           = s->sp;
+    m->pc           = s->pc;
+    m->address_temp = s->address_temp;
+    m->cycles       = s->cycles;
+    memcpy(m->ram, s->ram, sizeof(m->ram));
+
+    m->mapper_state = s->mapper_state;
+    memcpy(m->prg_ram, s->prg_ram, sizeof(m->prg_ram));
+    memcpy(m->chr_ram, s->chr_ram, sizeof(m->chr_ram));
+
+    m->ppu_state  = s->ppu_state;
+    m->ppu_cycles = s->ppu_cycles;
+
+    m->apu_state  = s->apu_state;
+    m->apu_cycles = s->apu_cycles;
+
+    memcpy(m->event_heap, s->event_heap, sizeof(m->event_heap));
+    m->event_count      = s->event_count;
+    m->next_event_cycle = s->next_event_cycle;
+
+    memcpy(m->pad_buttons, s->pad_buttons, sizeof(m->pad_buttons));
+    memcpy(m->pad_shift, s->pad_shift, sizeof(m->pad_shift));
+    m->pad_strobe = s->pad_strobe;
+
+    mapper::apply_banks(m);
+
+    if (m->chr_writable)
+    {
+        ppu::decode_tiles(m->chr_ram, sizeof(m->chr_ram), m->chr_ram_tiles);
+    }
+
+    // Code in ROM is keyed by bank and stays valid, RAM may hold anything now
+    for (uint32_t page = 0; page < 0x80; ++page)
+    {
+        if (m->block_code_pages[page])
+        {
+            cpu::invalidate_blocks(m, page << 8);
+        }
+    }
+
+    apu::restart_output(m);
+    return true;
+}
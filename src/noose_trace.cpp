@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "noose_internal.h"
+
+using namespace noose;
+
+/*
+Instruction trace. While tracing, every instruction appends a 16 byte
+trace_entry to a ring of the most recent ones, overwriting the oldest; no
+formatting happens while the emulator runs. The ring and its header live in
+one mapping, either anonymous or a shared mapping of a file. With a file
+the kernel owns the pages, so the last instructions before a crash are
+still on disk afterwards.
+
+format_trace renders a trace file offline, either in the nestest log
+layout (which -verify can read back) or as JSON lines. Memory values and
+the PPU position aren't recorded, so those columns are left out. Operands
+behind a read handler aren't read either, a handler read could have side
+effects, so they're flagged as unknown and printed as ??.
+*/
+
+static const uint32_t TRACE_MAX_ENTRIES = 1u << 28;
+
+static inline uint8_t peek(const machine* m, uint16_t addr, uint64_t unknown_bit, uint64_t* flags)
+{
+    const cpu::page& pg = m->page_table[addr >> 8];
+    if (!pg.read)
+    {
+        *flags |= unknown_bit;
+        return 0;
+    }
+    return pg.read[addr & 0xff];
+}
+
+void trace::record(machine* m, uint8_t opcode)
+{
+    trace_entry& e = m->trace_entries[m->trace->count++ & m->trace_mask];
+
+    uint64_t flags = 0;
+
+    e.opcode      = opcode;
+    e.operands[0] = peek(m, m->pc + 1, TRACE_OPERAND_UNKNOWN_0, &flags);
+    e.operands[1] = peek(m, m->pc + 2, TRACE_OPERAND_UNKNOWN_1, &flags);
+    e.cycle_pc    = flags | (((m->cycles << 16) | m->pc) & TRACE_CYCLE_PC_MASK);
+    e.a           = m->a;
+    e.x           = m->x;
+    e.y           = m->y;
+    e.p           = cpu::get_status(m);
+    e.sp          = m->sp;
+}
+
+bool noose::start_trace(noose::machine* m, uint32_t entry_count, const char* path)
+{
+    noose::stop_trace(m);
+
+    // 2^28 entries are 4 GB already, and larger counts would overflow below
+    if (entry_count > TRACE_MAX_ENTRIES)
+    {
+        noose::error("Too many trace entries");
+        return false;
+    }
+
+    uint32_t capacity = 1;
+    while(capacity < entry_count)
+    {
+        capacity <<= 1;
+    }
+
+    size_t size = sizeof(trace_header) + (size_t) capacity * sizeof(trace_entry);
+    void*  mem  = MAP_FAILED;
+
+    if (path)
+    {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            noose::error("Unable to open trace file");
+            return false;
+        }
+
+        if (ftruncate(fd, size) == 0)
+        {
+            mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        // The mapping keeps the file alive
+        close(fd);
+    }
+    else
+    {
+        mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (mem == MAP_FAILED)
+    {
+        noose::error("Unable to map trace ring");
+        return false;
+    }
+
+    trace_header* h = (trace_header*) mem;
+    h->magic        = TRACE_MAGIC;
+    h->version      = TRACE_VERSION;
+    h->entry_size   = sizeof(trace_entry);
+    h->capacity     = capacity;
+    h->count        = 0;
+
+    m->trace              = h;
+    m->trace_entries      = (trace_entry*) (h + 1);
+    m->trace_mask         = capacity - 1;
+    m->trace_mapping_size = size;
+
+    // Compiled blocks are built with or without the trace calls
+    cpu::invalidate_blocks(m);
+    return true;
+}
+
+void noose::stop_trace(noose::machine* m)
+{
+    if (!m->trace)
+    {
+        return;
+    }
+
+    munmap(m->trace, m->trace_mapping_size);
+
+    m->trace              = 0;
+    m->trace_entries      = 0;
+    m->trace_mask         = 0;
+    m->trace_mapping_size = 0;
+
+    cpu::invalidate_blocks(m);
+}
+
+bool noose::save_trace(const noose::machine* m, const char* path)
+{
+    if (!m->trace)
+    {
+        noose::error("Not tracing");
+        return false;
+    }
+
+    FILE* f = fopen(path, "wb");
+    if (!f)
+    {
+        noose::error("Unable to open trace file for writing");
+        return false;
+    }
+
+    bool ok = fwrite(m->trace, m->trace_mapping_size, 1, f) == 1;
+    fclose(f);
+
+    if (!ok)
+    {
+        noose::error("Unable to write trace file");
+    }
+    return ok;
+}
+
+// Operands the way nestest prints them, without the memory values
+static void format_operands(const trace_entry& e, uint16_t pc, char* out)
+{
+    const cpu::instruction& inst = cpu::get_decoded_instruction(e.opcode);
+    uint16_t                word = e.operands[0] | (e.operands[1] << 8);
+
+    uint64_t unknown = inst.length > 2 ? TRACE_OPERAND_UNKNOWN_0 | TRACE_OPERAND_UNKNOWN_1 : TRACE_OPERAND_UNKNOWN_0;
+    if (inst.length > 1 && (e.cycle_pc & unknown))
+    {
+        strcpy(out, " ??");
+        return;
+    }
+
+    // Branches are xxy10000 and show their target
+    if ((e.opcode & 0x1f) == 0x10)
+    {
+        sprintf(out, " $%04X", (uint16_t) (pc + 2 + (int8_t) e.operands[0]));
+        return;
+    }
+
+    if (e.opcode == 0x20 || e.opcode == 0x4c)
+    {
+        sprintf(out, " $%04X", word);
+        return;
+    }
+
+    if (e.opcode == 0x6c)
+    {
+        sprintf(out, " ($%04X)", word);
+        return;
+    }
+
+    switch(inst.length > 1 ? inst.address_mode : cpu::MODE_IMPLIED)
+    {
+        case cpu::MODE_ACCUMULATOR:        strcpy(out, " A");                                break;
+        case cpu::MODE_IMMEDIATE:          sprintf(out, " #$%02X", e.operands[0]);            break;
+        case cpu::MODE_ZEROPAGE:           sprintf(out, " $%02X", e.operands[0]);             break;
+        case cpu::MODE_ZEROPAGE_X_INDEXED: sprintf(out, " $%02X,X", e.operands[0]);           break;
+        case cpu::MODE_ZEROPAGE_Y_INDEXED: sprintf(out, " $%02X,Y", e.operands[0]);           break;
+        case cpu::MODE_ABSOLUTE:           sprintf(out, " $%04X", word);                      break;
+        case cpu::MODE_ABSOLUTE_X_INDEXED: sprintf(out, " $%04X,X", word);                    break;
+        case cpu::MODE_ABSOLUTE_y_INDEXED: sprintf(out, " $%04X,Y", word);                    break;
+        case cpu::MODE_X_INDEXED_INDIRECT: sprintf(out, " ($%02X,X)", e.operands[0]);         break;
+        case cpu::MODE_INDIRECT_Y_INDEXED: sprintf(out, " ($%02X),Y", e.operands[0]);         break;
+        default:                           out[0] = '\0';                                     break;
+    }
+}
+
+static void print_entry(const trace_entry& e, noose::trace_format format)
+{
+    const cpu::instruction& inst  = cpu::get_decoded_instruction(e.opcode);
+    uint16_t                pc    = (uint16_t) e.cycle_pc;
+    unsigned long long      cycle = (e.cycle_pc & TRACE_CYCLE_PC_MASK) >> 16;
+
+    char operand_0[3] = "??";
+    char operand_1[3] = "??";
+    if (!(e.cycle_pc & TRACE_OPERAND_UNKNOWN_0)) sprintf(operand_0, "%02X", e.operands[0]);
+    if (!(e.cycle_pc & TRACE_OPERAND_UNKNOWN_1)) sprintf(operand_1, "%02X", e.operands[1]);
+
+    char bytes[16];
+    switch(inst.length)
+    {
+        case 2:  sprintf(bytes, "%02X %s", e.opcode, operand_0);               break;
+        case 3:  sprintf(bytes, "%02X %s %s", e.opcode, operand_0, operand_1); break;
+        default: sprintf(bytes, "%02X", e.opcode);                             break;
+    }
+
+    char operands[16];
+    char disassembly[32];
+    format_operands(e, pc, operands);
+    snprintf(disassembly, sizeof(disassembly), "%s%s", cpu::get_instruction_meta(inst).name, operands);
+
+    if (format == noose::TRACE_FORMAT_JSON)
+    {
+        printf("{\"pc\":%u,\"bytes\":\"%s\",\"asm\":\"%s\",\"a\":%u,\"x\":%u,\"y\":%u,\"p\":%u,\"sp\":%u,\"cycle\":%llu}\n",
+            pc, bytes, disassembly, e.a, e.x, e.y, e.p, e.sp, cycle);
+    }
+    else
+    {
+        printf("%04X  %-10s%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n",
+            pc, bytes, disassembly, e.a, e.x, e.y, e.p, e.sp, cycle);
+    }
+}
+
+bool noose::format_trace(const char* path, noose::trace_format format, uint32_t last_count)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        noose::error("Unable to open trace file");
+        return false;
+    }
+
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(trace_header))
+    {
+        mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        noose::error("Not a trace file");
+        return false;
+    }
+
+    const trace_header* h = (const trace_header*) mem;
+    bool valid = h->magic == TRACE_MAGIC && h->version == TRACE_VERSION &&
+        h->entry_size == sizeof(trace_entry) && h->capacity && (h->capacity & (h->capacity - 1)) == 0 &&
+        sizeof(trace_header) + (size_t) h->capacity * sizeof(trace_entry) <= (size_t) st.st_size;
+
+    if (!valid)
+    {
+        noose::error("Not a trace file");
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    cpu::initialize_tables();
+
+    // Oldest first, of whatever the ring still holds
+    const trace_entry* entries = (const trace_entry*) (h + 1);
+    uint64_t           count   = h->count < h->capacity ? h->count : h->capacity;
+
+    if (last_count && last_count < count)
+    {
+        count = last_count;
+    }
+
+    for (uint64_t i = h->count - count; i < h->count; ++i)
+    {
+        print_entry(entries[i & (h->capacity - 1)], format);
+    }
+
+    munmap(mem, st.st_size);
+    return true;
+}
+
+bool noose::record_trace(const noose::rom* rom, const char* path, uint32_t frame_count, uint32_t entry_count)
+{
+    noose::machine* m = noose::create_machine(rom);
+    if (!m)
+    {
+        return false;
+    }
+
+    if (!noose::start_trace(m, entry_count, path))
+    {
+        noose::destroy_machine(m);
+        return false;
+    }
+
+    noose::set_audio_rate(m, 0);
+
+    for (uint32_t i = 0; i < frame_count; ++i)
+    {
+        noose::run_until_frame(m);
+    }
+
+    uint64_t kept = m->trace->count < m->trace->capacity ? m->trace->count : m->trace->capacity;
+    printf("Traced %llu instructions over %u frames, the last %llu are in %s\n",
+        (unsigned long long) m->trace->count, frame_count, (unsigned long long) kept, path);
+
+    noose::destroy_machine(m);
+    return true;
+}